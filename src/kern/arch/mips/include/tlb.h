@@ -53,20 +53,27 @@
  *        is not set. To completely invalidate the TLB, load it with
  *        translations for addresses in one of the unmapped address
  *        ranges - these will never be matched.
+ *
+ *   tlb_setasid: load ENTRYHI without touching the TLB. Only its PID
+ *        field matters: the processor matches user accesses against
+ *        entries with that PID. tlb_write, tlb_read, and tlb_probe
+ *        all leave their own value in ENTRYHI, so the current PID
+ *        must be put back after using them.
  */
 
 void tlb_random(uint32_t entryhi, uint32_t entrylo);
 void tlb_write(uint32_t entryhi, uint32_t entrylo, uint32_t index);
 void tlb_read(uint32_t *entryhi, uint32_t *entrylo, uint32_t index);
 int tlb_probe(uint32_t entryhi, uint32_t entrylo);
+void tlb_setasid(uint32_t entryhi);
 
 /*
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
- * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
- * bits that aren't assigned a meaning.
+ * Note that the MIPS has support for a 6-bit address space ID, in
+ * TLBHI_PID. An entry only matches when its PID equals the one in
+ * ENTRYHI, unless TLBLO_GLOBAL is set. TLBLO_GLOBAL can be left
+ * always zero, as can the bits that aren't assigned a meaning.
  *
  * The TLBLO_DIRTY bit is actually a write privilege bit - it is not
  * ever set by the processor. If you set it, writes are permitted. If
@@ -78,7 +85,8 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PIDSHIFT 6
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
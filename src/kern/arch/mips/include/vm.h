@@ -66,6 +66,7 @@
  * a valid address, and will make a *huge* mess if you scribble on it.
  */
 #define PADDR_TO_KVADDR(paddr) ((paddr)+MIPS_KSEG0)
+#define KVADDR_TO_PADDR(vaddr) ((vaddr)-MIPS_KSEG0)
 
 /*
  * The top of user space. (Actually, the address immediately above the
@@ -116,11 +117,13 @@ paddr_t ram_getfirstfree(void);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+struct addrspace;
+struct semaphore;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;	/* whose mapping */
+	vaddr_t ts_vaddr;		/* page to drop from the TLB */
+	struct semaphore *ts_done;	/* V'd once it is gone */
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -104,6 +104,7 @@ syscall(struct trapframe *tf)
 
 	__i64 int64_retval;
 	int usrarg1;
+	off_t usroffset;
 
 	switch (callno) {
 		case SYS_fork:
@@ -131,6 +132,42 @@ syscall(struct trapframe *tf)
 					 (userptr_t)tf->tf_a1);
 			break;
 
+		case SYS_sbrk:
+			err = sys_sbrk((intptr_t)tf->tf_a0,
+				       (vaddr_t *)&retval);
+			break;
+
+		case SYS_mmap:
+			/* fd and the 64-bit offset are on the stack. */
+			err = copyin((const_userptr_t)(tf->tf_sp + 16),
+				     &usrarg1, sizeof(usrarg1));
+			if (err) {
+				break;
+			}
+			err = copyin((const_userptr_t)(tf->tf_sp + 24),
+				     &usroffset, sizeof(usroffset));
+			if (err) {
+				break;
+			}
+			err = sys_mmap((vaddr_t)tf->tf_a0,
+				       (size_t)tf->tf_a1,
+				       (int)tf->tf_a2,
+				       (int)tf->tf_a3,
+				       usrarg1, usroffset,
+				       (vaddr_t *)&retval);
+			break;
+
+		case SYS_munmap:
+			err = sys_munmap((vaddr_t)tf->tf_a0,
+					 (size_t)tf->tf_a1);
+			break;
+
+		case SYS_msync:
+			err = sys_msync((vaddr_t)tf->tf_a0,
+					(size_t)tf->tf_a1,
+					(int)tf->tf_a2);
+			break;
+
 		/* Add stuff here */
 		case SYS_open:
 			err = sys_open((const char *)tf->tf_a0,
@@ -37,6 +37,8 @@
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <uio.h>
+#include <vnode.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -103,6 +105,57 @@ free_kpages(vaddr_t addr)
 	(void)addr;
 }
 
+void
+frame_cache_init(struct frame_cache *fc, unsigned cpunum)
+{
+	/* dumbvm doesn't cache frames. */
+
+	(void)fc;
+	(void)cpunum;
+}
+
+void
+frame_set_kmalloc_ref(vaddr_t kpage, void *ref)
+{
+	/* dumbvm has no frame table to keep it in. */
+
+	(void)kpage;
+	(void)ref;
+}
+
+void *
+frame_kmalloc_ref(vaddr_t kaddr)
+{
+	/* So every kfree takes kmalloc's slow path. */
+
+	(void)kaddr;
+	return NULL;
+}
+
+void
+vm_asid_init(struct cpu_asids *ca)
+{
+	/* dumbvm flushes the TLB instead. */
+
+	(void)ca;
+}
+
+void
+vm_tlb_init(struct cpu_tlb *ct, unsigned cpunum)
+{
+	/* dumbvm keeps no TLB statistics. */
+
+	(void)ct;
+	(void)cpunum;
+}
+
+bool
+frame_prezero(void)
+{
+	/* dumbvm has no zeroed page pool. */
+	return false;
+}
+
 void
 vm_tlbshootdown_all(void)
 {
@@ -344,6 +397,40 @@ as_prepare_load(struct addrspace *as)
 	return 0;
 }
 
+/*
+ * dumbvm has no demand paging: read the segment into the memory
+ * as_prepare_load set aside, right away. The rest of it is already
+ * zero.
+ */
+int
+as_define_segment(struct addrspace *as, struct vnode *v,
+		  off_t offset, vaddr_t vaddr, size_t memsz, size_t filesz)
+{
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	iov.iov_ubase = (userptr_t)vaddr;
+	iov.iov_len = memsz;
+	u.uio_iov = &iov;
+	u.uio_iovcnt = 1;
+	u.uio_resid = filesz;
+	u.uio_offset = offset;
+	u.uio_segflg = UIO_USERSPACE;
+	u.uio_rw = UIO_READ;
+	u.uio_space = as;
+
+	result = VOP_READ(v, &u);
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		kprintf("ELF: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+	return 0;
+}
+
 int
 as_complete_load(struct addrspace *as)
 {
@@ -351,6 +438,52 @@ as_complete_load(struct addrspace *as)
 	return 0;
 }
 
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	/* dumbvm has no heap. */
+
+	(void)as;
+	(void)amount;
+	(void)oldbreak;
+	return ENOSYS;
+}
+
+int
+as_mmap(struct addrspace *as, struct vnode *v, off_t offset, size_t npages,
+	int prot, bool shared, vaddr_t *ret)
+{
+	/* dumbvm can't map files. */
+
+	(void)as;
+	(void)v;
+	(void)offset;
+	(void)npages;
+	(void)prot;
+	(void)shared;
+	(void)ret;
+	return ENOSYS;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t npages)
+{
+	(void)as;
+	(void)vaddr;
+	(void)npages;
+	return EINVAL;
+}
+
+int
+as_msync(struct addrspace *as, vaddr_t vaddr, size_t npages, bool sync)
+{
+	(void)as;
+	(void)vaddr;
+	(void)npages;
+	(void)sync;
+	return ENOMEM;
+}
+
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
@@ -845,13 +845,16 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 
 /*
  * VOP_MMAP
+ *
+ * Any file can be mapped; the VM system pages it in and out with
+ * emufs_read and emufs_write.
  */
 static
 int
 emufs_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 //////////////////////////////
@@ -231,14 +231,15 @@ sfs_fsync(struct vnode *v)
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Any file can be mapped; the VM system pages it
+ * in and out with sfs_read and sfs_write.
  */
 static
 int
 sfs_mmap(struct vnode *v   /* add stuff as needed */)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 /*
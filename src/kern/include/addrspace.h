@@ -36,17 +36,73 @@
 
 
 #include <vm.h>
+#include <pagetable.h>
+#include <platform/maxcpus.h>
 #include "opt-dumbvm.h"
 
-#define PAGE_TABLE_SIZE 1024
-#define PT1_INDEX(vaddr) (vaddr >> 22)
-#define PT2_INDEX(vaddr) (vaddr << 10 >> 22)
-#define PT_OFFSET(vaddr) (vaddr << 20 >> 20)
-
 struct vnode;
 
-typedef paddr_t page_table_entry;
+/*
+ * A piece of the executable that backs part of the address space.
+ * Pages in [seg_vaddr, seg_vaddr + seg_memsz) are read from the file
+ * on first touch: the first seg_filesz bytes come from seg_offset
+ * onwards, the rest (bss) is zero.
+ */
+struct as_segment {
+        vaddr_t seg_vaddr;
+        off_t seg_offset;
+        size_t seg_filesz;
+        size_t seg_memsz;
+        bool seg_writeable;
+};
+
+/*
+ * Room kept for the stack below USERSTACK: mmap and sbrk place nothing
+ * there, nor next to pages the stack has already grown into. The stack
+ * itself is not limited to it, and may grow down until one guard page
+ * short of the highest mapping or, if there is none, the heap's break.
+ * Tunable; 8 MB by default.
+ */
+#define AS_STACKPAGES 2048
+
+/* Region permissions, as passed to as_define_region. */
+#define AS_PERM_READ    4
+#define AS_PERM_WRITE   2
+#define AS_PERM_EXEC    1
+
+/*
+ * A region defined by the executable: RG_NPAGES pages from RG_BASE,
+ * with RG_PERM a mask of AS_PERM_*. Regions do not overlap, and are
+ * kept sorted by address so that faults can find theirs by binary
+ * search. A page two segments share is a region of its own, with the
+ * permissions of both.
+ */
+struct as_region {
+        vaddr_t rg_base;
+        size_t rg_npages;
+        unsigned rg_perm;
+};
 
+struct textcache;
+struct pagecache;
+
+/*
+ * A file mapped with mmap: MM_NPAGES pages from MM_BASE on show the
+ * file from MM_OFFSET on. Pages are faulted in through MM_CACHE, the
+ * file's pagecache, so all mappings of a file share its frames.
+ * MM_PROT is a mask of PROT_READ, PROT_WRITE and PROT_EXEC. Mappings
+ * are kept in descending address order.
+ */
+struct as_mmap {
+        vaddr_t mm_base;
+        size_t mm_npages;
+        struct vnode *mm_vnode;
+        off_t mm_offset;
+        int mm_prot;
+        bool mm_shared;                 /* MAP_SHARED, else MAP_PRIVATE */
+        struct pagecache *mm_cache;
+        struct as_mmap *mm_next;
+};
 
 /*
  * Address space - data structure associated with the virtual memory
@@ -66,12 +122,47 @@ struct addrspace {
         paddr_t as_stackpbase;
 
 #else
-        /* Put stuff here for your VM system */
-        vaddr_t as_vbase1;
-        size_t as_npages1;
-        vaddr_t as_vbase2;
-        size_t as_npages2;
+        /* Regions from the executable, in address order */
+        struct as_region *as_regions;
+        unsigned as_nregions;
+#if OPT_HASHPT
+        unsigned as_ptentries;  /* entries in the hashed page table */
+#else
         page_table_entry **page_table;
+#endif
+
+        /* Demand-paged executable; as_vnode is NULL if there is none */
+        struct vnode *as_vnode;
+        struct as_segment *as_segments;
+        unsigned as_nsegments;
+
+        /*
+         * Heap, from as_heapbase up to the break as_heaptop (not page
+         * aligned). Pages are allocated when touched, as elsewhere.
+         */
+        vaddr_t as_heapbase;
+        vaddr_t as_heaptop;
+
+        /* Mapped files, between the heap and the stack */
+        struct as_mmap *as_mmaps;
+
+        /* Lowest page the stack has grown down to */
+        vaddr_t as_stackbase;
+
+        /* Read-only text shared with other runs of as_vnode, or NULL */
+        struct textcache *as_text;
+
+        /* Pages in transit to or from swap (vm.c); protected by vm_lock */
+        unsigned as_transit;
+
+        /* ASID on each cpu, see vm.h; protected by disabling interrupts */
+        uint32_t as_asid[MAXCPUS];
+
+        /* Fault-around stream detection (vm.c); protected by vm_lock */
+        vaddr_t as_fa_last;             /* page of the last fault */
+        vaddr_t as_fa_next;             /* page just past the mapped-ahead run */
+        int as_fa_dir;                  /* +1 up, -1 down */
+        unsigned as_fa_window;          /* pages to map ahead, 0 if none */
 
 #endif
 };
@@ -106,8 +197,53 @@ struct addrspace {
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
+ *    as_define_segment - record that part of a region is backed by
+ *                the executable V. Nothing is read until the pages
+ *                are touched; see as_fill_page.
+ *
+ *    as_fill_page - read the executable's contents for the page at
+ *                VADDR into the zeroed kernel page KPAGE.
+ *
+ *    as_page_is_anon - whether the page at VADDR has no contents from
+ *                the executable, i.e. starts out all zero.
+ *
+ *    as_shares_text - whether the page at VADDR is read-only text
+ *                shared through as_text.
+ *
+ *    as_region_bounds - find the region containing VADDR, and return
+ *                its extent as [*BASE, *TOP). Returns false if VADDR
+ *                is in no region.
+ *
+ *    as_stack_floor - the lowest address the stack may grow down to.
+ *
+ *    as_perm   - the access allowed to the page at VADDR, as a mask of
+ *                AS_PERM_*; 0 if VADDR is in no region (or a mapping
+ *                made with PROT_NONE).
+ *
  *    as_complete_load - this is called when loading from an executable
- *                is complete.
+ *                is complete. Places the (empty) heap just above the
+ *                highest region.
+ *
+ *    as_sbrk   - move the break by AMOUNT bytes, handing back the old
+ *                break in *OLDBREAK. Growing only moves the bound;
+ *                shrinking frees the pages no longer in the heap.
+ *
+ *    as_mmap   - map NPAGES pages of V from file offset OFFSET
+ *                (page aligned) at a free address, returned in
+ *                *RET. PROT and SHARED are as for struct as_mmap.
+ *
+ *    as_munmap - remove the mapping at VADDR, which must be NPAGES
+ *                long, writing back any pages written through it.
+ *
+ *    as_msync  - write back the pages written through the mapping
+ *                at [VADDR, VADDR + NPAGES pages), which must all be
+ *                in one mapping. If SYNC, also flush the file to disk.
+ *
+ *    as_mmap_lookup - the mapping containing VADDR, or NULL.
+ *
+ *    as_mmap_copy - give NEW the same mappings as OLD (for fork).
+ *
+ *    as_mmap_destroy - remove all of AS's mappings.
  *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
@@ -129,11 +265,32 @@ int               as_define_region(struct addrspace *as,
                                    int writeable,
                                    int executable);
 int               as_prepare_load(struct addrspace *as);
+int               as_define_segment(struct addrspace *as, struct vnode *v,
+                                    off_t offset, vaddr_t vaddr,
+                                    size_t memsz, size_t filesz);
+int               as_fill_page(struct addrspace *as, vaddr_t vaddr,
+                               vaddr_t kpage);
+bool              as_page_is_anon(struct addrspace *as, vaddr_t vaddr);
+bool              as_shares_text(struct addrspace *as, vaddr_t vaddr);
+bool              as_region_bounds(struct addrspace *as, vaddr_t vaddr,
+                                   vaddr_t *base, vaddr_t *top);
+vaddr_t           as_stack_floor(struct addrspace *as);
+unsigned          as_perm(struct addrspace *as, vaddr_t vaddr);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_mmap(struct addrspace *as, struct vnode *v,
+                          off_t offset, size_t npages, int prot,
+                          bool shared, vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr,
+                            size_t npages);
+int               as_msync(struct addrspace *as, vaddr_t vaddr,
+                           size_t npages, bool sync);
+struct as_mmap   *as_mmap_lookup(struct addrspace *as, vaddr_t vaddr);
+int               as_mmap_copy(struct addrspace *old, struct addrspace *new);
+void              as_mmap_destroy(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
-int               getppages(struct addrspace *as, vaddr_t vbase, size_t npage);
-
 /*
  * Functions in loadelf.c
  *    load_elf - load an ELF user program executable into the current
@@ -34,6 +34,7 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <vm.h>          /* for the per-cpu VM and kmalloc caches */
 
 
 /*
@@ -61,6 +62,10 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	struct frame_cache c_framecache; /* Free frames (interrupts off) */
+	struct kmalloc_cache c_kmcache;	/* kmalloc blocks (interrupts off) */
+	struct cpu_asids c_asids;	/* TLB ASIDs (interrupts off) */
+	struct cpu_tlb c_tlb;		/* TLB refills (interrupts off) */
 
 	/*
 	 * Accessed by other cpus.
@@ -153,6 +158,8 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_broadcast sends the same shootdown to all CPUs
+ * except the current one, and returns how many it sent.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -167,6 +174,7 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
@@ -0,0 +1,24 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Constants for mmap(), shared between the kernel and libc's
+ * <sys/mman.h>.
+ */
+
+/* Protection (may be or'd together) */
+#define PROT_NONE     0      /* No access */
+#define PROT_READ     1      /* Pages may be read */
+#define PROT_WRITE    2      /* Pages may be written */
+#define PROT_EXEC     4      /* Pages may be executed */
+
+/* Flags (exactly one of these) */
+#define MAP_SHARED    1      /* Writes go to the file, seen by others */
+#define MAP_PRIVATE   2      /* Writes are private copies */
+
+/* Flags for msync (exactly one of these) */
+#define MS_ASYNC      1      /* Start writing back */
+#define MS_SYNC       2      /* Write back and wait for the disk */
+
+
+#endif /* _KERN_MMAN_H_ */
@@ -125,10 +125,20 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ *
+ * kmalloc_blocksize says how much memory kmalloc(SIZE) really uses.
+ *
+ * kheap_reclaim gives back the empty pages kmalloc keeps in reserve;
+ * it returns true if there were any. kheap_drain first empties this
+ * cpu's magazines into them, so it gives back everything kmalloc is
+ * keeping that could be freed.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
+size_t kmalloc_blocksize(size_t size);
 void kheap_printstats(void);
+bool kheap_reclaim(void);
+bool kheap_drain(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
@@ -0,0 +1,70 @@
+#ifndef _OBJCACHE_H_
+#define _OBJCACHE_H_
+
+/*
+ * Object caches: slab allocation of one kind of kernel object.
+ *
+ * A cache carves page-sized slabs into objects of one size and runs
+ * the constructor on each object once, when its slab is created. A
+ * freed object stays constructed, so allocating it again skips
+ * whatever the constructor does (creating locks and wait channels,
+ * initializing lists). The constructor's work is undone only when a
+ * slab is given back, and then by the destructor.
+ *
+ * So an object must be returned to its cache in the constructed
+ * state: locks released, lists empty, and so on.
+ *
+ * Caches are defined statically with OBJCACHE_INITIALIZER and never
+ * destroyed, which means they can be used before anything has been
+ * bootstrapped.
+ *
+ * objcache_alloc  - get a constructed object; NULL if out of memory or
+ *                   the constructor failed.
+ * objcache_free   - give an object back.
+ * objcache_reclaim
+ *                 - free every empty slab, even the ones caches keep.
+ * objcache_printstats
+ *                 - print each cache's counts and memory use.
+ *
+ * The constructor returns 0 or an errno value; the destructor may be
+ * NULL if there is nothing to undo. Both are called with no locks of
+ * the cache's held, and may allocate from other caches.
+ */
+
+#include <spinlock.h>
+
+struct objslab;
+
+struct objcache {
+	const char *oc_name;
+	size_t oc_size;			/* object size, rounded up */
+	int (*oc_ctor)(void *obj);
+	void (*oc_dtor)(void *obj);
+
+	struct spinlock oc_lock;
+	struct objslab *oc_partial;	/* slabs with free objects */
+	unsigned oc_perslab;		/* objects per slab */
+	unsigned oc_offset;		/* of the first object in a slab */
+	unsigned oc_nempty;		/* slabs with no objects in use */
+
+	/* Statistics */
+	unsigned oc_slabs;
+	unsigned oc_inuse;
+	unsigned oc_allocs;
+	unsigned oc_frees;
+	unsigned oc_grows;		/* slabs created */
+
+	struct objcache *oc_next;	/* all caches, for the stats */
+	bool oc_listed;
+};
+
+#define OBJCACHE_INITIALIZER(name, size, ctor, dtor) \
+	{ (name), ROUNDUP((size), 8), (ctor), (dtor), \
+	  SPINLOCK_INITIALIZER, NULL, 0, 0, 0, 0, 0, 0, 0, 0, NULL, false }
+
+void *objcache_alloc(struct objcache *oc);
+void objcache_free(struct objcache *oc, void *obj);
+void objcache_reclaim(void);
+void objcache_printstats(void);
+
+#endif /* _OBJCACHE_H_ */
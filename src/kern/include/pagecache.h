@@ -0,0 +1,56 @@
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * File pages for mmap.
+ *
+ * Every address space mapping a file attaches to the one pagecache
+ * for that file's vnode, which remembers the frame holding each page
+ * of the file that has been faulted in. Mappings of the same file,
+ * in any process, map the same frames: shared mappings write straight
+ * into them, and private ones take a copy-on-write copy first.
+ *
+ * Pages written through a shared mapping are marked dirty and written
+ * back to the file when a mapping of them goes away (see as_munmap),
+ * or on msync (see as_msync).
+ * A dirty page is only marked clean once no other address space maps
+ * it, so a page some other process can still write stays dirty.
+ *
+ * The cache holds a reference to each frame it remembers, so a mapped
+ * file page is never paged out to swap. A clean frame only the cache
+ * refers to is idle; pagecache_reclaim() frees one of those. The
+ * pagecache goes away when its last user detaches. Like textcache, it
+ * does not hold a reference to the vnode; each mapping does.
+ *
+ * pagecache_attach   - find or create the pagecache for V, making
+ *                      sure it covers the first NPAGES file pages.
+ * pagecache_detach   - drop an attachment. All dirty pages must have
+ *                      been written back by then.
+ * pagecache_lookup   - the frame cached for file page INDEX, with a new
+ *                      reference for the caller; 0 if none.
+ * pagecache_insert   - cache PADDR (owned by the caller) for INDEX.
+ * pagecache_dirty    - mark file page INDEX, which is cached, dirty.
+ * pagecache_clean    - if file page INDEX is dirty, return its frame
+ *                      with a new reference for the caller to write
+ *                      back, otherwise 0. MAPPED is the frame the
+ *                      caller maps at that page, or 0 if none.
+ *
+ * All of these except pagecache_printstats require vm_lock.
+ */
+
+struct vnode;
+struct pagecache;
+
+int pagecache_attach(struct vnode *v, unsigned npages,
+		     struct pagecache **ret);
+void pagecache_detach(struct pagecache *pc);
+paddr_t pagecache_lookup(struct pagecache *pc, unsigned index);
+void pagecache_insert(struct pagecache *pc, unsigned index, paddr_t paddr);
+void pagecache_dirty(struct pagecache *pc, unsigned index);
+paddr_t pagecache_clean(struct pagecache *pc, unsigned index, paddr_t mapped);
+bool pagecache_reclaim(void);
+
+/* Print page cache statistics (for the kernel menu) */
+void pagecache_printstats(void);
+
+#endif /* _PAGECACHE_H_ */
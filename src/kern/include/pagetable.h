@@ -0,0 +1,92 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+#include "opt-hashpt.h"
+
+/*
+ * Page tables. There are two implementations, picked at compile time.
+ *
+ * By default each address space has a two-level page table
+ * (vm/pagetable.c): a root table of PAGE_TABLE_SIZE pointers, each
+ * covering 4M of user address space, and second-level tables of
+ * PAGE_TABLE_SIZE entries that are only allocated once something in
+ * their 4M range is touched.
+ *
+ * With "options hashpt" there is instead one hashed page table for
+ * the whole system (vm/hashpt.c), with buckets sized from the number
+ * of frames at boot. Entries are keyed by address space and virtual
+ * page number, and exist only for pages that have been touched, so a
+ * sparse address space costs a small entry per page in use rather
+ * than a 4K table per 4M region. (The key is the address space itself
+ * rather than its ASID: ASIDs here are per cpu and change, see vm.h.)
+ *
+ * A page table entry holds the physical address of the page's frame
+ * in its upper bits and flags in the low bits. An entry for a page
+ * that has been paged out is not valid, has PTE_SWAPPED set, and
+ * holds the swap slot number in place of the frame address. While
+ * it is being written out or read back, without vm_lock, it also has
+ * PTE_BUSY set; see vm_evict_cluster and vm_swapin_cluster.
+ */
+
+#define PAGE_TABLE_SIZE 1024
+#define PT1_INDEX(vaddr) (vaddr >> 22)
+#define PT2_INDEX(vaddr) (vaddr << 10 >> 22)
+#define PT_OFFSET(vaddr) (vaddr << 20 >> 20)
+
+typedef uint32_t page_table_entry;
+
+#define PTE_FRAME   0xfffff000  /* physical address of the frame */
+#define PTE_VALID   0x00000001  /* frame is resident */
+#define PTE_WRITE   0x00000002  /* writable without a fault */
+#define PTE_SWAPPED 0x00000004  /* contents are in swap */
+#define PTE_BUSY    0x00000008  /* in transit to or from swap */
+
+#define PTE_PADDR(pte)  ((paddr_t)((pte) & PTE_FRAME))
+#define PTE_SLOT(pte)   ((unsigned)((pte) >> 12))
+#define PTE_MKSWAP(slot) (((page_table_entry)(slot) << 12) | PTE_SWAPPED)
+
+struct addrspace;
+
+/*
+ * pt_bootstrap - set up (once memory is being managed).
+ *
+ * pt_create   - give a new address space an empty page table.
+ *
+ * pt_lookup   - return a pointer to the entry for VADDR, or NULL if
+ *               there is none yet. If CREATE is set a zero entry is
+ *               made (with the rest of its second-level table, if
+ *               two-level); NULL then means out of memory. The
+ *               pointer stays good until the page is released.
+ *
+ * pt_copy     - copy-on-write copy of OLD's page table into NEW:
+ *               every resident page becomes shared, read-only in
+ *               both, with its frame's reference count raised.
+ *               Swapped-out pages share their swap slot the same way.
+ *
+ * pt_release  - release every frame and swap slot AS refers to in
+ *               [BASE, TOP), leaving those pages unmapped. The caller
+ *               must get rid of any TLB entries for them.
+ *
+ * pt_destroy  - release every frame and swap slot AS refers to, and
+ *               the page table itself.
+ *
+ * pt_overhead - bytes of memory all page tables are taking up.
+ *
+ * The caller must hold vm_lock for pt_lookup, pt_copy, pt_release and
+ * pt_destroy, since the pager rewrites entries of other address
+ * spaces (and the hashed table is shared by all of them). For the
+ * last three it must also have waited out AS's (or OLD's) pages in
+ * transit with vm_transit_wait.
+ */
+void pt_bootstrap(void);
+int pt_create(struct addrspace *as);
+page_table_entry *pt_lookup(struct addrspace *as, vaddr_t vaddr, bool create);
+int pt_copy(struct addrspace *old, struct addrspace *new);
+void pt_release(struct addrspace *as, vaddr_t base, vaddr_t top);
+void pt_destroy(struct addrspace *as);
+size_t pt_overhead(void);
+
+/* Print page table statistics (for the kernel menu) */
+void pt_printstats(void);
+
+#endif /* _PAGETABLE_H_ */
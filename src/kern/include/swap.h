@@ -0,0 +1,51 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space: page-sized slots on a raw disk (lhd1raw:).
+ *
+ * Slots are reference counted, because fork shares swapped-out pages
+ * the same way it shares resident ones; a slot is freed when the
+ * last page table entry naming it lets go.
+ *
+ * swap_bootstrap - open the swap device. Without one, no slot can be
+ *                  allocated and nothing is ever paged out.
+ * swap_alloc_cluster
+ *                - reserve up to WANT consecutive free slots, each with
+ *                  one reference; sets *FIRST and *GOT (at least one).
+ * swap_incref    - add a reference to a slot.
+ * swap_decref    - drop a reference; the last one frees the slot.
+ * swap_out       - write the page at kernel address KPAGE to SLOT.
+ * swap_in        - read SLOT into the page at kernel address KPAGE.
+ * swap_out_cluster, swap_in_cluster
+ *                - the same for N pages KPAGES[] and the consecutive
+ *                  slots from FIRST, in as few disk requests as the
+ *                  compressed pool allows (one, if it takes none).
+ * swap_incore    - whether SLOT's page is kept in memory (compressed,
+ *                  see zswap.h) rather than on disk, i.e. whether
+ *                  reading it back is cheap.
+ *
+ * The I/O functions sleep, and need not hold vm_lock (the pager drops
+ * it for them); the caller's references keep the slots from being
+ * reused meanwhile.
+ */
+
+#define SWAP_DEVICE "lhd1raw:"
+
+/* Most pages moved in one disk request. */
+#define SWAP_CLUSTER 8
+
+void swap_bootstrap(void);
+int swap_alloc_cluster(unsigned want, unsigned *first, unsigned *got);
+void swap_incref(unsigned slot);
+void swap_decref(unsigned slot);
+int swap_out(unsigned slot, vaddr_t kpage);
+int swap_in(unsigned slot, vaddr_t kpage);
+int swap_out_cluster(unsigned first, const vaddr_t *kpages, unsigned n);
+int swap_in_cluster(unsigned first, const vaddr_t *kpages, unsigned n);
+bool swap_incore(unsigned slot);
+
+/* Print swap statistics (for the kernel menu) */
+void swap_printstats(void);
+
+#endif /* _SWAP_H_ */
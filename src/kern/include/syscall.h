@@ -77,4 +77,11 @@ int sys_remove(char *pathname);
 int sys_mkdir(char *pathname, mode_t mode);
 int sys_rmdir(char *pathname);
 
+/* Memory related syscalls */
+int sys_sbrk(intptr_t amount, vaddr_t *retval);
+int sys_mmap(vaddr_t addr, size_t len, int prot, int flags, int fd,
+	     off_t offset, vaddr_t *retval);
+int sys_munmap(vaddr_t addr, size_t len);
+int sys_msync(vaddr_t addr, size_t len, int flags);
+
 #endif /* _SYSCALL_H_ */
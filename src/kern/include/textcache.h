@@ -0,0 +1,62 @@
+#ifndef _TEXTCACHE_H_
+#define _TEXTCACHE_H_
+
+/*
+ * Shared text pages.
+ *
+ * Every address space running the same executable attaches to one
+ * textcache for that executable's vnode, which remembers the frame
+ * loaded for each page of the read-only segment. A text fault maps
+ * the cached frame read-only instead of reading the file again, so
+ * N copies of a program share one copy of its text.
+ *
+ * The cache holds a reference to each frame it remembers. A frame
+ * only the cache refers to is idle; textcache_reclaim() frees one of
+ * those, before the pager resorts to swapping.
+ *
+ * A textcache outlives its last address space, so running a program
+ * again finds its text still in memory; it holds its own reference
+ * to the vnode for that. Once textcache_reclaim() has taken every
+ * frame of a textcache nobody is attached to, textcache_reap() frees
+ * it. textcache_purge() frees all unused textcaches at once, so that
+ * their vnode references don't keep a file system from unmounting.
+ *
+ * A textcache remembers vnode_writes() for its file when it is
+ * loaded. If the file has been written or truncated since, an unused
+ * textcache starts over empty on the next attach, and one still in
+ * use is not shared with the new program, which loads privately.
+ *
+ * textcache_attach  - find or create the textcache for V, covering
+ *                     the pages [BASE, TOP).
+ * textcache_share   - attach another address space to TC (for fork).
+ * textcache_detach  - drop an address space's attachment.
+ * textcache_covers  - whether VADDR is in TC's range.
+ * textcache_lookup  - the frame cached for VADDR, with a new reference
+ *                     for the caller; 0 if none.
+ * textcache_insert  - cache PADDR (owned by the caller) for VADDR.
+ * textcache_reap    - free unused textcaches with no frames left.
+ * textcache_purge   - free every unused textcache.
+ *
+ * All of these except textcache_reap, textcache_purge and
+ * textcache_printstats require vm_lock; textcache_reap and
+ * textcache_purge must be called without it.
+ */
+
+struct vnode;
+struct textcache;
+
+int textcache_attach(struct vnode *v, vaddr_t base, vaddr_t top,
+		     struct textcache **ret);
+void textcache_share(struct textcache *tc);
+void textcache_detach(struct textcache *tc);
+bool textcache_covers(struct textcache *tc, vaddr_t vaddr);
+paddr_t textcache_lookup(struct textcache *tc, vaddr_t vaddr);
+void textcache_insert(struct textcache *tc, vaddr_t vaddr, paddr_t paddr);
+bool textcache_reclaim(void);
+void textcache_reap(void);
+void textcache_purge(void);
+
+/* Print text sharing statistics (for the kernel menu) */
+void textcache_printstats(void);
+
+#endif /* _TEXTCACHE_H_ */
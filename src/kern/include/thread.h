@@ -108,6 +108,7 @@ struct thread {
 
 	/* add more here as needed */
 	struct fdesc *filtab[OPEN_MAX];
+	bool t_vm_evicting;		/* Paging out (see vm_evict_page) */
 };
 
 /*
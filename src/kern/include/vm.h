@@ -43,8 +43,141 @@ enum fte_state{
     FIXED
 };
 
+/*
+ * Physical frames are handed out by a buddy allocator. Free memory is
+ * kept as blocks of 2^order contiguous frames, each block aligned to
+ * its own size, and the free blocks of each order are chained through
+ * the frame table entry of their first frame. The chains are doubly
+ * linked so a buddy can be unlinked in constant time when merging.
+ *
+ * Every frame of an allocated block carries the block's order, so
+ * free_kpages() can recover the size from the address alone.
+ */
+#define BUDDY_MAX_ORDER 10
+#define BUDDY_NO_ORDER  0xff    /* non-head frame of a free block */
+#define FT_NONE         (-1)    /* end of a free list */
+
+struct addrspace;
+
+/*
+ * A user frame mapped by exactly one page table entry records that
+ * entry's address space and virtual address, so the pager can find
+ * the entry to rewrite when it evicts the frame. Frames with no owner
+ * (kernel memory, pages still shared copy-on-write) are never paged
+ * out.
+ *
+ * A user frame is CLEAN while its contents are also in swap slot
+ * SLOT: it was paged back in and has not been written since (its
+ * page table entry lacks PTE_WRITE). The frame holds a reference to
+ * the slot, so evicting it only means pointing the page table entry
+ * back at the slot, with no I/O. Every other allocated frame is DIRTY.
+ */
 struct frame_table_entry{
     enum fte_state state;
+    uint8_t order;      /* log2 of the block size this frame belongs to */
+    bool referenced;    /* touched since the clock hand last passed */
+    int next_free;      /* next free block of the same order, or FT_NONE */
+    int prev_free;      /* previous free block of the same order, or FT_NONE */
+    unsigned refcount;  /* page table entries mapping this (user) frame */
+    struct addrspace *as;   /* owner, if pageable */
+    vaddr_t vaddr;          /* owner's virtual address for the frame */
+    unsigned slot;          /* swap copy, if CLEAN */
+    void *kmalloc_ref;      /* kmalloc's pageref, if a subpage page */
+};
+
+/*
+ * Frame table occupancy, in frames. Kept up to date by the allocator,
+ * so reading it costs nothing beyond the lock.
+ */
+struct frame_stats {
+    unsigned fs_free;
+    unsigned fs_used;
+    unsigned fs_fixed;
+    unsigned fs_cached;     /* sitting in per-cpu frame caches */
+    unsigned fs_zeroed;     /* in the pre-zeroed pool */
+};
+
+/*
+ * Pre-zeroed frame pool. Idle cpus keep it topped up to its target
+ * size, which can be changed at run time (the vmzero menu command).
+ */
+#define ZERO_POOL_DEFAULT 32
+#define ZERO_POOL_MAX     256
+
+/*
+ * Per-cpu stash of free single frames in front of the buddy
+ * allocator. Only the owning cpu touches it, with interrupts off, so
+ * it needs no lock; it is refilled from and drained to the global
+ * pool FRAME_CACHE_BATCH frames per lock acquisition.
+ */
+#define FRAME_CACHE_SIZE  16
+#define FRAME_CACHE_BATCH 8
+
+struct frame_cache {
+    unsigned fc_count;
+    unsigned fc_frames[FRAME_CACHE_SIZE];   /* frame table indices */
+    unsigned fc_allochits;      /* allocations served from the stash */
+    unsigned fc_refills;        /* allocations that had to refill it */
+    unsigned fc_freehits;       /* frees absorbed by the stash */
+    unsigned fc_drains;         /* frees that had to drain it */
+};
+
+/*
+ * Per-cpu magazines in front of kmalloc's subpage allocator, one for
+ * each block size. Like the frame cache, only the owning cpu touches
+ * them, with interrupts off, so the common kmalloc and kfree are a
+ * pop or push with no lock; kmalloc's page lists are only visited to
+ * refill an empty magazine or drain a full one, half at a time.
+ * Larger blocks get smaller magazines (see kmalloc.c).
+ */
+#define KMALLOC_NSIZES  11
+#define KMALLOC_LARGEST_SUBPAGE 2048    /* bigger requests get pages */
+#define KMALLOC_MAGSIZE 16
+
+struct kmalloc_magazine {
+    unsigned km_count;
+    void *km_blocks[KMALLOC_MAGSIZE];
+};
+
+struct kmalloc_cache {
+    struct kmalloc_magazine kc_mags[KMALLOC_NSIZES];
+    unsigned kc_allochits;      /* allocations served from a magazine */
+    unsigned kc_refills;        /* allocations that had to refill one */
+    unsigned kc_freehits;       /* frees absorbed by a magazine */
+    unsigned kc_drains;         /* frees that had to drain one */
+};
+
+/*
+ * Address space IDs. The TLB tags entries with a 6-bit ASID, so
+ * switching address spaces only needs a new ASID in EntryHi, not a
+ * flush. ASIDs are handed out per cpu, in generations: an address
+ * space keeps its ASID on a cpu for as long as that cpu's generation
+ * lasts. When the ASIDs run out the cpu starts a new generation with
+ * an empty TLB, and everyone gets a new ASID the next time they run.
+ *
+ * An address space's per-cpu ASID is stored as (generation << ASID_BITS)
+ * | asid; zero means none. ASID 0 is never handed out.
+ */
+#define ASID_BITS       6
+#define NUM_ASID        (1U << ASID_BITS)
+#define ASID_MASK       (NUM_ASID - 1)
+#define ASID_GEN(ctx)   ((ctx) >> ASID_BITS)
+#define ASID_NUM(ctx)   ((ctx) & ASID_MASK)
+
+struct cpu_asids {
+    uint32_t ca_generation;     /* current generation; never 0 */
+    unsigned ca_next;           /* next unused ASID this generation */
+    unsigned ca_current;        /* ASID in EntryHi, 0 if none */
+};
+
+/*
+ * Per-cpu TLB refill state. When no entry for the page is there to
+ * overwrite, vm_fault replaces slots round-robin, oldest load first.
+ */
+struct cpu_tlb {
+    unsigned ct_hand;           /* next slot to replace */
+    unsigned ct_misses;         /* entries loaded by vm_fault */
+    unsigned ct_evictions;      /* ... that displaced a valid entry */
 };
 
 
@@ -68,6 +201,145 @@ void frame_table_init(void);
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+/*
+ * One zero-filled frame, from the pre-zeroed pool when possible.
+ * frame_prezero() is the idle loop's hook for filling the pool; it
+ * returns false if there was nothing to do.
+ */
+vaddr_t alloc_zeroed_kpage(void);
+bool frame_prezero(void);
+void frame_zeropool_settarget(unsigned target);
+void frame_zeropool_printstats(void);
+
+/*
+ * Reference counts on user frames, for sharing them copy-on-write.
+ * alloc_kpages() hands frames out with a count of one; frame_decref()
+ * frees the frame when the count drops to zero.
+ */
+void frame_incref(paddr_t paddr);
+void frame_decref(paddr_t paddr);
+unsigned frame_refcount(paddr_t paddr);
+
+/*
+ * Batched release, for tearing down page tables: frame_batch_add()
+ * queues one page table entry's reference to a frame of AS's, and
+ * frame_batch_flush() drops the queued references (and AS's ownership)
+ * under a single hold of the frame table lock, freeing the frames
+ * nobody else refers to. Adding to a full batch flushes it first;
+ * the caller flushes what is left at the end.
+ */
+#define FRAME_BATCH 32
+
+struct frame_batch {
+    struct addrspace *fb_as;
+    unsigned fb_count;
+    paddr_t fb_frames[FRAME_BATCH];
+};
+
+void frame_batch_init(struct frame_batch *fb, struct addrspace *as);
+void frame_batch_add(struct frame_batch *fb, paddr_t paddr);
+void frame_batch_flush(struct frame_batch *fb);
+
+/*
+ * Pageable frames. frame_set_owner() marks a frame mapped only by AS
+ * at VADDR as pageable (and recently used); frame_disown() undoes it
+ * if AS is still the owner. frame_clock_victim() runs the clock hand
+ * to pick a pageable frame that has not been used since the hand last
+ * passed it; with CLEAN set, only CLEAN frames are considered.
+ * frame_evictable() says whether the DIRTY frame AS maps at VADDR would
+ * make a victim too, so the pager can take its neighbours along. All
+ * four require vm_lock.
+ */
+void frame_set_owner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+void frame_disown(paddr_t paddr, struct addrspace *as);
+bool frame_clock_victim(paddr_t *paddr, struct addrspace **as, vaddr_t *vaddr,
+                        bool clean);
+bool frame_evictable(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+
+/*
+ * Clean frames (see above). frame_set_clean() records that the frame
+ * (just read in, with one reference) is a copy of SLOT, taking over
+ * the caller's reference to the slot. frame_take_slot() makes a CLEAN
+ * frame DIRTY again and hands the slot reference to the caller;
+ * it returns false, doing nothing, if the frame is not CLEAN. A CLEAN
+ * frame's slot reference is dropped when the frame is freed.
+ */
+void frame_set_clean(paddr_t paddr, unsigned slot);
+bool frame_take_slot(paddr_t paddr, unsigned *slot);
+
+/* Frame table occupancy */
+void frame_table_getstats(struct frame_stats *stats);
+unsigned frame_table_nfree(void);
+
+/* Per-cpu frame caches (called from cpu_create) */
+void frame_cache_init(struct frame_cache *fc, unsigned cpunum);
+void frame_cache_printstats(void);
+
+/*
+ * Kernel heap pages. kmalloc tags each page it carves into blocks
+ * with its bookkeeping structure for the page (its pageref), so that
+ * kfree can find that from a block's address without a search or a
+ * lock; NULL means the page is not one of kmalloc's subpage pages.
+ */
+void frame_set_kmalloc_ref(vaddr_t kpage, void *ref);
+void *frame_kmalloc_ref(vaddr_t kaddr);
+
+/* Per-cpu kmalloc magazines (called from cpu_create; see kmalloc.c) */
+void kmalloc_cache_init(struct kmalloc_cache *kc, unsigned cpunum);
+
+/*
+ * Serializes the pager against changes to user page tables. Held by
+ * vm_fault, by as_copy/as_destroy while walking page tables, and
+ * while paging out, except across swap I/O (see vm_evict_page).
+ */
+extern struct lock *vm_lock;
+
+/* Page out one or more user pages; false if nothing could be freed. */
+bool vm_evict_page(void);
+
+/*
+ * Wait (with vm_lock, which is dropped meanwhile) until none of AS's
+ * pages is on its way to or from swap, before walking or tearing down
+ * its whole page table.
+ */
+void vm_transit_wait(struct addrspace *as);
+
+/*
+ * The page-out daemon. It sleeps until free frames fall below the low
+ * watermark, then evicts until they are back above the high one, so
+ * faults seldom find memory empty and have to evict pages themselves.
+ * vm_pageout_kick() wakes it if memory is low; it is cheap, and safe
+ * to call from anywhere alloc_kpages() can be called.
+ */
+void vm_pageout_bootstrap(void);
+void vm_pageout_kick(void);
+
+/*
+ * Give back every frame kept only in case it is wanted again: idle
+ * shared text and file pages, unused textcaches, empty object cache
+ * slabs, and kmalloc's spare pages and this cpu's magazines. Whatever
+ * is still in use after this is really in use (see vmused).
+ */
+void vm_drain(void);
+
+/*
+ * ASID management. vm_asid_activate() switches this cpu's TLB to AS
+ * (interrupts off); vm_asid_retire() makes AS take fresh ASIDs
+ * everywhere, abandoning whatever entries its old ones have;
+ * vm_asid_release() is the same for an address space being destroyed;
+ * vm_tlb_invalidate() drops AS's entry for VADDR from this cpu's TLB
+ * (interrupts off).
+ */
+void vm_asid_init(struct cpu_asids *ca);
+void vm_tlb_init(struct cpu_tlb *ct, unsigned cpunum);
+void vm_asid_activate(struct addrspace *as);
+void vm_asid_retire(struct addrspace *as);
+void vm_asid_release(struct addrspace *as);
+void vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr);
+
+/* Print VM statistics (for the kernel menu) */
+void vm_printstats(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
@@ -50,7 +50,8 @@ struct stat;
  */
 struct vnode {
 	int vn_refcount;                /* Reference count */
-	struct spinlock vn_countlock;   /* Lock for vn_refcount */
+	struct spinlock vn_countlock;   /* Lock for vn_refcount, vn_writes */
+	unsigned vn_writes;             /* Writes and truncates done */
 
 	struct fs *vn_fs;               /* Filesystem vnode belongs to */
 
@@ -120,9 +121,10 @@ struct vnode {
  *    vop_fsync       - Force any dirty buffers associated with this file
  *                      to stable storage.
  *
- *    vop_mmap        - Map file into memory. If you implement this
- *                      feature, you're responsible for choosing the
- *                      arguments for this operation.
+ *    vop_mmap        - Check whether the file can be mapped into
+ *                      memory. Mapped pages are read and written
+ *                      back with vop_read and vop_write, so the file
+ *                      system has nothing else to do.
  *
  *    vop_truncate    - Forcibly set size of file to the length passed
  *                      in, discarding any excess blocks.
@@ -231,14 +233,14 @@ struct vnode_ops {
 #define VOP_READ(vn, uio)               (__VOP(vn, read)(vn, uio))
 #define VOP_READLINK(vn, uio)           (__VOP(vn, readlink)(vn, uio))
 #define VOP_GETDIRENTRY(vn, uio)        (__VOP(vn,getdirentry)(vn, uio))
-#define VOP_WRITE(vn, uio)              (__VOP(vn, write)(vn, uio))
+#define VOP_WRITE(vn, uio)              vnode_write(vn, uio)
 #define VOP_IOCTL(vn, code, buf)        (__VOP(vn, ioctl)(vn,code,buf))
 #define VOP_STAT(vn, ptr) 	        (__VOP(vn, stat)(vn, ptr))
 #define VOP_GETTYPE(vn, result)         (__VOP(vn, gettype)(vn, result))
 #define VOP_ISSEEKABLE(vn)              (__VOP(vn, isseekable)(vn))
 #define VOP_FSYNC(vn)                   (__VOP(vn, fsync)(vn))
 #define VOP_MMAP(vn /*add stuff */)     (__VOP(vn, mmap)(vn /*add stuff */))
-#define VOP_TRUNCATE(vn, pos)           (__VOP(vn, truncate)(vn, pos))
+#define VOP_TRUNCATE(vn, pos)           vnode_truncate(vn, pos)
 #define VOP_NAMEFILE(vn, uio)           (__VOP(vn, namefile)(vn, uio))
 
 #define VOP_CREAT(vn,nm,excl,mode,res)  (__VOP(vn, creat)(vn,nm,excl,mode,res))
@@ -266,6 +268,16 @@ void vnode_decref(struct vnode *);
 #define VOP_INCREF(vn) 			vnode_incref(vn)
 #define VOP_DECREF(vn) 			vnode_decref(vn)
 
+/*
+ * Writes and truncates (handled above filesystem level). VOP_WRITE
+ * and VOP_TRUNCATE count each call in vn_writes once it returns, so
+ * a cache of a file's contents can tell the file has changed since
+ * it last looked: vnode_writes returns the count.
+ */
+int vnode_write(struct vnode *, struct uio *);
+int vnode_truncate(struct vnode *, off_t);
+unsigned vnode_writes(struct vnode *);
+
 /*
  * Vnode initialization (intended for use by filesystem code)
  * The reference count is initialized to 1.
@@ -50,6 +50,12 @@ struct wchan *wchan_create(const char *name);
  */
 void wchan_destroy(struct wchan *wc);
 
+/*
+ * Rename a wait channel, which must be empty. The same rules apply to
+ * NAME as for wchan_create.
+ */
+void wchan_setname(struct wchan *wc, const char *name);
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -0,0 +1,41 @@
+#ifndef _ZSWAP_H_
+#define _ZSWAP_H_
+
+/*
+ * Compressed swap cache.
+ *
+ * Writing a page to the swap disk takes eight sector transfers of
+ * one interrupt each, so before a page goes to disk the swap layer
+ * tries to keep it here instead: compressed, in a pool of kmalloc'd
+ * blocks indexed by swap slot. Only pages that do not compress well,
+ * or that do not fit because the pool is full, are written to disk.
+ *
+ * The slot stays allocated as usual, so the rest of the VM system
+ * cannot tell where a swapped page actually is; swap.c decides.
+ *
+ * zswap_bootstrap - set up the pool for NSLOTS swap slots.
+ * zswap_store     - try to keep the page at KPAGE compressed for SLOT;
+ *                   false if it should go to disk instead.
+ * zswap_load      - uncompress SLOT into KPAGE; false if SLOT's page is
+ *                   not in the pool.
+ * zswap_contains  - whether SLOT's page is in the pool.
+ * zswap_drop      - forget SLOT's page, if it is in the pool (when the
+ *                   slot is freed).
+ * zswap_poolsize  - bytes of kernel heap the pool takes up.
+ *
+ * zswap_store and zswap_load may sleep (stores share one compression
+ * workspace, under a lock of its own); the others may be called from
+ * anywhere.
+ */
+
+void zswap_bootstrap(unsigned nslots);
+bool zswap_store(unsigned slot, vaddr_t kpage);
+bool zswap_load(unsigned slot, vaddr_t kpage);
+bool zswap_contains(unsigned slot);
+void zswap_drop(unsigned slot);
+size_t zswap_poolsize(void);
+
+/* Print compressed cache statistics (for the kernel menu) */
+void zswap_printstats(void);
+
+#endif /* _ZSWAP_H_ */
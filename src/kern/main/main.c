@@ -50,6 +50,10 @@
 #include <test.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-dumbvm.h"
+#if !OPT_DUMBVM
+#include <swap.h>
+#endif
 
 
 /*
@@ -131,6 +135,12 @@ boot(void)
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
 
+#if !OPT_DUMBVM
+	/* Swap lives on a raw disk, so only now that devices exist. */
+	swap_bootstrap();
+	vm_pageout_bootstrap();
+#endif
+
 	kheap_nextgeneration();
 
 	/*
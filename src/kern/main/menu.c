@@ -37,12 +37,15 @@
 #include <clock.h>
 #include <thread.h>
 #include <proc.h>
+#include <vm.h>
 #include <vfs.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <zswap.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-dumbvm.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -402,6 +405,79 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+#if !OPT_DUMBVM
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_vmzero(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: vmzero npages\n");
+		return EINVAL;
+	}
+
+	frame_zeropool_settarget(atoi(args[1]));
+
+	return 0;
+}
+
+/*
+ * Frames in use, and the change since the last vmused. Run it before
+ * a workload and again after everything the workload started has
+ * exited; whatever the workload still holds has leaked.
+ *
+ * The caches that are kept only in case they are wanted again are
+ * emptied first (vm_drain), so they do not show up as leaks. The
+ * compressed swap pool holds pages of processes still running and
+ * cannot be emptied; it grows and shrinks as they page, so it is
+ * counted separately.
+ */
+static bool vmused_valid;
+static unsigned vmused_last;
+
+static
+int
+cmd_vmused(int nargs, char **args)
+{
+	struct frame_stats fs;
+	unsigned used, zpages;
+
+	(void)nargs;
+	(void)args;
+
+	vm_drain();
+	frame_table_getstats(&fs);
+	zpages = DIVROUNDUP(zswap_poolsize(), PAGE_SIZE);
+	used = fs.fs_used > zpages ? fs.fs_used - zpages : 0;
+
+	kprintf("Frames in use: %u, and %u for compressed swap", used, zpages);
+	if (vmused_valid && used >= vmused_last) {
+		kprintf(" (%u more than at the last vmused)",
+			used - vmused_last);
+	}
+	else if (vmused_valid) {
+		kprintf(" (%u fewer than at the last vmused)",
+			vmused_last - used);
+	}
+	kprintf("\n");
+
+	vmused_valid = true;
+	vmused_last = used;
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -465,6 +541,11 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[km5] Multipage fragmentation test  ",
+#if !OPT_DUMBVM
+	"[pt1] Page table benchmark          ",
+	"[fc1] Frame clock test              ",
+#endif
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -505,6 +586,11 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+#if !OPT_DUMBVM
+	"[vm] VM statistics                  ",
+	"[vmzero] Set pre-zeroed pool size   ",
+	"[vmused] Frames in use (leak check) ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -554,6 +640,11 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+#if !OPT_DUMBVM
+	{ "vm",         cmd_vmstats },
+	{ "vmzero",     cmd_vmzero },
+	{ "vmused",     cmd_vmused },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -563,6 +654,11 @@ static struct {
 	{ "km2",	mallocstress },
 	{ "km3",	malloctest3 },
 	{ "km4",	malloctest4 },
+	{ "km5",	malloctest5 },
+#if !OPT_DUMBVM
+	{ "pt1",	pagetabletest },
+	{ "fc1",	frameclocktest },
+#endif
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -49,12 +49,42 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <pid.h>
+#include <objcache.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
 struct proc *kproc;
 
+/*
+ * Constructor and destructor for the proc cache. A free proc has no
+ * threads; its thread array keeps whatever space it had.
+ */
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_cleanup(&proc->p_threads);
+	spinlock_cleanup(&proc->p_lock);
+}
+
+static struct objcache proc_cache =
+	OBJCACHE_INITIALIZER("proc", sizeof(struct proc),
+			     proc_ctor, proc_dtor);
+
 /*
  * Create a proc structure.
  */
@@ -64,19 +94,16 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = objcache_alloc(&proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		objcache_free(&proc_cache, proc);
 		return NULL;
 	}
 
-	threadarray_init(&proc->p_threads);
-	spinlock_init(&proc->p_lock);
-
 	/* VM fields */
 	proc->p_addrspace = NULL;
 
@@ -166,11 +193,10 @@ proc_destroy(struct proc *proc)
 		as_destroy(as);
 	}
 
-	threadarray_cleanup(&proc->p_threads);
-	spinlock_cleanup(&proc->p_lock);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	objcache_free(&proc_cache, proc);
 }
 
 /*
@@ -17,17 +17,46 @@
 
 #include <file.h>
 #include <array.h>
+#include <objcache.h>
 
 /*
  * File descriptor manipulating functions
  */
 
+/*
+ * A free file descriptor keeps its lock.
+ */
+static
+int
+fd_ctor(void *obj)
+{
+	struct fdesc *fd = obj;
+
+	fd->fd_lock = lock_create("fd lock");
+	if (fd->fd_lock == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+fd_dtor(void *obj)
+{
+	struct fdesc *fd = obj;
+
+	lock_destroy(fd->fd_lock);
+}
+
+static struct objcache fd_cache =
+	OBJCACHE_INITIALIZER("fdesc", sizeof(struct fdesc), fd_ctor, fd_dtor);
+
 int
 fd_create(struct vnode *v, int flag, off_t offset, 
 	struct fdesc **fd)
 {
 
-	*fd = kmalloc(sizeof(struct fdesc));
+	*fd = objcache_alloc(&fd_cache);
 	if (*fd == NULL) {
 		return ENOMEM;
 	}
@@ -36,25 +65,30 @@ fd_create(struct vnode *v, int flag, off_t offset,
 	(*fd)->flags = flag;
 	(*fd)->filoff = offset;
 	(*fd)->refcount = 1;
-	(*fd)->fd_lock = lock_create("fd lock");
-	KASSERT((*fd)->fd_lock);
 	return 0;
 }
 
 void
 fd_destroy(struct fdesc *fd)
 {
-	kfree(fd);
+	KASSERT(!lock_do_i_hold(fd->fd_lock));
+	objcache_free(&fd_cache, fd);
 }
 
+/*
+ * A new descriptor for the same file at the same offset. Like every
+ * descriptor it holds its own reference to the vnode.
+ */
 int
 fd_copy(struct fdesc *src, struct fdesc **dst)
 {
-	*dst = kmalloc(sizeof(struct fdesc));
-	if (*dst == NULL) {
-		return ENOMEM;
+	int result;
+
+	result = fd_create(src->vn, src->flags, src->filoff, dst);
+	if (result) {
+		return result;
 	}
-	memcpy(dst, src, sizeof(struct fdesc));
+	VOP_INCREF(src->vn);
 	return 0;
 }
 
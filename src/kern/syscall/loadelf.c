@@ -52,6 +52,7 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <uio.h>
 #include <proc.h>
@@ -69,10 +70,12 @@
  * FILESIZE may be less than MEMSIZE; if so the remaining portion of
  * the in-memory segment should be zero-filled.
  *
- * Note that uiomove will catch it if someone tries to load an
- * executable whose load address is in kernel space. If you should
- * change this code to not use uiomove, be sure to check for this case
- * explicitly.
+ * Nothing is actually read here: the segment is recorded in the
+ * address space and its pages are read from V (or zero-filled) by
+ * vm_fault when they are first touched. Since uiomove is no longer
+ * there to catch a load address in kernel space, check for that
+ * explicitly, and check up front that the file is long enough
+ * rather than finding out halfway through running the program.
  */
 static
 int
@@ -81,68 +84,41 @@ load_segment(struct addrspace *as, struct vnode *v,
 	     size_t memsize, size_t filesize,
 	     int is_executable)
 {
-	struct iovec iov;
-	struct uio u;
+	struct stat st;
 	int result;
 
+	/*
+	 * The paging VM reads each page through the kernel's mapping of
+	 * its frame, and dumbvm's as_define_segment uses UIO_USERSPACE.
+	 * Nothing is lost: uiomove treats UIO_USERISPACE the same as
+	 * UIO_USERSPACE, and System/161 has no instruction cache to sync.
+	 */
+	(void)is_executable;
+
 	if (filesize > memsize) {
 		kprintf("ELF: warning: segment filesize > segment memsize\n");
 		filesize = memsize;
 	}
 
-	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n",
-	      (unsigned long) filesize, (unsigned long) vaddr);
+	if (vaddr + memsize < vaddr || vaddr + memsize > USERSPACETOP) {
+		kprintf("ELF: segment outside user space\n");
+		return ENOEXEC;
+	}
 
-	iov.iov_ubase = (userptr_t)vaddr;
-	iov.iov_len = memsize;		 // length of the memory space
-	u.uio_iov = &iov;
-	u.uio_iovcnt = 1;
-	u.uio_resid = filesize;          // amount to read from the file
-	u.uio_offset = offset;
-	u.uio_segflg = is_executable ? UIO_USERISPACE : UIO_USERSPACE;
-	u.uio_rw = UIO_READ;
-	u.uio_space = as;
-
-	result = VOP_READ(v, &u);
+	result = VOP_STAT(v, &st);
 	if (result) {
 		return result;
 	}
-
-	if (u.uio_resid != 0) {
+	if (offset + (off_t)filesize > st.st_size) {
 		/* short read; problem with executable? */
 		kprintf("ELF: short read on segment - file truncated?\n");
 		return ENOEXEC;
 	}
 
-	/*
-	 * If memsize > filesize, the remaining space should be
-	 * zero-filled. There is no need to do this explicitly,
-	 * because the VM system should provide pages that do not
-	 * contain other processes' data, i.e., are already zeroed.
-	 *
-	 * During development of your VM system, it may have bugs that
-	 * cause it to (maybe only sometimes) not provide zero-filled
-	 * pages, which can cause user programs to fail in strange
-	 * ways. Explicitly zeroing program BSS may help identify such
-	 * bugs, so the following disabled code is provided as a
-	 * diagnostic tool. Note that it must be disabled again before
-	 * you submit your code for grading.
-	 */
-#if 0
-	{
-		size_t fillamt;
-
-		fillamt = memsize - filesize;
-		if (fillamt > 0) {
-			DEBUG(DB_EXEC, "ELF: Zero-filling %lu more bytes\n",
-			      (unsigned long) fillamt);
-			u.uio_resid += fillamt;
-			result = uiomovezeros(fillamt, &u);
-		}
-	}
-#endif
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx on demand\n",
+	      (unsigned long) filesize, (unsigned long) vaddr);
 
-	return result;
+	return as_define_segment(as, v, offset, vaddr, memsize, filesize);
 }
 
 /*
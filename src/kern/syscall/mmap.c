@@ -0,0 +1,125 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <thread.h>
+#include <current.h>
+#include <proc.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <file.h>
+#include <syscall.h>
+
+/*
+ * mmap: map LEN bytes of open file FD from OFFSET somewhere in the
+ * address space, and return where. The address hint is ignored.
+ * Nothing is read here; pages are read from the file as they are
+ * touched. See as_mmap.
+ *
+ * The file must be open for reading, and for writing too if writes
+ * through the mapping are to go back to it.
+ */
+int
+sys_mmap(vaddr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, vaddr_t *retval)
+{
+	struct addrspace *as;
+	struct fdesc *fdes;
+	int accmode;
+	int result;
+
+	(void)addr;
+
+	if (len == 0 || (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0) {
+		return EINVAL;
+	}
+	if (flags != MAP_SHARED && flags != MAP_PRIVATE) {
+		return EINVAL;
+	}
+	if (len > USERSPACETOP) {
+		return ENOMEM;
+	}
+
+	if (fd < 0 || fd >= OPEN_MAX) {
+		return EBADF;
+	}
+	result = ftab_get(curthread->filtab, fd, &fdes);
+	if (result) {
+		return result;
+	}
+	if (fdes == NULL) {
+		return EBADF;
+	}
+
+	accmode = fdes->flags & O_ACCMODE;
+	if (accmode == O_WRONLY) {
+		return EACCES;
+	}
+	if (flags == MAP_SHARED && (prot & PROT_WRITE) && accmode != O_RDWR) {
+		return EACCES;
+	}
+
+	result = VOP_MMAP(fdes->vn);
+	if (result) {
+		return result;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	return as_mmap(as, fdes->vn, offset, DIVROUNDUP(len, PAGE_SIZE),
+		       prot, flags == MAP_SHARED, retval);
+}
+
+/*
+ * munmap: remove the mapping at ADDR, which must be LEN bytes long.
+ * Pages written through it are written back to the file.
+ */
+int
+sys_munmap(vaddr_t addr, size_t len)
+{
+	struct addrspace *as;
+
+	if ((addr & PAGE_FRAME) != addr || len == 0 || len > USERSPACETOP) {
+		return EINVAL;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	return as_munmap(as, addr, DIVROUNDUP(len, PAGE_SIZE));
+}
+
+/*
+ * msync: write back the pages in [ADDR, ADDR+LEN) written through a
+ * shared mapping, which must cover all of them. Writes go to the file
+ * before this returns either way; MS_SYNC also waits for the disk.
+ */
+int
+sys_msync(vaddr_t addr, size_t len, int flags)
+{
+	struct addrspace *as;
+
+	if ((addr & PAGE_FRAME) != addr || len > USERSPACETOP) {
+		return EINVAL;
+	}
+	if (flags != MS_ASYNC && flags != MS_SYNC) {
+		return EINVAL;
+	}
+	if (len == 0) {
+		return 0;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	return as_msync(as, addr, DIVROUNDUP(len, PAGE_SIZE),
+			flags == MS_SYNC);
+}
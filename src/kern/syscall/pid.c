@@ -73,15 +73,22 @@ int pid_alloc(struct proc *proc){
 int sys__exit(int exitcode){
 	pid_t pid = curproc->pid;
 	struct process *process;
+	struct addrspace *as;
 
 	process = pidtable[pid];
 	process->status = WNOHANG;
 	process->exitcode = _MKWAIT_EXIT(exitcode);
 	lock_release(process->pid_lock);
 
-	
+	/*
+	 * Nothing runs in the address space again, so give its memory
+	 * back now; the proc itself stays for its exit status.
+	 */
+	as = proc_setas(NULL);
+	as_deactivate();
+	as_destroy(as);
 
-	return 0;
+	thread_exit();
 }
 
 int sys_fork(struct trapframe *ptf, struct proc *pproc, pid_t *pid){
@@ -0,0 +1,23 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <syscall.h>
+
+/*
+ * sbrk: move the end of the heap by AMOUNT bytes and return the old
+ * end. Memory is not allocated here; see as_sbrk.
+ */
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	return as_sbrk(as, amount, retval);
+}
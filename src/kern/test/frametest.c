@@ -0,0 +1,79 @@
+/*
+ * Frame clock test.
+ *
+ * Makes a kernel frame look like a user page that has just been used,
+ * then runs the clock hand until it picks that frame. On the way the
+ * hand has to pass it once while it is still marked referenced, which
+ * clears the mark and drops the page from the TLB; the next time
+ * round it is the victim.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <test.h>
+
+#define FC1_VADDR 0x00400000
+
+int
+frameclocktest(int nargs, char **args)
+{
+	struct addrspace *as, *vas;
+	paddr_t paddr, vpaddr;
+	vaddr_t kpage, vvaddr;
+	unsigned calls;
+	bool found;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting frame clock test...\n");
+
+	as = as_create();
+	if (as == NULL) {
+		kprintf("fc1: as_create failed\n");
+		return ENOMEM;
+	}
+	kpage = alloc_kpages(1);
+	if (kpage == 0) {
+		as_destroy(as);
+		kprintf("fc1: alloc_kpages failed\n");
+		return ENOMEM;
+	}
+	paddr = KVADDR_TO_PADDR(kpage);
+
+	lock_acquire(vm_lock);
+	frame_set_owner(paddr, as, FC1_VADDR);
+
+	/*
+	 * Other processes' pages may come up first; the hand moves on
+	 * after each victim, so it gets round to ours within two turns
+	 * of calls returning somebody else's.
+	 */
+	found = false;
+	for (calls = 0; !found; calls++) {
+		if (!frame_clock_victim(&vpaddr, &vas, &vvaddr, false)) {
+			break;
+		}
+		found = vpaddr == paddr;
+	}
+	if (found) {
+		KASSERT(vas == as);
+		KASSERT(vvaddr == FC1_VADDR);
+	}
+
+	frame_disown(paddr, as);
+	lock_release(vm_lock);
+	free_kpages(kpage);
+	as_destroy(as);
+
+	if (!found) {
+		kprintf("fc1: the clock never picked the frame\n");
+		return EINVAL;
+	}
+	kprintf("fc1: victim after %u calls\n", calls);
+	kprintf("Frame clock test done\n");
+	return 0;
+}
@@ -33,6 +33,10 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <thread.h>
 #include <synch.h>
 #include <vm.h> /* for PAGE_SIZE */
@@ -40,6 +44,69 @@
 
 #include "opt-dumbvm.h"
 
+////////////////////////////////////////////////////////////
+// Throughput (km2, km3)
+
+/*
+ * The multithreaded tests count the kmalloc and kfree calls their
+ * threads make and note which cpus the threads ran on, so the rate
+ * can be compared across cpu counts: with a single heap lock, adding
+ * cpus adds contention rather than throughput.
+ */
+
+static struct spinlock km_statlock = SPINLOCK_INITIALIZER;
+static unsigned km_ops;
+static uint32_t km_cpus;
+
+static
+void
+malloctest_startstats(struct timespec *before)
+{
+	spinlock_acquire(&km_statlock);
+	km_ops = 0;
+	km_cpus = 0;
+	spinlock_release(&km_statlock);
+	gettime(before);
+}
+
+/* Called by each thread as it starts, and when done with its OPS */
+static
+void
+malloctest_addstats(unsigned ops)
+{
+	spinlock_acquire(&km_statlock);
+	km_ops += ops;
+	km_cpus |= (uint32_t)1 << curcpu->c_number;
+	spinlock_release(&km_statlock);
+}
+
+static
+void
+malloctest_printstats(const char *name, const struct timespec *before)
+{
+	struct timespec after, duration;
+	unsigned ncpus, i;
+	uint64_t usecs;
+
+	gettime(&after);
+	timespec_sub(&after, before, &duration);
+	usecs = duration.tv_sec * 1000000ULL + duration.tv_nsec / 1000;
+
+	ncpus = 0;
+	for (i=0; i<8 * sizeof(km_cpus); i++) {
+		if (km_cpus & ((uint32_t)1 << i)) {
+			ncpus++;
+		}
+	}
+	kprintf("%s: %u kmalloc/kfree calls in %llu.%06llu s on %u cpu%s",
+		name, km_ops, usecs / 1000000, usecs % 1000000,
+		ncpus, ncpus == 1 ? "" : "s");
+	if (usecs > 0) {
+		kprintf(", %llu/sec", km_ops * 1000000ULL / usecs);
+	}
+	kprintf("\n");
+}
+
 ////////////////////////////////////////////////////////////
 // km1/km2
 
@@ -66,33 +133,43 @@ mallocthread(void *sm, unsigned long num)
 	void *ptr;
 	void *oldptr=NULL;
 	void *oldptr2=NULL;
+	unsigned ops=0;
 	int i;
 
+	if (sem) {
+		malloctest_addstats(0);
+	}
 	for (i=0; i<NTRIES; i++) {
 		ptr = kmalloc(ITEMSIZE);
 		if (ptr==NULL) {
 			if (sem) {
 				kprintf("thread %lu: kmalloc returned NULL\n",
 					num);
+				malloctest_addstats(ops);
 				V(sem);
 				return;
 			}
 			kprintf("kmalloc returned null; test failed.\n");
 			return;
 		}
+		ops++;
 		if (oldptr2) {
 			kfree(oldptr2);
+			ops++;
 		}
 		oldptr2 = oldptr;
 		oldptr = ptr;
 	}
 	if (oldptr2) {
 		kfree(oldptr2);
+		ops++;
 	}
 	if (oldptr) {
 		kfree(oldptr);
+		ops++;
 	}
 	if (sem) {
+		malloctest_addstats(ops);
 		V(sem);
 	}
 }
@@ -114,6 +191,7 @@ int
 mallocstress(int nargs, char **args)
 {
 	struct semaphore *sem;
+	struct timespec before;
 	int i, result;
 
 	(void)nargs;
@@ -126,6 +204,7 @@ mallocstress(int nargs, char **args)
 
 	kprintf("Starting kmalloc stress test...\n");
 
+	malloctest_startstats(&before);
 	for (i=0; i<NTHREADS; i++) {
 		result = thread_fork("mallocstress", NULL,
 				     mallocthread, sem, i);
@@ -138,6 +217,7 @@ mallocstress(int nargs, char **args)
 	for (i=0; i<NTHREADS; i++) {
 		P(sem);
 	}
+	malloctest_printstats("mallocstress", &before);
 
 	sem_destroy(sem);
 	kprintf("kmalloc stress test done\n");
@@ -152,7 +232,10 @@ mallocstress(int nargs, char **args)
  * Larger kmalloc test. Or at least, potentially larger. The size is
  * an argument.
  *
- * The argument specifies the number of objects to allocate; the size
+ * The argument specifies the number of objects to allocate. They are
+ * split between a number of threads, NTHREADS unless a second
+ * argument says otherwise, that run at once (on as many cpus as
+ * there are) and each do the following on their share. The size
  * of each allocation rotates through sizes[]. (FUTURE: should there
  * be a mode that allocates random sizes?) In order to hold the
  * pointers returned by kmalloc we first allocate a two-level radix
@@ -169,12 +252,13 @@ mallocstress(int nargs, char **args)
  * Having set this up, the test just allocates and then frees all the
  * pointers in order, setting and checking the contents.
  */
-int
-malloctest3(int nargs, char **args)
+static
+void
+malloctest3thread(void *sm, unsigned long numptrs)
 {
 #define NUM_KM3_SIZES 5
 	static const unsigned sizes[NUM_KM3_SIZES] = { 32, 41, 109, 86, 9 };
-	unsigned numptrs;
+	struct semaphore *sem = sm;
 	size_t ptrspace;
 	size_t blocksize;
 	unsigned numptrblocks;
@@ -184,22 +268,15 @@ malloctest3(int nargs, char **args)
 	unsigned i, j;
 	unsigned char *ptr;
 
-	if (nargs != 2) {
-		kprintf("malloctest3: usage: malloctest3 numobjects\n");
-		return EINVAL;
-	}
+	malloctest_addstats(0);
 
-	/* Figure out how many pointers we'll get and the space they need. */
-	numptrs = atoi(args[1]);
+	/* Figure out the space the pointers need. */
 	ptrspace = numptrs * sizeof(void *);
 
 	/* Figure out how many blocks in the lower tier. */
 	blocksize = PAGE_SIZE / 4;
 	numptrblocks = DIVROUNDUP(ptrspace, blocksize);
 
-	kprintf("malloctest3: %u objects, %u pointer blocks\n",
-		numptrs, numptrblocks);
-
 	/* Allocate the upper tier. */
 	ptrblocks = kmalloc(numptrblocks * sizeof(ptrblocks[0]));
 	if (ptrblocks == NULL) {
@@ -245,8 +322,6 @@ malloctest3(int nargs, char **args)
 		cursizeindex = (cursizeindex + 1) % NUM_KM3_SIZES;
 	}
 
-	kprintf("malloctest3: %zu bytes allocated\n", totalsize);
-
 	/* Free the objects. */
 	curblock = 0;
 	curpos = 0;
@@ -288,6 +363,55 @@ malloctest3(int nargs, char **args)
 	/* Free the upper tier. */
 	kfree(ptrblocks);
 
+	malloctest_addstats(2 * (numptrs + numptrblocks + 1));
+	V(sem);
+}
+
+int
+malloctest3(int nargs, char **args)
+{
+	struct semaphore *sem;
+	struct timespec before;
+	unsigned numptrs, nthreads, i;
+	int result;
+
+	if (nargs != 2 && nargs != 3) {
+		kprintf("malloctest3: usage: malloctest3 numobjects "
+			"[numthreads]\n");
+		return EINVAL;
+	}
+	numptrs = atoi(args[1]);
+	nthreads = nargs == 3 ? (unsigned)atoi(args[2]) : NTHREADS;
+	if (nthreads == 0) {
+		kprintf("malloctest3: need at least one thread\n");
+		return EINVAL;
+	}
+
+	kprintf("malloctest3: %u objects, in %u threads\n",
+		numptrs, nthreads);
+
+	sem = sem_create("malloctest3", 0);
+	if (sem == NULL) {
+		panic("malloctest3: sem_create failed\n");
+	}
+
+	malloctest_startstats(&before);
+	for (i=0; i<nthreads; i++) {
+		/* The first threads take any remainder. */
+		result = thread_fork("malloctest3", NULL, malloctest3thread,
+				     sem, numptrs / nthreads +
+				     (i < numptrs % nthreads ? 1 : 0));
+		if (result) {
+			panic("malloctest3: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(sem);
+	}
+	malloctest_printstats("malloctest3", &before);
+	sem_destroy(sem);
+
 	kprintf("malloctest3: passed\n");
 	return 0;
 }
@@ -378,3 +502,171 @@ malloctest4(int nargs, char **args)
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km5
+
+/*
+ * Multipage fragmentation and throughput test.
+ *
+ * Each thread keeps KM5_NSLOTS slots and, NTRIES times, picks one at
+ * random: a full slot is checked and freed, an empty one gets a new
+ * block of 1 to KM5_MAXPAGES pages. The mix of sizes and lifetimes
+ * chops physical memory into pieces, so allocations may fail while
+ * the test is running; those are counted, not fatal.
+ *
+ * Before starting we find the largest block we can get, and after
+ * everything has been freed we look again. If the page allocator
+ * does not coalesce freed blocks properly the second number comes
+ * out smaller. (Stacks of exited threads that have not been reaped
+ * yet can also cost a little, so this is reported rather than fatal.)
+ */
+
+#define KM5_NSLOTS    16
+#define KM5_MAXPAGES  8
+
+static unsigned km5_allocs;
+static unsigned km5_failures;
+static struct spinlock km5_lock = SPINLOCK_INITIALIZER;
+
+static
+void
+malloctest5thread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	unsigned char *ptrs[KM5_NSLOTS];
+	unsigned npages[KM5_NSLOTS];
+	unsigned allocs = 0, failures = 0;
+	unsigned i, j, slot;
+
+	for (i=0; i<KM5_NSLOTS; i++) {
+		ptrs[i] = NULL;
+	}
+
+	for (i=0; i<NTRIES; i++) {
+		slot = random() % KM5_NSLOTS;
+		if (ptrs[slot] != NULL) {
+			for (j=0; j<npages[slot]; j++) {
+				if (ptrs[slot][j * PAGE_SIZE] !=
+				    (unsigned char)(num + slot + j)) {
+					panic("malloctest5: thread %lu: "
+					      "block at %p clobbered\n",
+					      num, ptrs[slot]);
+				}
+			}
+			kfree(ptrs[slot]);
+			ptrs[slot] = NULL;
+			continue;
+		}
+		npages[slot] = 1 + random() % KM5_MAXPAGES;
+		ptrs[slot] = kmalloc(npages[slot] * PAGE_SIZE);
+		if (ptrs[slot] == NULL) {
+			failures++;
+			continue;
+		}
+		allocs++;
+		for (j=0; j<npages[slot]; j++) {
+			ptrs[slot][j * PAGE_SIZE] =
+				(unsigned char)(num + slot + j);
+		}
+	}
+
+	for (i=0; i<KM5_NSLOTS; i++) {
+		if (ptrs[i] != NULL) {
+			kfree(ptrs[i]);
+		}
+	}
+
+	spinlock_acquire(&km5_lock);
+	km5_allocs += allocs;
+	km5_failures += failures;
+	spinlock_release(&km5_lock);
+
+	V(sem);
+}
+
+/*
+ * Size in pages of the largest block kmalloc can currently give us.
+ */
+static
+unsigned
+malloctest5_largest(void)
+{
+	unsigned npages;
+	void *ptr;
+
+	for (npages = 1024; npages > 0; npages /= 2) {
+		ptr = kmalloc(npages * PAGE_SIZE);
+		if (ptr != NULL) {
+			kfree(ptr);
+			return npages;
+		}
+	}
+	return 0;
+}
+
+int
+malloctest5(int nargs, char **args)
+{
+	struct semaphore *sem;
+	struct timespec before, after, duration;
+	unsigned nthreads, largest, after_largest;
+	unsigned i;
+	uint64_t usecs;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting multipage fragmentation test...\n");
+#if OPT_DUMBVM
+	kprintf("(This test will not work with dumbvm)\n");
+#endif
+
+	largest = malloctest5_largest();
+	kprintf("malloctest5: largest block before: %u pages\n", largest);
+
+	sem = sem_create("malloctest5", 0);
+	if (sem == NULL) {
+		panic("malloctest5: sem_create failed\n");
+	}
+
+	km5_allocs = 0;
+	km5_failures = 0;
+	nthreads = NTHREADS;
+
+	gettime(&before);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("malloctest5", NULL,
+				     malloctest5thread, sem, i);
+		if (result) {
+			panic("malloctest5: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	for (i=0; i<nthreads; i++) {
+		P(sem);
+	}
+	gettime(&after);
+	sem_destroy(sem);
+
+	timespec_sub(&after, &before, &duration);
+	usecs = duration.tv_sec * 1000000ULL + duration.tv_nsec / 1000;
+	kprintf("malloctest5: %u allocations, %u failed\n",
+		km5_allocs, km5_failures);
+	if (usecs > 0) {
+		kprintf("malloctest5: %llu allocations/sec\n",
+			(unsigned long long)km5_allocs * 1000000ULL / usecs);
+	}
+
+	after_largest = malloctest5_largest();
+	kprintf("malloctest5: largest block after: %u pages\n",
+		after_largest);
+	if (after_largest < largest) {
+		kprintf("malloctest5: freed blocks were not all coalesced\n");
+	}
+
+	kprintf("Multipage fragmentation test done\n");
+	return 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * Page table benchmark.
+ *
+ * Builds page tables for a few access patterns in a scratch address
+ * space and reports what they cost: memory per page mapped, and the
+ * page table's share of fault latency, both the first fault on a page
+ * (which creates its entry) and a later one (which finds it). The
+ * rest of the fault path does not depend on the page table.
+ *
+ * Run it in a kernel built with and without "options hashpt" (the
+ * HASHPT and GENERIC configs) to compare the two page tables.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <test.h>
+
+#define PT1_NPAGES 256
+
+/* User addresses are below 2G; keep clear of page 0 and the stack. */
+#define PT1_BASE  0x00400000
+#define PT1_RANGE 0x7f000000
+
+enum pt1_pattern {
+	PT1_DENSE,		/* consecutive pages */
+	PT1_SPARSE,		/* one page every 4M */
+	PT1_RANDOM,		/* anywhere */
+};
+
+static const char *const pt1_names[] = {
+	"dense", "sparse", "random",
+};
+
+static
+vaddr_t
+pt1_addr(enum pt1_pattern pattern, unsigned i)
+{
+	switch (pattern) {
+	    case PT1_DENSE:
+		return PT1_BASE + i * PAGE_SIZE;
+	    case PT1_SPARSE:
+		return PT1_BASE + i * PAGE_SIZE * 1024;
+	    case PT1_RANDOM:
+		return (PT1_BASE + random() % PT1_RANGE) & PAGE_FRAME;
+	}
+	panic("pt1: bad pattern %d\n", (int)pattern);
+}
+
+static
+uint64_t
+pt1_nsecs(const struct timespec *before, const struct timespec *after)
+{
+	struct timespec diff;
+
+	timespec_sub(after, before, &diff);
+	return diff.tv_sec * 1000000000ULL + diff.tv_nsec;
+}
+
+static
+int
+pt1_run(enum pt1_pattern pattern)
+{
+	struct addrspace *as;
+	struct timespec t0, t1, t2;
+	vaddr_t addrs[PT1_NPAGES];
+	size_t before, after;
+	unsigned i;
+
+	for (i = 0; i < PT1_NPAGES; i++) {
+		addrs[i] = pt1_addr(pattern, i);
+	}
+
+	lock_acquire(vm_lock);
+	before = pt_overhead();
+	lock_release(vm_lock);
+
+	as = as_create();
+	if (as == NULL) {
+		kprintf("pt1: as_create failed\n");
+		return ENOMEM;
+	}
+
+	lock_acquire(vm_lock);
+	gettime(&t0);
+	for (i = 0; i < PT1_NPAGES; i++) {
+		if (pt_lookup(as, addrs[i], true) == NULL) {
+			lock_release(vm_lock);
+			as_destroy(as);
+			kprintf("pt1: out of memory\n");
+			return ENOMEM;
+		}
+	}
+	gettime(&t1);
+	for (i = 0; i < PT1_NPAGES; i++) {
+		KASSERT(pt_lookup(as, addrs[i], false) != NULL);
+	}
+	gettime(&t2);
+	after = pt_overhead();
+	lock_release(vm_lock);
+
+	as_destroy(as);
+
+	kprintf("pt1: %-6s %u pages: %u bytes of page table (%u per page), "
+		"%llu ns to create an entry, %llu ns to find one\n",
+		pt1_names[pattern], PT1_NPAGES, (unsigned)(after - before),
+		(unsigned)((after - before) / PT1_NPAGES),
+		pt1_nsecs(&t0, &t1) / PT1_NPAGES,
+		pt1_nsecs(&t1, &t2) / PT1_NPAGES);
+	return 0;
+}
+
+int
+pagetabletest(int nargs, char **args)
+{
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+#if OPT_HASHPT
+	kprintf("Starting page table benchmark (hashed page table)...\n");
+#else
+	kprintf("Starting page table benchmark (two-level page table)...\n");
+#endif
+
+	result = pt1_run(PT1_DENSE);
+	if (result == 0) {
+		result = pt1_run(PT1_SPARSE);
+	}
+	if (result == 0) {
+		result = pt1_run(PT1_RANDOM);
+	}
+	if (result) {
+		return result;
+	}
+
+	kprintf("Page table benchmark done\n");
+	return 0;
+}
@@ -33,12 +33,14 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <objcache.h>
 
 #include <cpu.h>
 
@@ -140,31 +142,56 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * A free lock keeps its wait channel and spinlock, and is not held.
+ */
+static
+int
+lock_ctor(void *obj)
+{
+		struct lock *lock = obj;
+
+		lock->lock_wchan = wchan_create("lock");
+		if (lock->lock_wchan == NULL) {
+			return ENOMEM;
+		}
+		spinlock_init(&lock->lock_lock);
+		lock->heldby = NULL;
+		return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+		struct lock *lock = obj;
+
+		spinlock_cleanup(&lock->lock_lock);
+		wchan_destroy(lock->lock_wchan);
+}
+
+static struct objcache lock_cache =
+		OBJCACHE_INITIALIZER("lock", sizeof(struct lock),
+				     lock_ctor, lock_dtor);
+
 struct lock *
 lock_create(const char *name)
 {
 		struct lock *lock;
 
-		lock = kmalloc(sizeof(struct lock));
+		lock = objcache_alloc(&lock_cache);
 		if (lock == NULL) {
 				return NULL;
 		}
 
 		lock->lk_name = kstrdup(name);
 		if (lock->lk_name == NULL) {
-				kfree(lock);
+				objcache_free(&lock_cache, lock);
 				return NULL;
 		}
 
 		// add stuff here as needed
-		lock->lock_wchan = wchan_create(lock->lk_name);
-		if (lock->lock_wchan == NULL) {
-			kfree(lock->lk_name);
-			kfree(lock);
-			return NULL;
-		}
-
-		spinlock_init(&lock->lock_lock);
+		wchan_setname(lock->lock_wchan, lock->lk_name);
 		lock->heldby = NULL;
 
 		return lock;
@@ -176,10 +203,9 @@ lock_destroy(struct lock *lock)
 		KASSERT(lock != NULL);
 
 		// add stuff here as needed
-		spinlock_cleanup(&lock->lock_lock);
-		wchan_destroy(lock->lock_wchan);
+		wchan_setname(lock->lock_wchan, "lock");
 		kfree(lock->lk_name);
-		kfree(lock);
+		objcache_free(&lock_cache, lock);
 }
 
 void
@@ -227,31 +253,55 @@ lock_do_i_hold(struct lock *lock)
 // CV
 
 
+/*
+ * A free CV keeps its wait channel and spinlock, and has no waiters.
+ */
+static
+int
+cv_ctor(void *obj)
+{
+	struct cv *cv = obj;
+
+	cv->cv_wchan = wchan_create("cv");
+	if (cv->cv_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&cv->cv_lock);
+	return 0;
+}
+
+static
+void
+cv_dtor(void *obj)
+{
+	struct cv *cv = obj;
+
+	spinlock_cleanup(&cv->cv_lock);
+	wchan_destroy(cv->cv_wchan);
+}
+
+static struct objcache cv_cache =
+	OBJCACHE_INITIALIZER("cv", sizeof(struct cv), cv_ctor, cv_dtor);
+
 struct cv *
 cv_create(const char *name)
 {
 	struct cv *cv;
 
-	cv = kmalloc(sizeof(struct cv));
+	cv = objcache_alloc(&cv_cache);
 	if (cv == NULL) {
 			return NULL;
 	}
 
 	cv->cv_name = kstrdup(name);
 	if (cv->cv_name==NULL) {
-			kfree(cv);
+			objcache_free(&cv_cache, cv);
 			return NULL;
 	}
 
 	// add stuff here as needed
-	cv->cv_wchan = wchan_create(cv->cv_name);
-	if (cv->cv_wchan == NULL) {
-		kfree(cv->cv_name);
-		kfree(cv);
-		return NULL;
-	}
-
-	spinlock_init(&cv->cv_lock);
+	wchan_setname(cv->cv_wchan, cv->cv_name);
+	cv->cv_wcount = 0;
 
 	return cv;
 }
@@ -261,11 +311,9 @@ cv_destroy(struct cv *cv)
 {
 	KASSERT(cv != NULL);
 
-	spinlock_cleanup(&cv->cv_lock);
-	wchan_destroy(cv->cv_wchan);
-
+	wchan_setname(cv->cv_wchan, "cv");
 	kfree(cv->cv_name);
-	kfree(cv);
+	objcache_free(&cv_cache, cv);
 }
 
 void
@@ -51,6 +51,7 @@
 #include <mainbus.h>
 #include <vnode.h>
 #include <file.h>
+#include <objcache.h>
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -116,6 +117,36 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Constructor and destructor for the thread cache. A free thread has
+ * its list node unlinked and no stack.
+ */
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	thread_machdep_init(&thread->t_machdep);
+	threadlistnode_init(&thread->t_listnode, thread);
+	thread->t_stack = NULL;
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_machdep_cleanup(&thread->t_machdep);
+}
+
+static struct objcache thread_cache =
+	OBJCACHE_INITIALIZER("thread", sizeof(struct thread),
+			     thread_ctor, thread_dtor);
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -128,23 +159,20 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = objcache_alloc(&thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		objcache_free(&thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
-	/* Thread subsystem fields */
-	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
+	/* Thread subsystem fields (t_machdep, t_listnode, t_stack: ctor) */
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
@@ -156,6 +184,7 @@ thread_create(const char *name)
 
 	/* If you add to struct thread, be sure to initialize here */
 	bzero(thread->filtab, sizeof(struct fdesc *) * OPEN_MAX);
+	thread->t_vm_evicting = false;
 	return thread;
 }
 
@@ -199,6 +228,10 @@ cpu_create(unsigned hardware_number)
 	if (result != 0) {
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
+	frame_cache_init(&c->c_framecache, c->c_number);
+	kmalloc_cache_init(&c->c_kmcache, c->c_number);
+	vm_asid_init(&c->c_asids);
+	vm_tlb_init(&c->c_tlb, c->c_number);
 
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
 	c->c_curthread = thread_create(namebuf);
@@ -257,15 +290,17 @@ thread_destroy(struct thread *thread)
 	KASSERT(thread->t_proc == NULL);
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
+		thread->t_stack = NULL;
 	}
-	threadlistnode_cleanup(&thread->t_listnode);
-	thread_machdep_cleanup(&thread->t_machdep);
+	/* Back in the state thread_ctor left it in. */
+	KASSERT(thread->t_listnode.tln_prev == NULL);
+	KASSERT(thread->t_listnode.tln_next == NULL);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	objcache_free(&thread_cache, thread);
 }
 
 /*
@@ -645,7 +680,10 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			/* Zero a page for the VM system instead, if wanted. */
+			if (!frame_prezero()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -957,25 +995,19 @@ thread_consider_migration(void)
  */
 
 /*
- * Create a wait channel. NAME is a symbolic string name for it.
- * This is what's displayed by ps -alx in Unix.
- *
- * NAME should generally be a string constant. If it isn't, alternate
- * arrangements should be made to free it after the wait channel is
- * destroyed.
+ * Constructor and destructor for the wait channel cache. A wait
+ * channel is on allwchans[] for as long as it is constructed, free or
+ * not, so creating one doesn't have to take allwchans_lock.
  */
-struct wchan *
-wchan_create(const char *name)
+static
+int
+wchan_ctor(void *obj)
 {
-	struct wchan *wc;
+	struct wchan *wc = obj;
 	int result;
 
-	wc = kmalloc(sizeof(*wc));
-	if (wc == NULL) {
-		return NULL;
-	}
 	threadlist_init(&wc->wc_threads);
-	wc->wc_name = name;
+	wc->wc_name = "FREE";
 
 	/* add to allwchans[] */
 	spinlock_acquire(&allwchans_lock);
@@ -984,20 +1016,16 @@ wchan_create(const char *name)
 	if (result) {
 		KASSERT(result == ENOMEM);
 		threadlist_cleanup(&wc->wc_threads);
-		kfree(wc);
-		return NULL;
+		return result;
 	}
-
-	return wc;
+	return 0;
 }
 
-/*
- * Destroy a wait channel. Must be empty and unlocked.
- * (The corresponding cleanup functions require this.)
- */
+static
 void
-wchan_destroy(struct wchan *wc)
+wchan_dtor(void *obj)
 {
+	struct wchan *wc = obj;
 	unsigned num;
 	struct wchan *wc2;
 
@@ -1015,7 +1043,54 @@ wchan_destroy(struct wchan *wc)
 	spinlock_release(&allwchans_lock);
 
 	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+}
+
+static struct objcache wchan_cache =
+	OBJCACHE_INITIALIZER("wchan", sizeof(struct wchan),
+			     wchan_ctor, wchan_dtor);
+
+/*
+ * Create a wait channel. NAME is a symbolic string name for it.
+ * This is what's displayed by ps -alx in Unix.
+ *
+ * NAME should generally be a string constant. If it isn't, alternate
+ * arrangements should be made to free it after the wait channel is
+ * destroyed.
+ */
+struct wchan *
+wchan_create(const char *name)
+{
+	struct wchan *wc;
+
+	wc = objcache_alloc(&wchan_cache);
+	if (wc == NULL) {
+		return NULL;
+	}
+	wc->wc_name = name;
+	return wc;
+}
+
+/*
+ * Destroy a wait channel. Must be empty and unlocked.
+ * (The corresponding cleanup functions require this.)
+ */
+void
+wchan_destroy(struct wchan *wc)
+{
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	wc->wc_name = "FREE";
+	objcache_free(&wchan_cache, wc);
+}
+
+/*
+ * Rename a wait channel. Used for the wait channels of cached locks
+ * and CVs, which are made before their owners have names.
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	wc->wc_name = name;
 }
 
 /*
@@ -1174,6 +1249,22 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+unsigned
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping)
+{
+	unsigned i, n = 0;
+	struct cpu *c;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self) {
+			ipi_tlbshootdown(c, mapping);
+			n++;
+		}
+	}
+	return n;
+}
+
 void
 interprocessor_interrupt(void)
 {
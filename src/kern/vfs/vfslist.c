@@ -43,6 +43,8 @@
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <textcache.h>
+#include "opt-dumbvm.h"
 
 /*
  * Structure for a single named device.
@@ -558,6 +560,11 @@ vfs_unmount(const char *devname)
 	struct knowndev *kd;
 	int result;
 
+#if !OPT_DUMBVM
+	/* Unused shared text holds vnodes; let go of them first. */
+	textcache_purge();
+#endif
+
 	vfs_biglock_acquire();
 
 	result = findmount(devname, &kd);
@@ -605,6 +612,10 @@ vfs_unmountall(void)
 	unsigned i, num;
 	int result;
 
+#if !OPT_DUMBVM
+	textcache_purge();
+#endif
+
 	vfs_biglock_acquire();
 
 	num = knowndevarray_num(knowndevs);
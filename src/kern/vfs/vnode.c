@@ -50,6 +50,7 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 	vn->vn_ops = ops;
 	vn->vn_refcount = 1;
 	spinlock_init(&vn->vn_countlock);
+	vn->vn_writes = 0;
 	vn->vn_fs = fs;
 	vn->vn_data = fsdata;
 	return 0;
@@ -122,6 +123,54 @@ vnode_decref(struct vnode *vn)
 	}
 }
 
+static
+void
+vnode_written(struct vnode *vn)
+{
+	spinlock_acquire(&vn->vn_countlock);
+	vn->vn_writes++;
+	spinlock_release(&vn->vn_countlock);
+}
+
+/*
+ * Write, and count it.
+ * Called by VOP_WRITE.
+ */
+int
+vnode_write(struct vnode *vn, struct uio *uio)
+{
+	int result;
+
+	result = __VOP(vn, write)(vn, uio);
+	vnode_written(vn);
+	return result;
+}
+
+/*
+ * Truncate, and count it.
+ * Called by VOP_TRUNCATE.
+ */
+int
+vnode_truncate(struct vnode *vn, off_t len)
+{
+	int result;
+
+	result = __VOP(vn, truncate)(vn, len);
+	vnode_written(vn);
+	return result;
+}
+
+unsigned
+vnode_writes(struct vnode *vn)
+{
+	unsigned writes;
+
+	spinlock_acquire(&vn->vn_countlock);
+	writes = vn->vn_writes;
+	spinlock_release(&vn->vn_countlock);
+	return writes;
+}
+
 /*
  * Check for various things being valid.
  * Called before all VOP_* calls.
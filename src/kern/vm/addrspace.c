@@ -29,7 +29,10 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
 #include <lib.h>
+#include <uio.h>
 #include <spl.h>
 #include <spinlock.h>
 #include <current.h>
@@ -37,12 +40,36 @@
 #include <addrspace.h>
 #include <vm.h>
 #include <proc.h>
+#include <synch.h>
+#include <vnode.h>
+#include <textcache.h>
+#include <pagecache.h>
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
  * assignment, this file is not compiled or linked or in any way
  * used. The cheesy hack versions in dumbvm.c are used instead.
  */
 
+/*
+ * Copy the N elements of SIZE bytes at SRC into a new array, with
+ * room for EXTRA more. The old array is left alone.
+ */
+static
+void *
+as_array_copy(const void *src, unsigned n, unsigned extra, size_t size)
+{
+	void *dst;
+
+	if (n + extra == 0) {
+		return NULL;
+	}
+	dst = kmalloc((n + extra) * size);
+	if (dst != NULL && n > 0) {
+		memcpy(dst, src, n * size);
+	}
+	return dst;
+}
+
 struct addrspace *
 as_create(void)
 {
@@ -53,17 +80,29 @@ as_create(void)
 		return NULL;
 	}
 
-	as->page_table = kmalloc(sizeof(page_table_entry*) * PAGE_TABLE_SIZE);
-	if (as->page_table == NULL){
+	if (pt_create(as)) {
 		kfree(as);
 		return NULL;
 	}
 
-	as->as_vbase1 = 0;
-	as->as_npages1 = 0;
-	as->as_vbase2 = 0;
-	as->as_npages2 = 0;
-	bzero((void *)as->page_table, sizeof(page_table_entry*) * PAGE_TABLE_SIZE);
+	as->as_regions = NULL;
+	as->as_nregions = 0;
+
+	as->as_vnode = NULL;
+	as->as_segments = NULL;
+	as->as_nsegments = 0;
+	as->as_heapbase = 0;
+	as->as_heaptop = 0;
+	as->as_mmaps = NULL;
+	as->as_stackbase = USERSTACK;
+	as->as_text = NULL;
+	as->as_transit = 0;
+	bzero(as->as_asid, sizeof(as->as_asid));
+
+	as->as_fa_last = 0;
+	as->as_fa_next = 0;
+	as->as_fa_dir = 1;
+	as->as_fa_window = 0;
 
 	/*
 	 * Initialize as needed.
@@ -76,17 +115,64 @@ int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *newas;
+	int result;
 
 	newas = as_create();
 	if (newas==NULL) {
 		return ENOMEM;
 	}
 
+	newas->as_regions = as_array_copy(old->as_regions, old->as_nregions,
+					  0, sizeof(struct as_region));
+	newas->as_segments = as_array_copy(old->as_segments,
+					   old->as_nsegments, 0,
+					   sizeof(struct as_segment));
+	if ((newas->as_regions == NULL && old->as_nregions > 0) ||
+	    (newas->as_segments == NULL && old->as_nsegments > 0)) {
+		as_destroy(newas);
+		return ENOMEM;
+	}
+	newas->as_nregions = old->as_nregions;
+	newas->as_nsegments = old->as_nsegments;
+	newas->as_heapbase = old->as_heapbase;
+	newas->as_heaptop = old->as_heaptop;
+	newas->as_stackbase = old->as_stackbase;
+
+	/* Pages not yet loaded from the executable will load the same way. */
+	if (old->as_vnode != NULL) {
+		VOP_INCREF(old->as_vnode);
+		newas->as_vnode = old->as_vnode;
+	}
+
 	/*
-	 * Write this.
+	 * Share every resident page copy-on-write instead of copying
+	 * it; the first write on either side takes a private copy.
 	 */
+	lock_acquire(vm_lock);
+	vm_transit_wait(old);
+	if (old->as_text != NULL) {
+		textcache_share(old->as_text);
+		newas->as_text = old->as_text;
+	}
+	result = as_mmap_copy(old, newas);
+	if (result == 0) {
+		result = pt_copy(old, newas);
+	}
+	lock_release(vm_lock);
+	if (result) {
+		as_destroy(newas);
+		return result;
+	}
 
-	(void)old;
+	/*
+	 * The old address space's pages just became read-only, but
+	 * TLBs may still hold writable entries for them under its
+	 * ASIDs. Rather than hunt those down, give it new ones.
+	 */
+	vm_asid_retire(old);
+	if (old == proc_getas()) {
+		as_activate();
+	}
 
 	*ret = newas;
 	return 0;
@@ -95,11 +181,34 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 void
 as_destroy(struct addrspace *as)
 {
+	as_mmap_destroy(as);
+
 	/*
+	 * Drop our TLB entries once, up front, rather than page by
+	 * page: after this no TLB can reach our frames.
+	 */
+	vm_asid_release(as);
 
-	 * Clean up as needed.
+	/*
+	 * Give back every frame and swap slot, and the page table.
+	 * vm_lock keeps the pager from picking one of our frames
+	 * meanwhile, once the pages it is already moving have landed.
 	 */
+	lock_acquire(vm_lock);
+	vm_transit_wait(as);
+	pt_destroy(as);
+	if (as->as_text != NULL) {
+		textcache_detach(as->as_text);
+	}
+	lock_release(vm_lock);
+	textcache_reap();
 
+	if (as->as_vnode != NULL) {
+		VOP_DECREF(as->as_vnode);
+	}
+
+	kfree(as->as_regions);
+	kfree(as->as_segments);
 	kfree(as);
 }
 
@@ -107,6 +216,7 @@ void
 as_activate(void)
 {
 	struct addrspace *as;
+	int spl;
 
 	as = proc_getas();
 	if (as == NULL) {
@@ -118,8 +228,13 @@ as_activate(void)
 	}
 
 	/*
-	 * Write this.
+	 * Entries are tagged with ASIDs, so there is nothing to flush:
+	 * just switch EntryHi over to this address space's ASID.
+	 * Disable interrupts on this CPU while frobbing the TLB.
 	 */
+	spl = splhigh();
+	vm_asid_activate(as);
+	splx(spl);
 }
 
 void
@@ -132,29 +247,126 @@ as_deactivate(void)
 	 */
 }
 
+/*
+ * The index of the first region that ends above VADDR, or
+ * as_nregions if there is none; VADDR is in that region if it does
+ * not start above VADDR.
+ */
+static
+unsigned
+as_region_search(struct addrspace *as, vaddr_t vaddr)
+{
+	struct as_region *rg;
+	unsigned lo, hi, mid;
+
+	lo = 0;
+	hi = as->as_nregions;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		rg = &as->as_regions[mid];
+		if (vaddr >= rg->rg_base + rg->rg_npages * PAGE_SIZE) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static
+struct as_region *
+as_region_find(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned i;
+
+	i = as_region_search(as, vaddr);
+	if (i < as->as_nregions && as->as_regions[i].rg_base <= vaddr) {
+		return &as->as_regions[i];
+	}
+	return NULL;
+}
+
+/*
+ * Make room for a region at index I, moving the ones from I on up.
+ */
+static
+int
+as_region_insert(struct addrspace *as, unsigned i, vaddr_t base,
+		 size_t npages, unsigned perm)
+{
+	struct as_region *regions;
+
+	KASSERT(i <= as->as_nregions);
+
+	regions = as_array_copy(as->as_regions, i, as->as_nregions - i + 1,
+				sizeof(*regions));
+	if (regions == NULL) {
+		return ENOMEM;
+	}
+	memcpy(&regions[i + 1], &as->as_regions[i],
+	       (as->as_nregions - i) * sizeof(*regions));
+	regions[i].rg_base = base;
+	regions[i].rg_npages = npages;
+	regions[i].rg_perm = perm;
+
+	kfree(as->as_regions);
+	as->as_regions = regions;
+	as->as_nregions++;
+	return 0;
+}
+
+/*
+ * If VADDR is inside a region, rather than at its start, cut the
+ * region in two there.
+ */
+static
+int
+as_region_split(struct addrspace *as, vaddr_t vaddr)
+{
+	struct as_region *rg;
+	unsigned i;
+	size_t npages;
+	int result;
+
+	i = as_region_search(as, vaddr);
+	if (i == as->as_nregions || as->as_regions[i].rg_base >= vaddr) {
+		return 0;
+	}
+	rg = &as->as_regions[i];
+	npages = (vaddr - rg->rg_base) / PAGE_SIZE;
+	result = as_region_insert(as, i + 1, vaddr, rg->rg_npages - npages,
+				  rg->rg_perm);
+	if (result) {
+		return result;
+	}
+	/* The array moved. */
+	as->as_regions[i].rg_npages = npages;
+	return 0;
+}
+
 /*
  * Set up a segment at virtual address VADDR of size MEMSIZE. The
  * segment in memory extends from VADDR up to (but not including)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment. Pages
+ * without write permission are mapped read-only, and writing them
+ * is an error. Segments need not be page aligned, so two of them can
+ * share a page; it gets both their permissions.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
 {
-	/*
-	 * Write this.
-	 */
+	vaddr_t top, end;
+	unsigned perm, i;
+	int result;
 
-	(void)readable;
-	(void)writeable;
-	(void)executable;
-
-	size_t npages;
+	if (vaddr >= USERSPACETOP || sz > USERSPACETOP - vaddr) {
+		return EFAULT;
+	}
 
 	/* Align the region. First, the base... */
 	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
@@ -163,113 +375,669 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	/* ...and now the length. */
 	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
 
-	npages = sz / PAGE_SIZE;
+	if (sz == 0) {
+		return 0;
+	}
+	top = vaddr + sz;
 
-	/* We don't use these - all pages are read-write */
-	(void)readable;
-	(void)writeable;
-	(void)executable;
+	perm = (readable ? AS_PERM_READ : 0) |
+		(writeable ? AS_PERM_WRITE : 0) |
+		(executable ? AS_PERM_EXEC : 0);
 
-	if (as->as_vbase1 == 0) {
-		as->as_vbase1 = vaddr;
-		as->as_npages1 = npages;
-		return 0;
+	/*
+	 * Cut any region sticking out past either end, so that each one
+	 * is now either all inside [vaddr, top) or all outside. Then add
+	 * the permissions to the ones inside, and fill the gaps.
+	 */
+	result = as_region_split(as, vaddr);
+	if (result == 0) {
+		result = as_region_split(as, top);
+	}
+	if (result) {
+		return result;
 	}
 
-	if (as->as_vbase2 == 0) {
-		as->as_vbase2 = vaddr;
-		as->as_npages2 = npages;
-		return 0;
+	i = as_region_search(as, vaddr);
+	while (vaddr < top) {
+		if (i < as->as_nregions && as->as_regions[i].rg_base == vaddr) {
+			as->as_regions[i].rg_perm |= perm;
+			vaddr += as->as_regions[i].rg_npages * PAGE_SIZE;
+			i++;
+			continue;
+		}
+		end = top;
+		if (i < as->as_nregions && as->as_regions[i].rg_base < top) {
+			end = as->as_regions[i].rg_base;
+		}
+		result = as_region_insert(as, i, vaddr,
+					  (end - vaddr) / PAGE_SIZE, perm);
+		if (result) {
+			return result;
+		}
+		vaddr = end;
+		i++;
 	}
 
+	return 0;
+}
+
+int
+as_prepare_load(struct addrspace *as)
+{
 	/*
-	 * Support for more than two regions is not available.
+	 * Nothing to do: pages are allocated, and read from the
+	 * executable, when they are first touched.
 	 */
-	kprintf("dumbvm: Warning: too many regions\n");
 
-	return ENOSYS;
+	(void)as;
+	return 0;
 }
 
+/*
+ * The first read-only segment is the text; it is shared with every
+ * other address space running V.
+ */
 int
-getppages(struct addrspace *as, vaddr_t vbase, size_t npage)
+as_define_segment(struct addrspace *as, struct vnode *v,
+		  off_t offset, vaddr_t vaddr, size_t memsz, size_t filesz)
 {
-	vaddr_t addr;
-	int pt1;
-	int pt2;
-	int offset;
+	struct as_segment *seg, *segments;
+	struct as_region *rg;
+	vaddr_t base, top;
+	bool writeable;
+	int result;
 
-	if (vbase > USERSTACK) {
-		return EFAULT;
+	KASSERT(filesz <= memsz);
+
+	if (as->as_vnode != NULL && as->as_vnode != v) {
+		return EINVAL;
+	}
+
+	segments = as_array_copy(as->as_segments, as->as_nsegments, 1,
+				 sizeof(*segments));
+	if (segments == NULL) {
+		return ENOMEM;
+	}
+	kfree(as->as_segments);
+	as->as_segments = segments;
+
+	if (as->as_vnode == NULL) {
+		VOP_INCREF(v);
+		as->as_vnode = v;
+	}
+
+	/* The last page may be shared with a writeable segment. */
+	rg = as_region_find(as, vaddr);
+	if (rg != NULL) {
+		writeable = (rg->rg_perm & AS_PERM_WRITE) != 0;
+	}
+	else {
+		/* Not in any region; play safe. */
+		writeable = true;
+	}
+
+	if (!writeable && as->as_text == NULL && memsz > 0) {
+		base = vaddr & PAGE_FRAME;
+		top = (vaddr + memsz + PAGE_SIZE - 1) & PAGE_FRAME;
+		lock_acquire(vm_lock);
+		result = textcache_attach(v, base, top, &as->as_text);
+		lock_release(vm_lock);
+		if (result == ENOMEM) {
+			return result;
+		}
+		/* Otherwise, if we can't share, just load privately. */
+	}
+
+	seg = &as->as_segments[as->as_nsegments++];
+	seg->seg_vaddr = vaddr;
+	seg->seg_offset = offset;
+	seg->seg_filesz = filesz;
+	seg->seg_memsz = memsz;
+	seg->seg_writeable = writeable;
+
+	return 0;
+}
+
+/*
+ * KPAGE is already zeroed, which takes care of bss and of any part
+ * of the page no segment covers; only the file-backed bytes are read.
+ * A page can straddle two segments, so all of them are checked.
+ */
+int
+as_fill_page(struct addrspace *as, vaddr_t vaddr, vaddr_t kpage)
+{
+	struct as_segment *seg;
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	int result;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	for (unsigned i = 0; i < as->as_nsegments; i++) {
+		seg = &as->as_segments[i];
+
+		/* Intersect the page with the file-backed part. */
+		start = vaddr > seg->seg_vaddr ? vaddr : seg->seg_vaddr;
+		end = vaddr + PAGE_SIZE;
+		if (end > seg->seg_vaddr + seg->seg_filesz) {
+			end = seg->seg_vaddr + seg->seg_filesz;
+		}
+		if (start >= end) {
+			continue;
+		}
+
+		uio_kinit(&iov, &ku, (void *)(kpage + (start - vaddr)),
+			  end - start,
+			  seg->seg_offset + (start - seg->seg_vaddr),
+			  UIO_READ);
+		result = VOP_READ(as->as_vnode, &ku);
+		if (result) {
+			return result;
+		}
+		if (ku.uio_resid != 0) {
+			kprintf("vm: short read paging in 0x%x\n", vaddr);
+			return EIO;
+		}
+	}
+
+	return 0;
+}
+
+bool
+as_region_bounds(struct addrspace *as, vaddr_t vaddr,
+		 vaddr_t *base, vaddr_t *top)
+{
+	struct as_region *rg;
+	struct as_mmap *m;
+
+	rg = as_region_find(as, vaddr);
+	if (rg != NULL) {
+		*base = rg->rg_base;
+		*top = rg->rg_base + rg->rg_npages * PAGE_SIZE;
+		return true;
 	}
+	if (vaddr >= as->as_heapbase &&
+	    vaddr < ROUNDUP(as->as_heaptop, PAGE_SIZE)) {
+		*base = as->as_heapbase;
+		*top = ROUNDUP(as->as_heaptop, PAGE_SIZE);
+		return true;
+	}
+	for (m = as->as_mmaps; m != NULL; m = m->mm_next) {
+		if (vaddr >= m->mm_base &&
+		    vaddr < m->mm_base + m->mm_npages * PAGE_SIZE) {
+			*base = m->mm_base;
+			*top = m->mm_base + m->mm_npages * PAGE_SIZE;
+			return true;
+		}
+	}
+	if (vaddr >= as->as_stackbase && vaddr < USERSTACK) {
+		*base = as->as_stackbase;
+		*top = USERSTACK;
+		return true;
+	}
+	return false;
+}
 
-	pt1 = (int)PT1_INDEX(vbase);
-	pt2 = (int)PT2_INDEX(vbase);
-	offset = (int)PT_OFFSET(vbase);
+/*
+ * Nothing lies between the stack and the highest mapping, or the
+ * break if there is none, but the one guard page.
+ */
+vaddr_t
+as_stack_floor(struct addrspace *as)
+{
+	vaddr_t floor;
 
-	/* Align vaddr to PAGE_SIZE */
-	// page_base = vbase / PAGE_SIZE;
+	floor = ROUNDUP(as->as_heaptop, PAGE_SIZE);
+	if (as->as_mmaps != NULL) {
+		floor = as->as_mmaps->mm_base +
+			as->as_mmaps->mm_npages * PAGE_SIZE;
+	}
+	return floor + PAGE_SIZE;
+}
+
+/*
+ * The top of what mmap and sbrk may use: below the stack's reserve,
+ * and below the stack's pages and their guard page if it has grown
+ * past that.
+ */
+static
+vaddr_t
+as_stack_limit(struct addrspace *as)
+{
+	vaddr_t limit = USERSTACK - AS_STACKPAGES * PAGE_SIZE;
 
-	if (as->page_table[pt1] == NULL) {
-		as->page_table[pt1] = kmalloc(sizeof(page_table_entry) * PAGE_TABLE_SIZE);
-		if (as->page_table[pt1] == NULL) {
+	if (as->as_stackbase - PAGE_SIZE < limit) {
+		limit = as->as_stackbase - PAGE_SIZE;
+	}
+	return limit;
+}
+
+/*
+ * Checked on every fault, so the executable's regions, which most
+ * faults are in, come first; then the heap and stack, then mapped
+ * files.
+ */
+unsigned
+as_perm(struct addrspace *as, vaddr_t vaddr)
+{
+	struct as_region *rg;
+	struct as_mmap *m;
+	unsigned perm;
+
+	rg = as_region_find(as, vaddr);
+	if (rg != NULL) {
+		return rg->rg_perm;
+	}
+	if (vaddr >= as->as_heapbase &&
+	    vaddr < ROUNDUP(as->as_heaptop, PAGE_SIZE)) {
+		return AS_PERM_READ | AS_PERM_WRITE;
+	}
+	if (vaddr >= as_stack_floor(as) && vaddr < USERSTACK) {
+		return AS_PERM_READ | AS_PERM_WRITE;
+	}
+	m = as_mmap_lookup(as, vaddr);
+	if (m == NULL) {
+		return 0;
+	}
+	perm = 0;
+	if (m->mm_prot & PROT_READ) {
+		perm |= AS_PERM_READ;
+	}
+	if (m->mm_prot & PROT_WRITE) {
+		perm |= AS_PERM_WRITE;
+	}
+	if (m->mm_prot & PROT_EXEC) {
+		perm |= AS_PERM_EXEC;
+	}
+	return perm;
+}
+
+bool
+as_page_is_anon(struct addrspace *as, vaddr_t vaddr)
+{
+	struct as_segment *seg;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	for (unsigned i = 0; i < as->as_nsegments; i++) {
+		seg = &as->as_segments[i];
+		if (seg->seg_filesz > 0 &&
+		    seg->seg_vaddr < vaddr + PAGE_SIZE &&
+		    vaddr < seg->seg_vaddr + seg->seg_filesz) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * A page that also holds part of a writeable segment (e.g. the start
+ * of the data) is private, even if it is in the text range.
+ */
+bool
+as_shares_text(struct addrspace *as, vaddr_t vaddr)
+{
+	struct as_segment *seg;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	if (as->as_text == NULL || !textcache_covers(as->as_text, vaddr)) {
+		return false;
+	}
+	for (unsigned i = 0; i < as->as_nsegments; i++) {
+		seg = &as->as_segments[i];
+		if (seg->seg_writeable &&
+		    seg->seg_vaddr < vaddr + PAGE_SIZE &&
+		    vaddr < seg->seg_vaddr + seg->seg_memsz) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * The break starts out at the heap base; as_sbrk moves it.
+ */
+int
+as_complete_load(struct addrspace *as)
+{
+	struct as_region *rg;
+
+	as->as_heapbase = 0;
+	if (as->as_nregions > 0) {
+		rg = &as->as_regions[as->as_nregions - 1];
+		as->as_heapbase = rg->rg_base + rg->rg_npages * PAGE_SIZE;
+	}
+	as->as_heaptop = as->as_heapbase;
+
+	return 0;
+}
+
+/*
+ * Growing the heap allocates nothing; its pages are zero-filled on
+ * first touch like any other anonymous memory. The heap may not run
+ * into a mapped file or the stack's room, nor shrink below its base.
+ *
+ * Shrinking frees the pages wholly above the new break in one pass,
+ * then gets rid of their TLB entries on every cpu at once by giving
+ * the address space new ASIDs, rather than one shootdown per page.
+ */
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	vaddr_t limit = as_stack_limit(as);
+	vaddr_t oldtop, newtop, brk;
+	struct as_mmap *m;
+
+	/* The lowest mapping is the last. */
+	for (m = as->as_mmaps; m != NULL; m = m->mm_next) {
+		limit = m->mm_base;
+	}
+
+	brk = as->as_heaptop;
+	if (amount >= 0) {
+		if (brk + amount < brk || brk + amount > limit) {
 			return ENOMEM;
 		}
 	}
+	else {
+		if (0 - (vaddr_t)amount > brk - as->as_heapbase) {
+			return EINVAL;
+		}
+	}
 
-	/* Store KV addr of page, additional info not included yet, TBD */
-	for(unsigned i = 0; i < npage; i++){
-		addr = alloc_kpages(1);
-		if (addr == 0) {
-			for(unsigned j = 0; j < i; j++){
-				free_kpages(as->page_table[pt1][pt2 + j]);
-				return ENOMEM;
-			}
+	oldtop = ROUNDUP(brk, PAGE_SIZE);
+	newtop = ROUNDUP(brk + amount, PAGE_SIZE);
+	as->as_heaptop = brk + amount;
+
+	if (newtop < oldtop) {
+		lock_acquire(vm_lock);
+		vm_transit_wait(as);
+		pt_release(as, newtop, oldtop);
+		lock_release(vm_lock);
+
+		vm_asid_retire(as);
+		if (as == proc_getas()) {
+			as_activate();
 		}
-		as->page_table[pt1][pt2] = addr;
-		KASSERT(addr != 0);
-		bzero((void*)addr, PAGE_SIZE);
 	}
 
+	*oldbreak = brk;
 	return 0;
 }
 
+/*
+ * Mappings are placed top down from below the stack's room, in the highest
+ * gap big enough, and may come down as far as the heap's break. The
+ * pagecache is attached now so that all that is left for a fault to
+ * do is find or read the page.
+ */
 int
-as_prepare_load(struct addrspace *as)
+as_mmap(struct addrspace *as, struct vnode *v, off_t offset, size_t npages,
+	int prot, bool shared, vaddr_t *ret)
 {
-	/*
-	 * Write this.
-	 */
-	vaddr_t result;
+	struct as_mmap *m, **p;
+	vaddr_t top, floor;
+	size_t len;
+	int result;
 
-	result = getppages(as, as->as_vbase1, as->as_npages1);
-	if (result) {
-		return result;
+	if (offset < 0 || offset % PAGE_SIZE != 0 || npages == 0) {
+		return EINVAL;
+	}
+	if (npages > USERSPACETOP / PAGE_SIZE ||
+	    offset / PAGE_SIZE > USERSPACETOP / PAGE_SIZE) {
+		return ENOMEM;
+	}
+	len = npages * PAGE_SIZE;
+
+	top = as_stack_limit(as);
+	for (p = &as->as_mmaps; *p != NULL; p = &(*p)->mm_next) {
+		if (top - ((*p)->mm_base + (*p)->mm_npages * PAGE_SIZE) >= len) {
+			break;
+		}
+		top = (*p)->mm_base;
+	}
+	floor = ROUNDUP(as->as_heaptop, PAGE_SIZE);
+	if (*p == NULL && (top < floor || top - floor < len)) {
+		return ENOMEM;
+	}
+
+	m = kmalloc(sizeof(*m));
+	if (m == NULL) {
+		return ENOMEM;
 	}
+	m->mm_base = top - len;
+	m->mm_npages = npages;
+	m->mm_vnode = v;
+	m->mm_offset = offset;
+	m->mm_prot = prot;
+	m->mm_shared = shared;
 
-	result = getppages(as, as->as_vbase2, as->as_npages2);
+	lock_acquire(vm_lock);
+	result = pagecache_attach(v, offset / PAGE_SIZE + npages, &m->mm_cache);
+	lock_release(vm_lock);
 	if (result) {
+		kfree(m);
 		return result;
 	}
+	VOP_INCREF(v);
 
-	result = getppages(as, USERSTACK - 1, 1);
+	m->mm_next = *p;
+	*p = m;
+
+	*ret = m->mm_base;
+	return 0;
+}
+
+/*
+ * Write back the dirty pages of M in [VADDR, VADDR + NPAGES pages).
+ * Whichever mapping of a page goes away, it writes the page back, so
+ * a page dirtied through one mapping and still mapped by another is
+ * written when either goes. The file is written without vm_lock
+ * held, the same as it is read, and never extended: the part of a
+ * page past the end of file is not part of the file.
+ *
+ * Each page written is made read-only in AS again, so that the next
+ * write through it marks it dirty again; the caller drops the TLB
+ * entries. Returns the first error, after trying every page.
+ */
+static
+int
+as_mmap_writeback(struct addrspace *as, struct as_mmap *m,
+		  vaddr_t vaddr, size_t npages)
+{
+	page_table_entry *pte;
+	struct iovec iov;
+	struct uio ku;
+	struct stat st;
+	paddr_t paddr, mapped;
+	vaddr_t va;
+	off_t off;
+	size_t len;
+	int result, err = 0;
+
+	result = VOP_STAT(m->mm_vnode, &st);
 	if (result) {
-		return result;
+		kprintf("vm: cannot write back mapping at 0x%x: %s\n",
+			m->mm_base, strerror(result));
+		st.st_size = 0;
+		err = result;
+	}
+
+	for (unsigned i = 0; i < npages; i++) {
+		va = vaddr + i * PAGE_SIZE;
+		off = m->mm_offset + (off_t)(va - m->mm_base);
+
+		lock_acquire(vm_lock);
+		pte = pt_lookup(as, va, false);
+		mapped = (pte != NULL && (*pte & PTE_VALID)) ?
+			PTE_PADDR(*pte) : 0;
+		paddr = pagecache_clean(m->mm_cache, off / PAGE_SIZE, mapped);
+		if (paddr != 0 && mapped == paddr) {
+			*pte &= ~PTE_WRITE;
+		}
+		lock_release(vm_lock);
+
+		if (paddr == 0) {
+			continue;
+		}
+		if (off < st.st_size) {
+			len = st.st_size - off < PAGE_SIZE ?
+				st.st_size - off : PAGE_SIZE;
+			uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr),
+				  len, off, UIO_WRITE);
+			result = VOP_WRITE(m->mm_vnode, &ku);
+			if (result) {
+				kprintf("vm: write back of 0x%x failed: %s\n",
+					va, strerror(result));
+				if (err == 0) {
+					err = result;
+				}
+			}
+		}
+		frame_decref(paddr);
 	}
+	return err;
+}
+
+/*
+ * Write back M's pages, free the ones AS has faulted in, and free M.
+ * M is already off AS's list. TLB entries are the caller's problem.
+ */
+static
+void
+as_mmap_remove(struct addrspace *as, struct as_mmap *m)
+{
+	as_mmap_writeback(as, m, m->mm_base, m->mm_npages);
+
+	lock_acquire(vm_lock);
+	vm_transit_wait(as);
+	pt_release(as, m->mm_base, m->mm_base + m->mm_npages * PAGE_SIZE);
+	pagecache_detach(m->mm_cache);
+	lock_release(vm_lock);
 
+	VOP_DECREF(m->mm_vnode);
+	kfree(m);
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t npages)
+{
+	struct as_mmap *m, **p;
+
+	for (p = &as->as_mmaps; *p != NULL; p = &(*p)->mm_next) {
+		if ((*p)->mm_base == vaddr && (*p)->mm_npages == npages) {
+			break;
+		}
+	}
+	m = *p;
+	if (m == NULL) {
+		return EINVAL;
+	}
+	*p = m->mm_next;
+
+	as_mmap_remove(as, m);
+
+	/* As for sbrk: drop all the pages' TLB entries at once. */
+	vm_asid_retire(as);
+	if (as == proc_getas()) {
+		as_activate();
+	}
 	return 0;
 }
 
 int
-as_complete_load(struct addrspace *as)
+as_msync(struct addrspace *as, vaddr_t vaddr, size_t npages, bool sync)
 {
-	/*
-	 * Write this.
-	 */
+	struct as_mmap *m;
+	int result;
 
-	(void)as;
+	m = as_mmap_lookup(as, vaddr);
+	if (m == NULL ||
+	    npages > m->mm_npages - (vaddr - m->mm_base) / PAGE_SIZE) {
+		return ENOMEM;
+	}
+	if (!m->mm_shared) {
+		/* Private pages never go back to the file. */
+		return 0;
+	}
+
+	result = as_mmap_writeback(as, m, vaddr, npages);
+
+	/* The pages written back are read-only now; lose the old entries. */
+	vm_asid_retire(as);
+	if (as == proc_getas()) {
+		as_activate();
+	}
+
+	if (result == 0 && sync) {
+		result = VOP_FSYNC(m->mm_vnode);
+	}
+	return result;
+}
+
+struct as_mmap *
+as_mmap_lookup(struct addrspace *as, vaddr_t vaddr)
+{
+	struct as_mmap *m;
+
+	for (m = as->as_mmaps; m != NULL; m = m->mm_next) {
+		if (vaddr >= m->mm_base &&
+		    vaddr < m->mm_base + m->mm_npages * PAGE_SIZE) {
+			return m;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Called with vm_lock held, from as_copy. If this fails, NEW has
+ * the mappings copied so far and the caller destroys it.
+ */
+int
+as_mmap_copy(struct addrspace *old, struct addrspace *new)
+{
+	struct as_mmap *m, *n, **tail;
+	int result;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	tail = &new->as_mmaps;
+	for (m = old->as_mmaps; m != NULL; m = m->mm_next) {
+		n = kmalloc(sizeof(*n));
+		if (n == NULL) {
+			return ENOMEM;
+		}
+		*n = *m;
+		n->mm_next = NULL;
+		result = pagecache_attach(m->mm_vnode,
+					  m->mm_offset / PAGE_SIZE + m->mm_npages,
+					  &n->mm_cache);
+		if (result) {
+			kfree(n);
+			return result;
+		}
+		VOP_INCREF(n->mm_vnode);
+
+		*tail = n;
+		tail = &n->mm_next;
+	}
 	return 0;
 }
 
+void
+as_mmap_destroy(struct addrspace *as)
+{
+	struct as_mmap *m;
+
+	while (as->as_mmaps != NULL) {
+		m = as->as_mmaps;
+		as->as_mmaps = m->mm_next;
+		as_mmap_remove(as, m);
+	}
+}
+
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
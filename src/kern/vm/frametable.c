@@ -1,12 +1,17 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <spl.h>
+#include <cpu.h>
 #include <thread.h>
+#include <current.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <synch.h>
+#include <swap.h>
+#include <platform/maxcpus.h>
 
-/* Place your frametable data-structures here 
+/* Place your frametable data-structures here
  * You probably also want to write a frametable initialisation
  * function and call it from vm_bootstrap
  */
@@ -17,8 +22,404 @@ static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 static struct frame_table_entry *frame_table;
 static unsigned table_size;
 
+/*
+ * Heads of the free block lists, one per order. free_area[k] chains
+ * the free blocks of 2^k frames through frame_table[].next_free.
+ * Bit k of free_orders is set iff free_area[k] is non-empty, so an
+ * allocation finds the smallest usable order without probing lists.
+ */
+static int free_area[BUDDY_MAX_ORDER + 1];
+static uint32_t free_orders;
+
+/*
+ * Occupancy counters, in frames. Used is whatever is neither.
+ */
+static unsigned nfree_frames;
+static unsigned nfixed_frames;
+
+/*
+ * Every cpu's frame cache, for statistics.
+ */
+static struct frame_cache *frame_caches[MAXCPUS];
+
+/*
+ * Position of the page-replacement clock hand in the frame table.
+ */
+static unsigned clock_hand;
+
+/* Batched releases (see frame_batch_flush); protected by stealmem_lock. */
+static unsigned batch_flushes;
+static unsigned batch_frames;
+
+/*
+ * Frames zeroed ahead of time by idle cpus, so faults on anonymous
+ * memory need not clear a page inline. A stack of frame indices,
+ * protected by stealmem_lock.
+ */
+static unsigned zero_pool[ZERO_POOL_MAX];
+static unsigned zero_pool_count;
+static unsigned zero_pool_target = ZERO_POOL_DEFAULT;
+static unsigned zero_pool_hits;
+static unsigned zero_pool_misses;
+
+#define ORDER_NPAGES(order) (1U << (order))
+
+/*
+ * Push a free block onto the list for its order.
+ */
+static
+void
+buddy_push(unsigned index, unsigned order)
+{
+	int head;
+
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+	KASSERT((index & (ORDER_NPAGES(order) - 1)) == 0);
+
+	head = free_area[order];
+	frame_table[index].order = order;
+	frame_table[index].next_free = head;
+	frame_table[index].prev_free = FT_NONE;
+	if (head != FT_NONE) {
+		frame_table[head].prev_free = index;
+	}
+	free_area[order] = index;
+	free_orders |= ORDER_NPAGES(order);
+}
+
+/*
+ * Unlink a free block from the list for its order.
+ */
+static
+void
+buddy_remove(unsigned index, unsigned order)
+{
+	struct frame_table_entry *fte = &frame_table[index];
+
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+	KASSERT(fte->order == order);
+
+	if (fte->prev_free != FT_NONE) {
+		frame_table[fte->prev_free].next_free = fte->next_free;
+	}
+	else {
+		KASSERT(free_area[order] == (int)index);
+		free_area[order] = fte->next_free;
+	}
+	if (fte->next_free != FT_NONE) {
+		frame_table[fte->next_free].prev_free = fte->prev_free;
+	}
+	fte->next_free = FT_NONE;
+	fte->prev_free = FT_NONE;
+
+	if (free_area[order] == FT_NONE) {
+		free_orders &= ~ORDER_NPAGES(order);
+	}
+}
+
+/*
+ * Return a block to the free lists, merging it with its buddy for as
+ * long as the buddy is free and of the same size.
+ */
+static
+void
+buddy_free(unsigned index, unsigned order)
+{
+	unsigned buddy;
+
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+
+	while (order < BUDDY_MAX_ORDER) {
+		buddy = index ^ ORDER_NPAGES(order);
+		if (buddy + ORDER_NPAGES(order) > table_size) {
+			break;
+		}
+		/* Only the head of a free block carries a real order. */
+		if (frame_table[buddy].state != FREE ||
+		    frame_table[buddy].order != order) {
+			break;
+		}
+		buddy_remove(buddy, order);
+		/* The higher of the two is no longer a block head. */
+		frame_table[index | ORDER_NPAGES(order)].order = BUDDY_NO_ORDER;
+		index &= ~ORDER_NPAGES(order);
+		order++;
+	}
+	buddy_push(index, order);
+}
+
+/*
+ * Find a free block of exactly 2^ORDER frames, splitting a larger one
+ * if needed. The unused halves go back on the free lists.
+ */
+static
+int
+buddy_alloc(unsigned order)
+{
+	uint32_t usable;
+	unsigned k;
+	int index;
+
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+
+	usable = free_orders & ~(ORDER_NPAGES(order) - 1);
+	if (usable == 0) {
+		return FT_NONE;
+	}
+	for (k = order; (usable & ORDER_NPAGES(k)) == 0; k++) {
+		/* nothing; bounded by BUDDY_MAX_ORDER */
+	}
+
+	index = free_area[k];
+	buddy_remove(index, k);
+	while (k > order) {
+		k--;
+		buddy_push(index + ORDER_NPAGES(k), k);
+	}
+	return index;
+}
+
+/*
+ * Smallest order whose block holds NPAGES frames.
+ */
+static
+unsigned
+npages_to_order(unsigned npages)
+{
+	unsigned order = 0;
+
+	while (ORDER_NPAGES(order) < npages) {
+		order++;
+	}
+	return order;
+}
+
+
+/*
+ * Hand out / take back a single frame through the global pool.
+ */
+static
+int
+global_alloc_frame(void)
+{
+	int index;
+
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+
+	index = buddy_alloc(0);
+	if (index != FT_NONE) {
+		KASSERT(frame_table[index].state == FREE);
+		frame_table[index].state = DIRTY;
+		frame_table[index].order = 0;
+		nfree_frames--;
+	}
+	return index;
+}
+
+static
+void
+global_free_frame(unsigned index)
+{
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+	KASSERT(frame_table[index].state != FREE);
+	KASSERT(frame_table[index].order == 0);
+
+	frame_table[index].state = FREE;
+	frame_table[index].order = BUDDY_NO_ORDER;
+	buddy_free(index, 0);
+	nfree_frames++;
+}
+
+void
+frame_cache_init(struct frame_cache *fc, unsigned cpunum)
+{
+	KASSERT(cpunum < MAXCPUS);
+
+	fc->fc_count = 0;
+	fc->fc_allochits = 0;
+	fc->fc_refills = 0;
+	fc->fc_freehits = 0;
+	fc->fc_drains = 0;
+	frame_caches[cpunum] = fc;
+}
+
+/*
+ * The current cpu's frame cache. Before thread_bootstrap() there is
+ * no curcpu; those allocations go straight to the global pool.
+ * Interrupts must be off so we stay on this cpu.
+ */
+static
+struct frame_cache *
+frame_cache_get(void)
+{
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	KASSERT(curthread->t_curspl > 0);
+	return &curcpu->c_framecache;
+}
+
+/*
+ * Take a frame from the local cache, refilling it with a batch from
+ * the global pool under a single lock hold if it is empty.
+ */
+static
+int
+frame_cache_alloc(void)
+{
+	struct frame_cache *fc;
+	int index, spl;
+
+	spl = splhigh();
+	fc = frame_cache_get();
+	if (fc == NULL) {
+		splx(spl);
+		return FT_NONE;
+	}
+
+	if (fc->fc_count > 0) {
+		fc->fc_allochits++;
+	}
+	else {
+		fc->fc_refills++;
+		spinlock_acquire(&stealmem_lock);
+		while (fc->fc_count < FRAME_CACHE_BATCH) {
+			index = global_alloc_frame();
+			if (index == FT_NONE) {
+				break;
+			}
+			fc->fc_frames[fc->fc_count++] = index;
+		}
+		spinlock_release(&stealmem_lock);
+	}
+
+	index = FT_NONE;
+	if (fc->fc_count > 0) {
+		index = fc->fc_frames[--fc->fc_count];
+	}
+	splx(spl);
+	return index;
+}
+
+/*
+ * Put a frame in the local cache, first draining a batch back to the
+ * global pool if it is full. Returns false if there is no cache yet.
+ */
+static
+bool
+frame_cache_free(unsigned index)
+{
+	struct frame_cache *fc;
+	int spl;
+
+	spl = splhigh();
+	fc = frame_cache_get();
+	if (fc == NULL) {
+		splx(spl);
+		return false;
+	}
+
+	if (fc->fc_count < FRAME_CACHE_SIZE) {
+		fc->fc_freehits++;
+	}
+	else {
+		fc->fc_drains++;
+		spinlock_acquire(&stealmem_lock);
+		while (fc->fc_count > FRAME_CACHE_SIZE - FRAME_CACHE_BATCH) {
+			global_free_frame(fc->fc_frames[--fc->fc_count]);
+		}
+		spinlock_release(&stealmem_lock);
+	}
+	fc->fc_frames[fc->fc_count++] = index;
+	splx(spl);
+	return true;
+}
+
+/*
+ * Give everything in the local cache back, so the frames can merge
+ * into larger blocks. Used when a multi-page allocation fails.
+ */
+static
+void
+frame_cache_flush(void)
+{
+	struct frame_cache *fc;
+	int spl;
 
-/* Note that this function returns a VIRTUAL address, not a physical 
+	spl = splhigh();
+	fc = frame_cache_get();
+	if (fc != NULL && fc->fc_count > 0) {
+		spinlock_acquire(&stealmem_lock);
+		while (fc->fc_count > 0) {
+			global_free_frame(fc->fc_frames[--fc->fc_count]);
+		}
+		spinlock_release(&stealmem_lock);
+	}
+	splx(spl);
+}
+
+void
+frame_cache_printstats(void)
+{
+	struct frame_cache *fc;
+	unsigned i, allocs, frees;
+
+	for (i = 0; i < MAXCPUS; i++) {
+		fc = frame_caches[i];
+		if (fc == NULL) {
+			continue;
+		}
+		allocs = fc->fc_allochits + fc->fc_refills;
+		frees = fc->fc_freehits + fc->fc_drains;
+		kprintf("cpu%u frame cache: %u cached, "
+			"allocs %u/%u hit (%u%%), frees %u/%u hit (%u%%)\n",
+			i, fc->fc_count,
+			fc->fc_allochits, allocs,
+			allocs ? fc->fc_allochits * 100 / allocs : 0,
+			fc->fc_freehits, frees,
+			frees ? fc->fc_freehits * 100 / frees : 0);
+	}
+	kprintf("Batched frees: %u frames in %u lock holds\n",
+		batch_frames, batch_flushes);
+}
+
+
+/*
+ * Take a frame from the pre-zeroed pool, or FT_NONE if it is empty.
+ */
+static
+int
+zero_pool_pop(void)
+{
+	int index = FT_NONE;
+
+	spinlock_acquire(&stealmem_lock);
+	if (zero_pool_count > 0) {
+		index = zero_pool[--zero_pool_count];
+	}
+	spinlock_release(&stealmem_lock);
+	return index;
+}
+
+/*
+ * Paging something out to satisfy an allocation means sleeping on
+ * disk I/O, which interrupt handlers and spinlock holders cannot do.
+ * They just get NULL, as before.
+ */
+static
+bool
+frame_can_reclaim(void)
+{
+	if (!CURCPU_EXISTS()) {
+		return false;
+	}
+	return !curthread->t_in_interrupt &&
+		curthread->t_iplhigh_count == 0 &&
+		curcpu->c_spinlocks == 0;
+}
+
+
+/* Note that this function returns a VIRTUAL address, not a physical
  * address
  * WARNING: this function gets called very early, before
  * vm_bootstrap().  You may wish to modify main.c to call your
@@ -32,6 +433,7 @@ void frame_table_init(void)
 	uint32_t used_memory;
 	paddr_t top;
 	paddr_t bottom;
+	unsigned index, order;
 
 	top = ram_getsize();
 	bottom = ram_getfirstfree();
@@ -55,55 +457,582 @@ void frame_table_init(void)
 	 */
 	for(int i = 0; i < n_used_page; i++){
 		frame_table[i].state = FIXED;
+		frame_table[i].order = 0;
+		frame_table[i].next_free = FT_NONE;
+		frame_table[i].prev_free = FT_NONE;
+		frame_table[i].refcount = 0;
+		frame_table[i].referenced = false;
+		frame_table[i].as = NULL;
+		frame_table[i].vaddr = 0;
+		frame_table[i].slot = 0;
+		frame_table[i].kmalloc_ref = NULL;
 	}
 
 	for(unsigned i = n_used_page; i < table_size; i++){
 		frame_table[i].state = FREE;
+		frame_table[i].order = BUDDY_NO_ORDER;
+		frame_table[i].next_free = FT_NONE;
+		frame_table[i].prev_free = FT_NONE;
+		frame_table[i].refcount = 0;
+		frame_table[i].referenced = false;
+		frame_table[i].as = NULL;
+		frame_table[i].vaddr = 0;
+		frame_table[i].slot = 0;
+		frame_table[i].kmalloc_ref = NULL;
+	}
+
+	for (order = 0; order <= BUDDY_MAX_ORDER; order++) {
+		free_area[order] = FT_NONE;
 	}
+	free_orders = 0;
+	nfixed_frames = n_used_page;
+	nfree_frames = table_size - n_used_page;
 
+	/*
+	 * Carve the free frames into the largest aligned blocks that
+	 * fit. Blocks never need to coalesce across the FIXED frames
+	 * at the bottom, so this is the same state a sequence of
+	 * single-frame frees would leave behind.
+	 */
+	spinlock_acquire(&stealmem_lock);
+	index = n_used_page;
+	while (index < table_size) {
+		order = BUDDY_MAX_ORDER;
+		while ((index & (ORDER_NPAGES(order) - 1)) != 0 ||
+		       index + ORDER_NPAGES(order) > table_size) {
+			order--;
+		}
+		buddy_push(index, order);
+		index += ORDER_NPAGES(order);
+	}
+	spinlock_release(&stealmem_lock);
 }
 
 vaddr_t
 alloc_kpages(unsigned int npages)
 {
-	/*
-	 * IMPLEMENT ME.  You should replace this code with a proper implementation.
-	 */
-
-	paddr_t addr = 0;
+	unsigned order;
+	int index;
+	bool retried = false;
 
-	if (npages > 1){
+	if (npages == 0) {
+		return (vaddr_t)NULL;
 	}
-	else{
-		spinlock_acquire(&stealmem_lock);
-		for(unsigned i = 0; i < table_size; i++){
-			if (frame_table[i].state == FREE){
-				frame_table[i].state = DIRTY;
-				addr = PAGE_SIZE * i;
+
+	/*
+	 * Single frames come from the per-cpu cache when possible.
+	 * Running low wakes the page-out daemon, so that normally there
+	 * is a frame to hand out without paging anything out here.
+	 */
+	if (npages == 1) {
+		while ((index = frame_cache_alloc()) == FT_NONE) {
+			/* Zeroing was only an optimization; use those first. */
+			index = zero_pool_pop();
+			if (index != FT_NONE) {
+				break;
+			}
+			/* Out of memory: page something out if we may sleep. */
+			vm_pageout_kick();
+			if (!frame_can_reclaim() || !vm_evict_page()) {
 				break;
 			}
 		}
-		spinlock_release(&stealmem_lock);
+		vm_pageout_kick();
+		if (index != FT_NONE) {
+			frame_table[index].refcount = 1;
+			frame_table[index].as = NULL;
+			return PADDR_TO_KVADDR((paddr_t)index * PAGE_SIZE);
+		}
+	}
+
+	order = npages_to_order(npages);
+	if (order > BUDDY_MAX_ORDER) {
+		return (vaddr_t)NULL;
+	}
+
+ again:
+	spinlock_acquire(&stealmem_lock);
+	index = buddy_alloc(order);
+	if (index != FT_NONE) {
+		for (unsigned i = 0; i < ORDER_NPAGES(order); i++) {
+			KASSERT(frame_table[index + i].state == FREE);
+			frame_table[index + i].state = DIRTY;
+			frame_table[index + i].order = order;
+		}
+		frame_table[index].refcount = 1;
+		frame_table[index].as = NULL;
+		nfree_frames -= ORDER_NPAGES(order);
+	}
+	spinlock_release(&stealmem_lock);
+
+	/*
+	 * Frames parked in our cache may be what keeps a block from
+	 * coalescing; give them back and try once more.
+	 */
+	if (index == FT_NONE && order > 0 && !retried) {
+		frame_cache_flush();
+		retried = true;
+		goto again;
 	}
 
 	/*
 	 * When no page can be allocated, return NULL.
 	 */
-	if(addr == 0){
+	if (index == FT_NONE) {
 		return (vaddr_t)NULL;
 	}
 
-	return PADDR_TO_KVADDR(addr);
+	return PADDR_TO_KVADDR((paddr_t)index * PAGE_SIZE);
 }
 
 void
 free_kpages(vaddr_t addr)
 {
-	int index;
+	unsigned index;
+	unsigned order;
 
+	KASSERT(addr % PAGE_SIZE == 0);
 	index = (addr - MIPS_KSEG0) / PAGE_SIZE;
+	KASSERT(index < table_size);
+
+	/* The frame is ours, so its order can be read without the lock. */
+	if (frame_table[index].order == 0 && frame_cache_free(index)) {
+		return;
+	}
+
 	spinlock_acquire(&stealmem_lock);
-		frame_table[index].state = FREE;
+	KASSERT(frame_table[index].state != FREE);
+	KASSERT(frame_table[index].state != FIXED);
+
+	order = frame_table[index].order;
+	KASSERT(order <= BUDDY_MAX_ORDER);
+	/* Must be the start of the block alloc_kpages handed out. */
+	KASSERT((index & (ORDER_NPAGES(order) - 1)) == 0);
+
+	for (unsigned i = 0; i < ORDER_NPAGES(order); i++) {
+		frame_table[index + i].state = FREE;
+		frame_table[index + i].order = BUDDY_NO_ORDER;
+	}
+	buddy_free(index, order);
+	nfree_frames += ORDER_NPAGES(order);
 	spinlock_release(&stealmem_lock);
 }
 
+/*
+ * Only kmalloc sets the pointer, on pages it owns, and kfree only
+ * reads it for a block still allocated from the page; neither needs a
+ * lock.
+ */
+void
+frame_set_kmalloc_ref(vaddr_t kpage, void *ref)
+{
+	unsigned index;
+
+	KASSERT(kpage % PAGE_SIZE == 0);
+	index = (kpage - MIPS_KSEG0) / PAGE_SIZE;
+	KASSERT(index < table_size);
+	KASSERT(frame_table[index].state != FREE);
+
+	frame_table[index].kmalloc_ref = ref;
+}
+
+void *
+frame_kmalloc_ref(vaddr_t kaddr)
+{
+	unsigned index;
+
+	if (kaddr < MIPS_KSEG0 || kaddr >= MIPS_KSEG1) {
+		return NULL;
+	}
+	index = (kaddr - MIPS_KSEG0) / PAGE_SIZE;
+	if (index >= table_size) {
+		return NULL;
+	}
+	return frame_table[index].kmalloc_ref;
+}
+
+vaddr_t
+alloc_zeroed_kpage(void)
+{
+	vaddr_t kpage;
+	int index;
+
+	index = zero_pool_pop();
+	if (index != FT_NONE) {
+		zero_pool_hits++;
+		frame_table[index].refcount = 1;
+		frame_table[index].as = NULL;
+		return PADDR_TO_KVADDR((paddr_t)index * PAGE_SIZE);
+	}
+
+	zero_pool_misses++;
+	kpage = alloc_kpages(1);
+	if (kpage != 0) {
+		bzero((void *)kpage, PAGE_SIZE);
+	}
+	return kpage;
+}
+
+/*
+ * Zero one free frame into the pool, if it is below target and there
+ * is memory to spare. The idle loop calls this with interrupts off,
+ * so it does one page and lets the caller look for real work again.
+ */
+bool
+frame_prezero(void)
+{
+	int index;
+
+	spinlock_acquire(&stealmem_lock);
+	if (zero_pool_count >= zero_pool_target ||
+	    nfree_frames <= zero_pool_target) {
+		spinlock_release(&stealmem_lock);
+		return false;
+	}
+	index = global_alloc_frame();
+	spinlock_release(&stealmem_lock);
+
+	if (index == FT_NONE) {
+		return false;
+	}
+	bzero((void *)PADDR_TO_KVADDR((paddr_t)index * PAGE_SIZE), PAGE_SIZE);
+
+	spinlock_acquire(&stealmem_lock);
+	/* The target may have dropped meanwhile. */
+	if (zero_pool_count < zero_pool_target) {
+		zero_pool[zero_pool_count++] = index;
+	}
+	else {
+		global_free_frame(index);
+	}
+	spinlock_release(&stealmem_lock);
+
+	return true;
+}
+
+void
+frame_zeropool_settarget(unsigned target)
+{
+	if (target > ZERO_POOL_MAX) {
+		target = ZERO_POOL_MAX;
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	zero_pool_target = target;
+	while (zero_pool_count > zero_pool_target) {
+		global_free_frame(zero_pool[--zero_pool_count]);
+	}
+	spinlock_release(&stealmem_lock);
+}
+
+void
+frame_zeropool_printstats(void)
+{
+	unsigned total = zero_pool_hits + zero_pool_misses;
+
+	kprintf("Zero pool: %u/%u frames, %u/%u allocations hit (%u%%)\n",
+		zero_pool_count, zero_pool_target, zero_pool_hits, total,
+		total ? zero_pool_hits * 100 / total : 0);
+}
+
+void
+frame_incref(paddr_t paddr)
+{
+	unsigned index = paddr / PAGE_SIZE;
+
+	KASSERT(index < table_size);
+
+	spinlock_acquire(&stealmem_lock);
+	KASSERT(frame_table[index].state != FREE);
+	KASSERT(frame_table[index].refcount > 0);
+	frame_table[index].refcount++;
+	spinlock_release(&stealmem_lock);
+}
+
+void
+frame_decref(paddr_t paddr)
+{
+	unsigned index = paddr / PAGE_SIZE;
+	unsigned refcount, slot;
+	bool clean = false;
+
+	KASSERT(index < table_size);
+
+	spinlock_acquire(&stealmem_lock);
+	KASSERT(frame_table[index].state != FREE);
+	KASSERT(frame_table[index].refcount > 0);
+	refcount = --frame_table[index].refcount;
+	if (refcount == 0 && frame_table[index].state == CLEAN) {
+		frame_table[index].state = DIRTY;
+		slot = frame_table[index].slot;
+		clean = true;
+	}
+	spinlock_release(&stealmem_lock);
+
+	if (refcount == 0) {
+		if (clean) {
+			swap_decref(slot);
+		}
+		free_kpages(PADDR_TO_KVADDR(paddr));
+	}
+}
+
+void
+frame_batch_init(struct frame_batch *fb, struct addrspace *as)
+{
+	fb->fb_as = as;
+	fb->fb_count = 0;
+}
+
+void
+frame_batch_add(struct frame_batch *fb, paddr_t paddr)
+{
+	if (fb->fb_count == FRAME_BATCH) {
+		frame_batch_flush(fb);
+	}
+	fb->fb_frames[fb->fb_count++] = paddr;
+}
+
+/*
+ * One lock hold for the whole batch. Frames nobody else refers to go
+ * straight back to the buddy allocator rather than through the
+ * per-cpu cache, which a batch this size would only overflow. Swap
+ * slots of CLEAN frames are let go after the lock is dropped.
+ */
+void
+frame_batch_flush(struct frame_batch *fb)
+{
+	struct frame_table_entry *fte;
+	unsigned slots[FRAME_BATCH];
+	unsigned i, index, nslots = 0;
+
+	if (fb->fb_count == 0) {
+		return;
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	for (i = 0; i < fb->fb_count; i++) {
+		index = fb->fb_frames[i] / PAGE_SIZE;
+		KASSERT(index < table_size);
+		fte = &frame_table[index];
+		KASSERT(fte->state != FREE && fte->state != FIXED);
+		KASSERT(fte->refcount > 0);
+
+		if (fte->as == fb->fb_as) {
+			fte->as = NULL;
+		}
+		if (--fte->refcount > 0) {
+			continue;
+		}
+		if (fte->state == CLEAN) {
+			fte->state = DIRTY;
+			slots[nslots++] = fte->slot;
+		}
+		global_free_frame(index);
+	}
+	batch_flushes++;
+	batch_frames += fb->fb_count;
+	spinlock_release(&stealmem_lock);
+
+	fb->fb_count = 0;
+	for (i = 0; i < nslots; i++) {
+		swap_decref(slots[i]);
+	}
+}
+
+/*
+ * Current reference count. Only meaningful to a caller that holds one
+ * of the references: a count of one then means nobody else can map
+ * the frame until we hand it out again.
+ */
+unsigned
+frame_refcount(paddr_t paddr)
+{
+	unsigned index = paddr / PAGE_SIZE;
+
+	KASSERT(index < table_size);
+	return frame_table[index].refcount;
+}
+
+void
+frame_table_getstats(struct frame_stats *stats)
+{
+	spinlock_acquire(&stealmem_lock);
+	stats->fs_free = nfree_frames;
+	stats->fs_fixed = nfixed_frames;
+	stats->fs_zeroed = zero_pool_count;
+	spinlock_release(&stealmem_lock);
+
+	/* Other cpus' counts are read unlocked; close enough for stats. */
+	stats->fs_cached = 0;
+	for (unsigned i = 0; i < MAXCPUS; i++) {
+		if (frame_caches[i] != NULL) {
+			stats->fs_cached += frame_caches[i]->fc_count;
+		}
+	}
+	stats->fs_used = table_size - stats->fs_free - stats->fs_fixed -
+		stats->fs_cached - stats->fs_zeroed;
+}
+
+/*
+ * Number of frames an allocation could get without evicting anything:
+ * the free list, the pre-zeroed pool and every cpu's frame cache. No
+ * lock is taken, so the value may be stale by the time the caller
+ * looks at it; it is meant for pressure heuristics and reporting, not
+ * for deciding whether an allocation will succeed.
+ */
+unsigned
+frame_table_nfree(void)
+{
+	unsigned n;
+
+	n = nfree_frames + zero_pool_count;
+	for (unsigned i = 0; i < MAXCPUS; i++) {
+		if (frame_caches[i] != NULL) {
+			n += frame_caches[i]->fc_count;
+		}
+	}
+	return n;
+}
+
+
+void
+frame_set_owner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned index = paddr / PAGE_SIZE;
+
+	KASSERT(index < table_size);
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	spinlock_acquire(&stealmem_lock);
+	KASSERT(frame_table[index].state != FREE);
+	KASSERT(frame_table[index].refcount == 1);
+	frame_table[index].as = as;
+	frame_table[index].vaddr = vaddr;
+	frame_table[index].referenced = true;
+	spinlock_release(&stealmem_lock);
+}
+
+void
+frame_disown(paddr_t paddr, struct addrspace *as)
+{
+	unsigned index = paddr / PAGE_SIZE;
+
+	KASSERT(index < table_size);
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	spinlock_acquire(&stealmem_lock);
+	if (frame_table[index].as == as) {
+		frame_table[index].as = NULL;
+	}
+	spinlock_release(&stealmem_lock);
+}
+
+void
+frame_set_clean(paddr_t paddr, unsigned slot)
+{
+	unsigned index = paddr / PAGE_SIZE;
+
+	KASSERT(index < table_size);
+
+	spinlock_acquire(&stealmem_lock);
+	KASSERT(frame_table[index].state == DIRTY);
+	KASSERT(frame_table[index].refcount == 1);
+	frame_table[index].state = CLEAN;
+	frame_table[index].slot = slot;
+	spinlock_release(&stealmem_lock);
+}
+
+bool
+frame_take_slot(paddr_t paddr, unsigned *slot)
+{
+	unsigned index = paddr / PAGE_SIZE;
+	bool clean;
+
+	KASSERT(index < table_size);
+
+	spinlock_acquire(&stealmem_lock);
+	clean = frame_table[index].state == CLEAN;
+	if (clean) {
+		frame_table[index].state = DIRTY;
+		*slot = frame_table[index].slot;
+	}
+	spinlock_release(&stealmem_lock);
+
+	return clean;
+}
+
+/*
+ * Second chance: a frame referenced since the last sweep has its bit
+ * cleared and is skipped. There is no hardware referenced bit, so the
+ * bit is set by vm_fault; clearing it also drops the page from this
+ * cpu's TLB so the next use faults and sets it again. Other cpus'
+ * entries are left alone; a page hot there only looks idle here.
+ * Two full turns always find a victim if there is one.
+ *
+ * Looking only for CLEAN frames, one turn is enough, and DIRTY frames
+ * keep their referenced bits for the sweep that may evict them.
+ */
+bool
+frame_clock_victim(paddr_t *paddr, struct addrspace **as, vaddr_t *vaddr,
+		   bool clean)
+{
+	struct frame_table_entry *fte;
+	unsigned n;
+	int spl;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	spinlock_acquire(&stealmem_lock);
+	for (n = 0; n < (clean ? 1 : 2) * table_size; n++) {
+		fte = &frame_table[clock_hand];
+		if (++clock_hand == table_size) {
+			clock_hand = 0;
+		}
+
+		if (fte->as == NULL || fte->refcount != 1) {
+			continue;
+		}
+		if (clean && fte->state != CLEAN) {
+			continue;
+		}
+		KASSERT(fte->state != FREE && fte->state != FIXED);
+
+		if (fte->referenced) {
+			fte->referenced = false;
+			/* The spinlock doesn't set t_curspl; this does. */
+			spl = splhigh();
+			vm_tlb_invalidate(fte->as, fte->vaddr);
+			splx(spl);
+			continue;
+		}
+
+		*paddr = (paddr_t)(fte - frame_table) * PAGE_SIZE;
+		*as = fte->as;
+		*vaddr = fte->vaddr;
+		spinlock_release(&stealmem_lock);
+		return true;
+	}
+	spinlock_release(&stealmem_lock);
+
+	return false;
+}
+
+bool
+frame_evictable(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct frame_table_entry *fte;
+	unsigned index = paddr / PAGE_SIZE;
+	bool ok;
+
+	KASSERT(index < table_size);
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	spinlock_acquire(&stealmem_lock);
+	fte = &frame_table[index];
+	ok = fte->as == as && fte->vaddr == vaddr && fte->refcount == 1 &&
+		fte->state == DIRTY && !fte->referenced;
+	spinlock_release(&stealmem_lock);
+
+	return ok;
+}
@@ -0,0 +1,323 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <vm.h>
+#include <swap.h>
+
+#if OPT_HASHPT
+
+/*
+ * Hashed page table, shared by all address spaces. See pagetable.h.
+ *
+ * Each bucket is a singly linked chain of entries. An entry never
+ * moves while it exists, so pt_lookup can hand out a pointer into
+ * it. Everything here is protected by vm_lock.
+ */
+
+struct hpt_entry {
+	struct addrspace *he_as;
+	vaddr_t he_vpn;			/* virtual page number */
+	page_table_entry he_pte;
+	struct hpt_entry *he_next;
+};
+
+/* Buckets per frame; at one, chains stay short until pages swap out. */
+#define HPT_BUCKETS_PER_FRAME 1
+
+static struct hpt_entry **hpt_buckets;
+static unsigned hpt_bits;		/* log2 of the number of buckets */
+static unsigned hpt_nentries;
+
+#define HPT_NBUCKETS (1U << hpt_bits)
+
+static
+unsigned
+hpt_hash(struct addrspace *as, vaddr_t vpn)
+{
+	/* Fibonacci hashing; address spaces are kmalloc'd, so skip 5 bits. */
+	return ((vpn ^ ((uintptr_t)as >> 5)) * 0x9e3779b1U) >> (32 - hpt_bits);
+}
+
+void
+pt_bootstrap(void)
+{
+	struct frame_stats fs;
+	unsigned nframes;
+
+	frame_table_getstats(&fs);
+	nframes = (fs.fs_free + fs.fs_used + fs.fs_cached + fs.fs_zeroed) *
+		HPT_BUCKETS_PER_FRAME;
+
+	for (hpt_bits = 4; HPT_NBUCKETS < nframes; hpt_bits++) {
+		/* nothing */
+	}
+	hpt_buckets = kmalloc(HPT_NBUCKETS * sizeof(hpt_buckets[0]));
+	if (hpt_buckets == NULL) {
+		panic("pt_bootstrap: out of memory\n");
+	}
+	bzero(hpt_buckets, HPT_NBUCKETS * sizeof(hpt_buckets[0]));
+}
+
+int
+pt_create(struct addrspace *as)
+{
+	as->as_ptentries = 0;
+	return 0;
+}
+
+/*
+ * Find AS's entry for VPN; returns the link pointing at it, or at
+ * NULL at the end of the chain if there is none.
+ */
+static
+struct hpt_entry **
+hpt_find(struct addrspace *as, vaddr_t vpn)
+{
+	struct hpt_entry **p;
+
+	for (p = &hpt_buckets[hpt_hash(as, vpn)]; *p != NULL;
+	     p = &(*p)->he_next) {
+		if ((*p)->he_as == as && (*p)->he_vpn == vpn) {
+			break;
+		}
+	}
+	return p;
+}
+
+static
+struct hpt_entry *
+hpt_insert(struct addrspace *as, vaddr_t vpn, page_table_entry pte)
+{
+	struct hpt_entry *e, **bucket;
+
+	e = kmalloc(sizeof(*e));
+	if (e == NULL) {
+		return NULL;
+	}
+	e->he_as = as;
+	e->he_vpn = vpn;
+	e->he_pte = pte;
+
+	/* Only now: the allocation may have paged something out. */
+	bucket = &hpt_buckets[hpt_hash(as, vpn)];
+	e->he_next = *bucket;
+	*bucket = e;
+
+	as->as_ptentries++;
+	hpt_nentries++;
+	return e;
+}
+
+/*
+ * Drop the page's reference to its frame (batched) or swap slot.
+ */
+static
+void
+hpt_release_entry(struct frame_batch *fb, page_table_entry pte)
+{
+	if (pte & PTE_VALID) {
+		frame_batch_add(fb, PTE_PADDR(pte));
+	}
+	else if (pte & PTE_SWAPPED) {
+		swap_decref(PTE_SLOT(pte));
+	}
+}
+
+/*
+ * Release and free the entry *P points at, unlinking it.
+ */
+static
+void
+hpt_remove(struct frame_batch *fb, struct hpt_entry **p)
+{
+	struct hpt_entry *e = *p;
+
+	KASSERT(e->he_as == fb->fb_as);
+	hpt_release_entry(fb, e->he_pte);
+	*p = e->he_next;
+
+	KASSERT(e->he_as->as_ptentries > 0);
+	e->he_as->as_ptentries--;
+	hpt_nentries--;
+	kfree(e);
+}
+
+page_table_entry *
+pt_lookup(struct addrspace *as, vaddr_t vaddr, bool create)
+{
+	struct hpt_entry *e;
+	vaddr_t vpn = vaddr / PAGE_SIZE;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	e = *hpt_find(as, vpn);
+	if (e == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		e = hpt_insert(as, vpn, 0);
+		if (e == NULL) {
+			return NULL;
+		}
+	}
+	return &e->he_pte;
+}
+
+/*
+ * Entries NEW gets are added at the heads of chains, so the walk may
+ * meet them later on; they aren't OLD's, and are skipped like any
+ * other address space's.
+ */
+int
+pt_copy(struct addrspace *old, struct addrspace *new)
+{
+	struct hpt_entry *e, *ne;
+	page_table_entry pte;
+	unsigned i, left;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	left = old->as_ptentries;
+	for (i = 0; i < HPT_NBUCKETS && left > 0; i++) {
+		for (e = hpt_buckets[i]; e != NULL; e = e->he_next) {
+			if (e->he_as != old) {
+				continue;
+			}
+			left--;
+			if (e->he_pte == 0) {
+				continue;
+			}
+
+			ne = hpt_insert(new, e->he_vpn, 0);
+			if (ne == NULL) {
+				return ENOMEM;
+			}
+
+			pte = e->he_pte;
+			if (pte & PTE_VALID) {
+				/* Share the frame; whoever writes first copies. */
+				pte &= ~PTE_WRITE;
+				e->he_pte = pte;
+				frame_incref(PTE_PADDR(pte));
+			}
+			else if (pte & PTE_SWAPPED) {
+				swap_incref(PTE_SLOT(pte));
+			}
+			ne->he_pte = pte;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * A range with fewer pages than there are buckets is looked up page
+ * by page; a larger one is found by walking the table. The entries
+ * are freed, unlike the two-level table's second-level tables. That
+ * is safe because nothing else can be using them: a process has one
+ * thread, and it is the one releasing them.
+ */
+void
+pt_release(struct addrspace *as, vaddr_t base, vaddr_t top)
+{
+	struct frame_batch fb;
+	struct hpt_entry **p;
+	vaddr_t vpn;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+	KASSERT((base & PAGE_FRAME) == base);
+	KASSERT((top & PAGE_FRAME) == top);
+
+	frame_batch_init(&fb, as);
+
+	if ((top - base) / PAGE_SIZE < HPT_NBUCKETS) {
+		for (vpn = base / PAGE_SIZE; vpn < top / PAGE_SIZE; vpn++) {
+			p = hpt_find(as, vpn);
+			if (*p != NULL) {
+				hpt_remove(&fb, p);
+			}
+		}
+		frame_batch_flush(&fb);
+		return;
+	}
+
+	for (i = 0; i < HPT_NBUCKETS && as->as_ptentries > 0; i++) {
+		p = &hpt_buckets[i];
+		while (*p != NULL) {
+			vpn = (*p)->he_vpn;
+			if ((*p)->he_as == as && vpn >= base / PAGE_SIZE &&
+			    vpn < top / PAGE_SIZE) {
+				hpt_remove(&fb, p);
+			}
+			else {
+				p = &(*p)->he_next;
+			}
+		}
+	}
+	frame_batch_flush(&fb);
+}
+
+void
+pt_destroy(struct addrspace *as)
+{
+	struct frame_batch fb;
+	struct hpt_entry **p;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	frame_batch_init(&fb, as);
+	for (i = 0; i < HPT_NBUCKETS && as->as_ptentries > 0; i++) {
+		p = &hpt_buckets[i];
+		while (*p != NULL) {
+			if ((*p)->he_as == as) {
+				hpt_remove(&fb, p);
+			}
+			else {
+				p = &(*p)->he_next;
+			}
+		}
+	}
+	frame_batch_flush(&fb);
+	KASSERT(as->as_ptentries == 0);
+}
+
+size_t
+pt_overhead(void)
+{
+	/* Entries come from kmalloc's 16-byte subpages. */
+	return HPT_NBUCKETS * sizeof(hpt_buckets[0]) +
+		hpt_nentries * ROUNDUP(sizeof(struct hpt_entry), 16);
+}
+
+void
+pt_printstats(void)
+{
+	struct hpt_entry *e;
+	unsigned i, len, longest = 0, used = 0;
+
+	lock_acquire(vm_lock);
+	for (i = 0; i < HPT_NBUCKETS; i++) {
+		len = 0;
+		for (e = hpt_buckets[i]; e != NULL; e = e->he_next) {
+			len++;
+		}
+		if (len > 0) {
+			used++;
+		}
+		if (len > longest) {
+			longest = len;
+		}
+	}
+	lock_release(vm_lock);
+
+	kprintf("Page tables: hashed, %u entries in %u/%u buckets "
+		"(longest chain %u), %u KB\n", hpt_nentries, used,
+		HPT_NBUCKETS, longest, (unsigned)(pt_overhead() / 1024));
+}
+
+#endif /* OPT_HASHPT */
@@ -29,8 +29,15 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <objcache.h>
+#include <platform/maxcpus.h>
+
+#include "opt-dumbvm.h"
 
 /*
  * Kernel malloc.
@@ -103,6 +110,13 @@ fill_deadbeef(void *vptr, size_t len)
  * LABELS records the allocation site and a generation number for each
  * allocation and is useful for tracking down memory leaks.
  *
+ * PROFILE counts the sizes requested, and for each size class what was
+ * asked of it against the blocks it handed out, for kheap_printstats
+ * to report along with the classes that would have wasted least; use
+ * it to pick the size classes. Unlike the modes above it leaves the
+ * magazines on and the blocks as they are, so it profiles the heap as
+ * it ships, only slower.
+ *
  * On top of these one can enable the following:
  *
  * CHECKBEEF checks that free blocks still contain 0xdeadbeef when
@@ -118,26 +132,77 @@ fill_deadbeef(void *vptr, size_t len)
 #undef SLOWER
 #undef GUARDS
 #undef LABELS
+#undef PROFILE
 
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+/*
+ * The per-cpu magazines keep blocks that are neither on a page's
+ * freelist nor in use, which the debugging modes would take for
+ * allocated blocks; they are off when any of those is on.
+ */
+#if !defined(SLOW) && !defined(SLOWER) && \
+    !defined(GUARDS) && !defined(LABELS)
+#define MAGAZINES
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
 
-#define NSIZES 8
-static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+/*
+ * Powers of two, plus a class for each of the commonest objects that
+ * would waste much of a power-of-two block: 48 for mmap records (40
+ * bytes on mips), 192 for address spaces (188) and trapframes (148),
+ * and 576 for SFS vnodes (548). All are multiples of 16, which keeps
+ * blocks aligned. A size that doesn't divide the page leaves a few
+ * bytes at the end of it unused. Check these against PROFILE's
+ * suggestion after a representative run.
+ */
+#define NSIZES 11
+static const size_t sizes[NSIZES] = {
+	16, 32, 48, 64, 128, 192, 256, 512, 576, 1024, 2048
+};
 
 #define SMALLEST_SUBPAGE_SIZE 16
 #define LARGEST_SUBPAGE_SIZE 2048
 
+#if NSIZES != KMALLOC_NSIZES
+#error "KMALLOC_NSIZES in vm.h does not match"
+#endif
+#if LARGEST_SUBPAGE_SIZE != KMALLOC_LARGEST_SUBPAGE
+#error "KMALLOC_LARGEST_SUBPAGE in vm.h does not match"
+#endif
+
 #elif PAGE_SIZE == 8192
 #error "No support for 8k pages (yet?)"
 #else
 #error "Odd page size"
 #endif
 
+/*
+ * Given a requested client size, return the block type, that is, the
+ * index into the sizes[] array for the block size to use.
+ */
+static
+inline
+int blocktype(size_t clientsz)
+{
+	unsigned i;
+	for (i=0; i<NSIZES; i++) {
+		if (clientsz <= sizes[i]) {
+			return i;
+		}
+	}
+
+	panic("Subpage allocator cannot handle allocation of size %zu\n",
+	      clientsz);
+
+	// keep compiler happy
+	return 0;
+}
+
 ////////////////////////////////////////
 
 struct freelist {
@@ -161,141 +226,78 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the page lists. The common case doesn't get
+ * that far: see the per-cpu magazines below.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
+#ifdef MAGAZINES
+/* Every cpu's magazines, for statistics. */
+static struct kmalloc_cache *kmalloc_caches[MAXCPUS];
+#endif
+
 ////////////////////////////////////////
 
 /*
- * We can only allocate whole pages of pageref structure at a time.
- * This is a struct type for such a page.
+ * Pagerefs are allocated a whole page of them at a time, as the heap
+ * grows; each page of them can manage 4K / 16 * 4K = 1M of kernel
+ * heap. Those pages are never given back. Free pagerefs are kept on
+ * a list through their next_all fields.
  *
- * Each pageref page contains 256 pagerefs, which can manage up to
- * 256 * 4K = 1M of kernel heap.
+ * A heap page's pageref is found through the frame table, which keeps
+ * a pointer to it for each page (see frame_kmalloc_ref). dumbvm has no
+ * frame table, so there the list of all pages is searched instead.
  */
 
 #define NPAGEREFS_PER_PAGE (PAGE_SIZE / sizeof(struct pageref))
 
-struct pagerefpage {
-	struct pageref refs[NPAGEREFS_PER_PAGE];
-};
-
-/*
- * This structure holds a pointer to a pageref page and also its
- * bitmap of free entries.
- */
-
-#define INUSE_WORDS (NPAGEREFS_PER_PAGE / 32)
-
-struct kheap_root {
-	struct pagerefpage *page;
-	uint32_t pagerefs_inuse[INUSE_WORDS];
-	unsigned numinuse;
-};
-
-/*
- * It would be better to make this dynamically sizeable. However,
- * since we only actually run on System/161 and System/161 is
- * specifically limited to 16M of RAM, we'll just adopt that as a
- * static size limit.
- *
- * FUTURE: it would be better to pick this number based on the RAM
- * size we find at boot time.
- */
-
-#define NUM_PAGEREFPAGES 16
-#define TOTAL_PAGEREFS (NUM_PAGEREFPAGES * NPAGEREFS_PER_PAGE)
-
-static struct kheap_root kheaproots[NUM_PAGEREFPAGES];
+static struct pageref *freepagerefs;
+static unsigned npagerefpages;		/* pages of pagerefs */
+static unsigned npagerefs;		/* pagerefs in use */
 
 /*
- * Allocate a page to hold pagerefs.
+ * Allocate a pageref structure.
  */
 static
-void
-allocpagerefpage(struct kheap_root *root)
+struct pageref *
+allocpageref(void)
 {
+	struct pageref *refs;
 	vaddr_t va;
+	unsigned i;
 
-	KASSERT(root->page == NULL);
-
-	/*
-	 * We release the spinlock while calling alloc_kpages. This
-	 * avoids deadlock if alloc_kpages needs to come back here.
-	 * Note that this means things can change behind our back...
-	 */
-	spinlock_release(&kmalloc_spinlock);
-	va = alloc_kpages(1);
-	spinlock_acquire(&kmalloc_spinlock);
-	if (va == 0) {
-		kprintf("kmalloc: Couldn't get a pageref page\n");
-		return;
-	}
-	KASSERT(va % PAGE_SIZE == 0);
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-	if (root->page != NULL) {
-		/* Oops, somebody else allocated it. */
+	while (freepagerefs == NULL) {
+		/*
+		 * We release the spinlock while calling alloc_kpages.
+		 * This avoids deadlock if alloc_kpages needs to come
+		 * back here. Someone else may refill the list
+		 * meanwhile; then there are spare pagerefs, which is
+		 * harmless.
+		 */
 		spinlock_release(&kmalloc_spinlock);
-		free_kpages(va);
+		va = alloc_kpages(1);
 		spinlock_acquire(&kmalloc_spinlock);
-		/* Once allocated it isn't ever freed. */
-		KASSERT(root->page != NULL);
-		return;
-	}
-
-	root->page = (struct pagerefpage *)va;
-}
-
-/*
- * Allocate a pageref structure.
- */
-static
-struct pageref *
-allocpageref(void)
-{
-	unsigned i,j;
-	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
-
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-		if (root->numinuse >= NPAGEREFS_PER_PAGE) {
-			continue;
+		if (va == 0) {
+			kprintf("kmalloc: Couldn't get a pageref page\n");
+			return NULL;
 		}
+		KASSERT(va % PAGE_SIZE == 0);
 
-		/*
-		 * This should probably not be a linear search.
-		 */
-		for (i=0; i<INUSE_WORDS; i++) {
-			if (root->pagerefs_inuse[i]==0xffffffff) {
-				/* full */
-				continue;
-			}
-			for (k=1,j=0; k!=0; k<<=1,j++) {
-				if ((root->pagerefs_inuse[i] & k)==0) {
-					root->pagerefs_inuse[i] |= k;
-					root->numinuse++;
-					if (root->page == NULL) {
-						allocpagerefpage(root);
-					}
-					if (root->page == NULL) {
-						return NULL;
-					}
-					return &root->page->refs[i*32 + j];
-				}
-			}
-			KASSERT(0);
+		refs = (struct pageref *)va;
+		for (i=0; i<NPAGEREFS_PER_PAGE; i++) {
+			refs[i].next_all = freepagerefs;
+			freepagerefs = &refs[i];
 		}
+		npagerefpages++;
 	}
 
-	/* ran out */
-	return NULL;
+	refs = freepagerefs;
+	freepagerefs = refs->next_all;
+	npagerefs++;
+	return refs;
 }
 
 /*
@@ -305,36 +307,12 @@ static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
-	struct pagerefpage *page;
-
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-
-		page = root->page;
-		if (page == NULL) {
-			KASSERT(root->numinuse == 0);
-			continue;
-		}
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(npagerefs > 0);
 
-		j = p-page->refs;
-		/* note: j is unsigned, don't test < 0 */
-		if (j < NPAGEREFS_PER_PAGE) {
-			/* on this page */
-			i = j/32;
-			k = ((uint32_t)1) << (j%32);
-			KASSERT((root->pagerefs_inuse[i] & k) != 0);
-			root->pagerefs_inuse[i] &= ~k;
-			KASSERT(root->numinuse > 0);
-			root->numinuse--;
-			return;
-		}
-	}
-	/* pageref wasn't on any of the pages */
-	KASSERT(0);
+	p->next_all = freepagerefs;
+	freepagerefs = p;
+	npagerefs--;
 }
 
 ////////////////////////////////////////
@@ -346,6 +324,21 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+/*
+ * Empty pages, up to KHEAP_RESERVE of each size, are not freed but
+ * kept on a list of their own (through next_samesize, and still on
+ * the list of all pages). A size whose use keeps crossing a page
+ * boundary, as in fork/exit loops, then reuses the same page instead
+ * of freeing it and getting a new one every time. The reserve is
+ * given back when memory runs short; see kheap_reclaim.
+ */
+#define KHEAP_RESERVE 1
+
+static struct pageref *reservebases[NSIZES];
+static unsigned nreserved[NSIZES];
+static unsigned reserve_hits;		/* page allocations avoided */
+static unsigned reserve_releases;	/* pages given back from it */
+
 ////////////////////////////////////////
 
 #ifdef GUARDS
@@ -589,14 +582,20 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < TOTAL_PAGEREFS);
+			KASSERT(sc < npagerefs);
+			sc++;
+		}
+		for (pr = reservebases[i]; pr != NULL; pr = pr->next_samesize) {
+			checksubpage(pr);
+			KASSERT(pr->nfree == PAGE_SIZE / sizes[i]);
+			KASSERT(sc < npagerefs);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < TOTAL_PAGEREFS);
+		KASSERT(ac < npagerefs);
 		ac++;
 	}
 
@@ -698,6 +697,253 @@ dump_subpages(unsigned generation)
 
 #endif /* LABELS */
 
+#ifdef PROFILE
+
+/*
+ * Allocation profile, protected by profile_lock rather than
+ * kmalloc_spinlock, which the magazines are there to avoid.
+ *
+ * Requests are counted by size, in buckets as wide as the class
+ * granularity, along with how many bytes they add up to; that is all
+ * profile_suggest needs to work out the classes that would have
+ * wasted least on them. Each class also counts what its blocks would
+ * have cost with power-of-two classes, to compare. Sizes include the
+ * debugging modes' overheads, if any are on.
+ */
+
+#define PROFILE_BUCKET 16
+#define PROFILE_NBUCKETS (LARGEST_SUBPAGE_SIZE / PROFILE_BUCKET)
+#define PROFILE_TOP 10
+
+struct profile_class {
+	unsigned pc_allocs;
+	unsigned pc_live;
+	uint64_t pc_requested;		/* bytes, over all allocations */
+	uint64_t pc_pow2;		/* ... as power-of-two blocks */
+};
+
+static struct spinlock profile_lock = SPINLOCK_INITIALIZER;
+static unsigned profile_hist[PROFILE_NBUCKETS];
+static uint64_t profile_histbytes[PROFILE_NBUCKETS];
+static unsigned profile_large;		/* whole-page allocations */
+static struct profile_class profile_classes[NSIZES];
+
+/*
+ * Working space for profile_print, which only the kernel menu runs:
+ * a copy of the above, and profile_suggest's tables.
+ */
+static unsigned ps_hist[PROFILE_NBUCKETS];
+static uint64_t ps_histbytes[PROFILE_NBUCKETS];
+static struct profile_class ps_classes[NSIZES];
+static uint64_t ps_count[PROFILE_NBUCKETS + 1];
+static uint64_t ps_bytes[PROFILE_NBUCKETS + 1];
+static uint64_t ps_cost[NSIZES][PROFILE_NBUCKETS];
+static uint8_t ps_from[NSIZES][PROFILE_NBUCKETS];
+
+static
+size_t
+profile_pow2size(size_t sz)
+{
+	size_t p2;
+
+	for (p2 = SMALLEST_SUBPAGE_SIZE; p2 < sz; p2 *= 2) {
+		/* nothing */
+	}
+	return p2;
+}
+
+/*
+ * Account for a subpage request that needs SZ bytes.
+ */
+static
+void
+profile_alloc(size_t sz)
+{
+	struct profile_class *pc;
+	unsigned bucket;
+
+	bucket = sz > 0 ? (sz - 1) / PROFILE_BUCKET : 0;
+
+	spinlock_acquire(&profile_lock);
+	profile_hist[bucket]++;
+	profile_histbytes[bucket] += sz;
+	pc = &profile_classes[blocktype(sz)];
+	pc->pc_allocs++;
+	pc->pc_live++;
+	pc->pc_requested += sz;
+	pc->pc_pow2 += profile_pow2size(sz);
+	spinlock_release(&profile_lock);
+}
+
+/*
+ * Account for freeing PTR, before it is freed. Pages kmalloc got
+ * before the frame table was up are not tagged, so frees from them go
+ * uncounted.
+ */
+static
+void
+profile_free(void *ptr)
+{
+	struct pageref *pr;
+	struct profile_class *pc;
+
+	pr = frame_kmalloc_ref((vaddr_t)ptr);
+	if (pr == NULL) {
+		return;
+	}
+	spinlock_acquire(&profile_lock);
+	pc = &profile_classes[PR_BLOCKTYPE(pr)];
+	if (pc->pc_live > 0) {
+		pc->pc_live--;
+	}
+	spinlock_release(&profile_lock);
+}
+
+static
+void
+profile_large_alloc(void)
+{
+	spinlock_acquire(&profile_lock);
+	profile_large++;
+	spinlock_release(&profile_lock);
+}
+
+/*
+ * Pick the NSIZES classes, multiples of PROFILE_BUCKET ending with
+ * LARGEST_SUBPAGE_SIZE, that would have wasted least on the requests
+ * in ps_hist, and return the bytes they would have wasted. Dynamic
+ * programming: ps_cost[k][e] is the least waste on the requests up to
+ * bucket E with K + 1 classes, the largest ending at bucket E, and
+ * ps_from[k][e] the first bucket that class takes. The slack at the
+ * end of a page is not counted.
+ */
+static
+uint64_t
+profile_suggest(size_t *classes)
+{
+	uint64_t cost;
+	unsigned k, s, e;
+
+	ps_count[0] = ps_bytes[0] = 0;
+	for (e=0; e<PROFILE_NBUCKETS; e++) {
+		ps_count[e + 1] = ps_count[e] + ps_hist[e];
+		ps_bytes[e + 1] = ps_bytes[e] + ps_histbytes[e];
+	}
+
+	/* Waste of one class of (E+1) buckets taking buckets S to E. */
+#define PS_WASTE(s, e) \
+	((ps_count[(e) + 1] - ps_count[s]) * ((e) + 1) * PROFILE_BUCKET - \
+	 (ps_bytes[(e) + 1] - ps_bytes[s]))
+
+	for (e=0; e<PROFILE_NBUCKETS; e++) {
+		ps_cost[0][e] = PS_WASTE(0, e);
+		ps_from[0][e] = 0;
+	}
+	for (k=1; k<NSIZES; k++) {
+		for (e=k; e<PROFILE_NBUCKETS; e++) {
+			ps_cost[k][e] = ~(uint64_t)0;
+			for (s=k; s<=e; s++) {
+				cost = ps_cost[k - 1][s - 1] + PS_WASTE(s, e);
+				if (cost < ps_cost[k][e]) {
+					ps_cost[k][e] = cost;
+					ps_from[k][e] = s;
+				}
+			}
+		}
+	}
+#undef PS_WASTE
+
+	e = PROFILE_NBUCKETS - 1;
+	for (k=NSIZES; k-- > 0; ) {
+		classes[k] = (e + 1) * PROFILE_BUCKET;
+		if (k > 0) {
+			e = ps_from[k][e] - 1;
+		}
+	}
+	return ps_cost[NSIZES - 1][PROFILE_NBUCKETS - 1];
+}
+
+/*
+ * Print, per class, how much of what it handed out was not asked for,
+ * and how much would not have been with power-of-two classes; then
+ * the classes that would have wasted least, and the most requested
+ * sizes.
+ */
+static
+void
+profile_print(void)
+{
+	struct profile_class *pc;
+	size_t suggested[NSIZES];
+	uint64_t waste, pow2waste, allocated;
+	unsigned i, j, best, allocs, large;
+	bool shown[PROFILE_NBUCKETS];
+
+	spinlock_acquire(&profile_lock);
+	memcpy(ps_hist, profile_hist, sizeof(ps_hist));
+	memcpy(ps_histbytes, profile_histbytes, sizeof(ps_histbytes));
+	memcpy(ps_classes, profile_classes, sizeof(ps_classes));
+	large = profile_large;
+	spinlock_release(&profile_lock);
+
+	kprintf("kmalloc size classes (waste: share of the bytes handed "
+		"out that were not asked for):\n");
+	kprintf("  size   allocs    live  waste  with powers of two\n");
+	waste = 0;
+	pow2waste = 0;
+	allocs = 0;
+	for (i=0; i<NSIZES; i++) {
+		pc = &ps_classes[i];
+		allocated = (uint64_t)pc->pc_allocs * sizes[i];
+		kprintf("  %4u %8u %7u %5u%% %18u%%\n",
+			(unsigned)sizes[i], pc->pc_allocs, pc->pc_live,
+			allocated ? (unsigned)((allocated - pc->pc_requested) *
+				100 / allocated) : 0,
+			pc->pc_pow2 ? (unsigned)((pc->pc_pow2 -
+				pc->pc_requested) * 100 / pc->pc_pow2) : 0);
+		waste += allocated - pc->pc_requested;
+		pow2waste += pc->pc_pow2 - pc->pc_requested;
+		allocs += pc->pc_allocs;
+	}
+	kprintf("Waste over %u allocations: %llu bytes with these classes, "
+		"%llu bytes with powers of two\n", allocs, waste, pow2waste);
+	kprintf("%u allocations of whole pages\n", large);
+
+	waste = profile_suggest(suggested);
+	kprintf("Least waste (%llu bytes) with:", waste);
+	for (i=0; i<NSIZES; i++) {
+		kprintf(" %u", (unsigned)suggested[i]);
+	}
+	kprintf("\n");
+
+	kprintf("Most requested sizes:\n");
+	for (i=0; i<PROFILE_NBUCKETS; i++) {
+		shown[i] = false;
+	}
+	for (i=0; i<PROFILE_TOP; i++) {
+		best = PROFILE_NBUCKETS;
+		for (j=0; j<PROFILE_NBUCKETS; j++) {
+			if (!shown[j] && ps_hist[j] > 0 &&
+			    (best == PROFILE_NBUCKETS ||
+			     ps_hist[j] > ps_hist[best])) {
+				best = j;
+			}
+		}
+		if (best == PROFILE_NBUCKETS) {
+			break;
+		}
+		shown[best] = true;
+		kprintf("  %4u-%4u bytes: %u allocs, %u-byte blocks "
+			"(%u-byte with powers of two)\n",
+			best * PROFILE_BUCKET + 1, (best + 1) * PROFILE_BUCKET,
+			ps_hist[best],
+			(unsigned)sizes[blocktype((best + 1) * PROFILE_BUCKET)],
+			(unsigned)profile_pow2size((best + 1) * PROFILE_BUCKET));
+	}
+}
+
+#endif /* PROFILE */
+
 void
 kheap_nextgeneration(void)
 {
@@ -795,6 +1041,60 @@ subpage_stats(struct pageref *pr)
 	kprintf("\n");
 }
 
+/*
+ * Per size class: its pages (the empty ones in reserve included), the
+ * blocks on them in use and sitting in magazines, and how much of the
+ * pages the blocks in use fill; the rest is free blocks and the slack
+ * at the end of each page. Comparing this before and after a workload
+ * shows which classes fragment.
+ */
+static
+void
+kheap_classstats(void)
+{
+	struct pageref *pr;
+	unsigned pages[NSIZES], nfree[NSIZES], cached[NSIZES];
+	unsigned k, nblocks, inuse;
+#ifdef MAGAZINES
+	struct kmalloc_cache *kc;
+	unsigned i;
+#endif
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	for (k=0; k<NSIZES; k++) {
+		pages[k] = nfree[k] = cached[k] = 0;
+	}
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		k = PR_BLOCKTYPE(pr);
+		pages[k]++;
+		nfree[k] += pr->nfree;
+	}
+#ifdef MAGAZINES
+	/* Other cpus' counts may be a moment out of date. */
+	for (i = 0; i < MAXCPUS; i++) {
+		kc = kmalloc_caches[i];
+		if (kc == NULL) {
+			continue;
+		}
+		for (k=0; k<NSIZES; k++) {
+			cached[k] += kc->kc_mags[k].km_count;
+		}
+	}
+#endif
+
+	kprintf("  size  pages  in use  in magazines  pages filled\n");
+	for (k=0; k<NSIZES; k++) {
+		nblocks = pages[k] * (PAGE_SIZE / sizes[k]);
+		inuse = nblocks - nfree[k];
+		inuse = inuse > cached[k] ? inuse - cached[k] : 0;
+		kprintf("  %4u %6u %7u %13u %12u%%\n",
+			(unsigned)sizes[k], pages[k], inuse, cached[k],
+			pages[k] ? inuse * (unsigned)sizes[k] * 100 /
+				(pages[k] * PAGE_SIZE) : 0);
+	}
+}
+
 /*
  * Print the whole heap.
  */
@@ -802,6 +1102,11 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	unsigned k, reserved;
+#ifdef MAGAZINES
+	struct kmalloc_cache *kc;
+	unsigned i, j, cached, allocs, frees;
+#endif
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -811,18 +1116,56 @@ kheap_printstats(void)
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		subpage_stats(pr);
 	}
+	kprintf("%u pagerefs in use, in %u pages\n", npagerefs, npagerefpages);
+	reserved = 0;
+	for (k=0; k<NSIZES; k++) {
+		reserved += nreserved[k];
+	}
+	kprintf("Empty page reserve: %u pages; %u page allocations avoided, "
+		"%u pages given back\n", reserved, reserve_hits, reserve_releases);
+	kheap_classstats();
+
+#ifdef MAGAZINES
+	/* Blocks in magazines show as allocated above. */
+	for (i = 0; i < MAXCPUS; i++) {
+		kc = kmalloc_caches[i];
+		if (kc == NULL) {
+			continue;
+		}
+		cached = 0;
+		for (j = 0; j < NSIZES; j++) {
+			cached += kc->kc_mags[j].km_count;
+		}
+		allocs = kc->kc_allochits + kc->kc_refills;
+		frees = kc->kc_freehits + kc->kc_drains;
+		kprintf("cpu%u kmalloc magazines: %u blocks, "
+			"allocs %u/%u hit (%u%%), frees %u/%u hit (%u%%)\n",
+			i, cached,
+			kc->kc_allochits, allocs,
+			allocs ? kc->kc_allochits * 100 / allocs : 0,
+			kc->kc_freehits, frees,
+			frees ? kc->kc_freehits * 100 / frees : 0);
+	}
+#endif
 
 	spinlock_release(&kmalloc_spinlock);
+
+#ifdef PROFILE
+	profile_print();
+#endif
+
+	/* Their slabs are whole pages, so they don't show up above. */
+	objcache_printstats();
 }
 
 ////////////////////////////////////////
 
 /*
- * Remove a pageref from both lists that it's on.
+ * Remove a pageref from the list of pages of its size.
  */
 static
 void
-remove_lists(struct pageref *pr, int blktype)
+remove_samesize(struct pageref *pr, int blktype)
 {
 	struct pageref **guy;
 
@@ -835,6 +1178,16 @@ remove_lists(struct pageref *pr, int blktype)
 			break;
 		}
 	}
+}
+
+/*
+ * Remove a pageref from the list of all pages.
+ */
+static
+void
+remove_all(struct pageref *pr)
+{
+	struct pageref **guy;
 
 	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
 		checksubpage(*guy);
@@ -846,52 +1199,187 @@ remove_lists(struct pageref *pr, int blktype)
 }
 
 /*
- * Given a requested client size, return the block type, that is, the
- * index into the sizes[] array for the block size to use.
+ * Remove a pageref from both lists that it's on.
  */
 static
-inline
-int blocktype(size_t clientsz)
+void
+remove_lists(struct pageref *pr, int blktype)
 {
-	unsigned i;
-	for (i=0; i<NSIZES; i++) {
-		if (clientsz <= sizes[i]) {
-			return i;
-		}
-	}
-
-	panic("Subpage allocator cannot handle allocation of size %zu\n",
-	      clientsz);
-
-	// keep compiler happy
-	return 0;
+	remove_samesize(pr, blktype);
+	remove_all(pr);
 }
 
 /*
- * Allocate a block of size SZ, where SZ is not large enough to
- * warrant a whole-page allocation.
+ * Take the first block off PR's freelist. There must be one.
  */
 static
 void *
-subpage_kmalloc(size_t sz
-#ifdef LABELS
-		, vaddr_t label
-#endif
-	)
+subpage_takeblock(struct pageref *pr)
 {
-	unsigned blktype;	// index into sizes[] that we're using
-	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
+	struct freelist *fl;	// free list entry
 	void *retptr;		// our result
 
-	volatile int i;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
 
-#ifdef GUARDS
-	size_t clientsz;
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+	return retptr;
+}
+
+/*
+ * Put the block at OFFSET in PR's page back on the page's freelist.
+ * If that makes the whole page free, the page goes in the reserve if
+ * there is room. If not, PR is taken off the lists and released and
+ * true is returned: the caller then frees the page, once it has let go
+ * of kmalloc_spinlock.
+ */
+static
+bool
+subpage_putblock(struct pageref *pr, vaddr_t offset)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fla = prpage + offset;
+	fl = (struct freelist *)fla;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+
+		/* this block should not already be on the free list! */
+#ifdef SLOW
+		{
+			struct freelist *fl2;
+
+			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
+				KASSERT(fl2 != fl);
+			}
+		}
+#else
+		/* check just the head */
+		KASSERT(fl != fl->next);
 #endif
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		if (nreserved[blktype] < KHEAP_RESERVE) {
+			remove_samesize(pr, blktype);
+			pr->next_samesize = reservebases[blktype];
+			reservebases[blktype] = pr;
+			nreserved[blktype]++;
+			return false;
+		}
+		remove_lists(pr, blktype);
+		freepageref(pr);
+		frame_set_kmalloc_ref(prpage, NULL);
+		return true;
+	}
+	return false;
+}
 
+/*
+ * Find the pageref for the heap page holding PTRADDR, or NULL if it
+ * isn't one of ours.
+ */
+static
+struct pageref *
+subpage_findpage(vaddr_t ptraddr)
+{
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	int blktype;		// index into sizes[] that we're using
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+#if OPT_DUMBVM
+	for (pr = allbase; pr; pr = pr->next_all) {
+		prpage = PR_PAGEADDR(pr);
+		blktype = PR_BLOCKTYPE(pr);
+
+		/* check for corruption */
+		KASSERT(blktype>=0 && blktype<NSIZES);
+		checksubpage(pr);
+
+		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+			break;
+		}
+	}
+#else
+	pr = frame_kmalloc_ref(ptraddr);
+	if (pr != NULL) {
+		prpage = PR_PAGEADDR(pr);
+		blktype = PR_BLOCKTYPE(pr);
+
+		/* check for corruption */
+		KASSERT(blktype>=0 && blktype<NSIZES);
+		KASSERT(prpage == (ptraddr & PAGE_FRAME));
+		checksubpage(pr);
+	}
+#endif
+	return pr;
+}
+
+/*
+ * Allocate a block of size SZ, where SZ is not large enough to
+ * warrant a whole-page allocation.
+ */
+static
+void *
+subpage_kmalloc(size_t sz
+#ifdef LABELS
+		, vaddr_t label
+#endif
+	)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	struct pageref *pr;	// pageref for page we're allocating from
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
+	void *retptr;		// our result
+
+	volatile int i;
+
+#ifdef GUARDS
+	size_t clientsz;
+#endif
 #ifdef GUARDS
 	clientsz = sz;
 	sz += GUARD_OVERHEAD;
@@ -920,25 +1408,7 @@ subpage_kmalloc(size_t sz
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+			retptr = subpage_takeblock(pr);
 #ifdef GUARDS
 			retptr = establishguardband(retptr, clientsz, sz);
 #endif
@@ -953,6 +1423,17 @@ subpage_kmalloc(size_t sz
 		}
 	}
 
+	/* A page from the reserve saves getting a new one. */
+	pr = reservebases[blktype];
+	if (pr != NULL) {
+		reservebases[blktype] = pr->next_samesize;
+		nreserved[blktype]--;
+		reserve_hits++;
+		pr->next_samesize = sizebases[blktype];
+		sizebases[blktype] = pr;
+		goto doalloc;
+	}
+
 	/*
 	 * No page of the right size available.
 	 * Make a new one.
@@ -987,6 +1468,7 @@ subpage_kmalloc(size_t sz
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
+	frame_set_kmalloc_ref(prpage, pr);
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -1028,8 +1510,6 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
@@ -1064,30 +1544,20 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = subpage_findpage(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+	if (offset + sizes[blktype] > PAGE_SIZE ||
+	    offset % sizes[blktype] != 0) {
 		panic("kfree: subpage free of invalid addr %p\n", ptr);
 	}
 
@@ -1103,40 +1573,7 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef((void *)ptraddr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-
-		/* this block should not already be on the free list! */
-#ifdef SLOW
-		{
-			struct freelist *fl2;
-
-			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
-				KASSERT(fl2 != fl);
-			}
-		}
-#else
-		/* check just the head */
-		KASSERT(fl != fl->next);
-#endif
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
+	if (subpage_putblock(pr, offset)) {
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
@@ -1154,6 +1591,301 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+////////////////////////////////////////
+
+/*
+ * Per-cpu magazines.
+ *
+ * Each cpu keeps a magazine of free blocks of each size (see vm.h).
+ * kmalloc pops a block off the local magazine and kfree pushes it
+ * back, with interrupts off and no lock; kfree gets the block's size
+ * from the frame table. Only when a magazine runs empty (or full) is
+ * kmalloc_spinlock taken, to move half a magazine's worth of blocks
+ * from (or to) the page lists in one go.
+ *
+ * A magazine holds at most a page's worth of blocks, so a cpu never
+ * sits on more than NSIZES pages of free blocks. They are given back
+ * if memory runs out.
+ */
+
+#ifdef MAGAZINES
+
+static
+unsigned
+mag_capacity(unsigned blktype)
+{
+	unsigned n;
+
+	n = PAGE_SIZE / sizes[blktype];
+	if (n > KMALLOC_MAGSIZE) {
+		n = KMALLOC_MAGSIZE;
+	}
+	return n < 2 ? 2 : n;
+}
+
+void
+kmalloc_cache_init(struct kmalloc_cache *kc, unsigned cpunum)
+{
+	unsigned i;
+
+	KASSERT(cpunum < MAXCPUS);
+
+	for (i=0; i<NSIZES; i++) {
+		kc->kc_mags[i].km_count = 0;
+	}
+	kc->kc_allochits = 0;
+	kc->kc_refills = 0;
+	kc->kc_freehits = 0;
+	kc->kc_drains = 0;
+	kmalloc_caches[cpunum] = kc;
+}
+
+/*
+ * The current cpu's magazines. Before thread_bootstrap() there is no
+ * curcpu; those calls go straight to the page lists. Interrupts must
+ * be off so we stay on this cpu.
+ */
+static
+struct kmalloc_cache *
+mag_get(void)
+{
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	KASSERT(curthread->t_curspl > 0);
+	return &curcpu->c_kmcache;
+}
+
+/*
+ * Move blocks from MAG back to their pages until KEEP are left.
+ * Pages this frees up are put in EMPTY[] for the caller to pass to
+ * free_kpages, with interrupts back on; returns how many there are.
+ */
+static
+unsigned
+mag_drain(struct kmalloc_magazine *mag, unsigned keep, vaddr_t *empty)
+{
+	struct pageref *pr;
+	vaddr_t ptraddr, prpage;
+	unsigned nempty = 0;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	while (mag->km_count > keep) {
+		ptraddr = (vaddr_t)mag->km_blocks[--mag->km_count];
+		pr = subpage_findpage(ptraddr);
+		KASSERT(pr != NULL);
+		prpage = PR_PAGEADDR(pr);
+		if (subpage_putblock(pr, ptraddr - prpage)) {
+			empty[nempty++] = prpage;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+	return nempty;
+}
+
+/*
+ * Take a block of type BLKTYPE from this cpu's magazine, refilling it
+ * from pages that already have free blocks if it is empty. Returns
+ * NULL if there are none; the caller then goes to subpage_kmalloc,
+ * which gets a new page.
+ */
+static
+void *
+mag_alloc(unsigned blktype)
+{
+	struct kmalloc_cache *kc;
+	struct kmalloc_magazine *mag;
+	struct pageref *pr;
+	unsigned batch;
+	void *ptr;
+	int spl;
+
+	spl = splhigh();
+	kc = mag_get();
+	if (kc == NULL) {
+		splx(spl);
+		return NULL;
+	}
+	mag = &kc->kc_mags[blktype];
+
+	if (mag->km_count > 0) {
+		kc->kc_allochits++;
+	}
+	else {
+		kc->kc_refills++;
+		batch = mag_capacity(blktype) / 2;
+		spinlock_acquire(&kmalloc_spinlock);
+		for (pr = sizebases[blktype];
+		     pr != NULL && mag->km_count < batch;
+		     pr = pr->next_samesize) {
+			while (pr->nfree > 0 && mag->km_count < batch) {
+				mag->km_blocks[mag->km_count++] =
+					subpage_takeblock(pr);
+			}
+		}
+		spinlock_release(&kmalloc_spinlock);
+	}
+
+	ptr = NULL;
+	if (mag->km_count > 0) {
+		ptr = mag->km_blocks[--mag->km_count];
+	}
+	splx(spl);
+	return ptr;
+}
+
+/*
+ * Put a block in this cpu's magazine, first draining half of it if it
+ * is full. Returns false, doing nothing, if PTR is not a subpage block
+ * or there are no magazines yet.
+ */
+static
+bool
+mag_free(void *ptr)
+{
+	struct kmalloc_cache *kc;
+	struct kmalloc_magazine *mag;
+	struct pageref *pr;
+	vaddr_t offset, empty[KMALLOC_MAGSIZE];
+	unsigned cap, nempty, i;
+	int blktype, spl;
+
+	/* The page can't go away: PTR is still allocated from it. */
+	pr = frame_kmalloc_ref((vaddr_t)ptr);
+	if (pr == NULL) {
+		return false;
+	}
+	blktype = PR_BLOCKTYPE(pr);
+	offset = (vaddr_t)ptr - PR_PAGEADDR(pr);
+	if (offset + sizes[blktype] > PAGE_SIZE ||
+	    offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	spl = splhigh();
+	kc = mag_get();
+	if (kc == NULL) {
+		splx(spl);
+		return false;
+	}
+
+	/* As in subpage_kfree, to catch uses of dangling pointers. */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	mag = &kc->kc_mags[blktype];
+	cap = mag_capacity(blktype);
+	nempty = 0;
+	if (mag->km_count < cap) {
+		kc->kc_freehits++;
+	}
+	else {
+		kc->kc_drains++;
+		nempty = mag_drain(mag, cap / 2, empty);
+	}
+	mag->km_blocks[mag->km_count++] = ptr;
+	splx(spl);
+
+	for (i=0; i<nempty; i++) {
+		free_kpages(empty[i]);
+	}
+	return true;
+}
+
+/*
+ * Give back everything in this cpu's magazines, so that pages they
+ * were keeping can be freed. Used when an allocation fails; returns
+ * true if it freed any page, i.e. if trying again might help.
+ */
+static
+bool
+mag_flush(void)
+{
+	struct kmalloc_cache *kc;
+	vaddr_t empty[KMALLOC_MAGSIZE];
+	unsigned i, j, nempty;
+	bool freed = false;
+	int spl;
+
+	for (i=0; i<NSIZES; i++) {
+		spl = splhigh();
+		kc = mag_get();
+		if (kc == NULL) {
+			splx(spl);
+			return false;
+		}
+		nempty = mag_drain(&kc->kc_mags[i], 0, empty);
+		splx(spl);
+
+		for (j=0; j<nempty; j++) {
+			free_kpages(empty[j]);
+			freed = true;
+		}
+	}
+	return freed;
+}
+
+#else /* not MAGAZINES */
+
+void
+kmalloc_cache_init(struct kmalloc_cache *kc, unsigned cpunum)
+{
+	(void)kc;
+	(void)cpunum;
+}
+
+#endif /* MAGAZINES */
+
+/*
+ * Free the reserve of empty pages. Called by the VM system when it is
+ * short of memory, and by kmalloc when an allocation fails. Returns
+ * true if it freed any page.
+ */
+bool
+kheap_reclaim(void)
+{
+	vaddr_t pages[NSIZES * KHEAP_RESERVE];
+	struct pageref *pr;
+	unsigned i, n;
+
+	n = 0;
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<NSIZES; i++) {
+		while ((pr = reservebases[i]) != NULL) {
+			KASSERT(n < ARRAYCOUNT(pages));
+			reservebases[i] = pr->next_samesize;
+			nreserved[i]--;
+			remove_all(pr);
+			pages[n++] = PR_PAGEADDR(pr);
+			freepageref(pr);
+			frame_set_kmalloc_ref(PR_PAGEADDR(pr), NULL);
+		}
+	}
+	reserve_releases += n;
+	spinlock_release(&kmalloc_spinlock);
+
+	for (i=0; i<n; i++) {
+		free_kpages(pages[i]);
+	}
+	return n > 0;
+}
+
+/*
+ * Give back whatever kmalloc is keeping, so that a failed allocation
+ * can be tried again, or so that it is not counted as in use (see
+ * vm_drain). The magazines go first: their blocks may empty pages,
+ * which then go in the reserve.
+ */
+bool
+kheap_drain(void)
+{
+	bool freed = false;
+
+#ifdef MAGAZINES
+	freed = mag_flush();
+#endif
+	return kheap_reclaim() || freed;
+}
+
 //
 ////////////////////////////////////////////////////////////
 
@@ -1165,6 +1897,9 @@ void *
 kmalloc(size_t sz)
 {
 	size_t checksz;
+#ifdef MAGAZINES
+	void *ptr;
+#endif
 #ifdef LABELS
 	vaddr_t label;
 #endif
@@ -1185,21 +1920,57 @@ kmalloc(size_t sz)
 		/* Round up to a whole number of pages. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
 		address = alloc_kpages(npages);
+		if (address==0 && kheap_drain()) {
+			address = alloc_kpages(npages);
+		}
 		if (address==0) {
 			return NULL;
 		}
 		KASSERT(address % PAGE_SIZE == 0);
+#ifdef PROFILE
+		profile_large_alloc();
+#endif
 
 		return (void *)address;
 	}
 
-#ifdef LABELS
+#ifdef PROFILE
+	profile_alloc(checksz);
+#endif
+
+#ifdef MAGAZINES
+	ptr = mag_alloc(blocktype(sz));
+	if (ptr != NULL) {
+		return ptr;
+	}
+	ptr = subpage_kmalloc(sz);
+	if (ptr == NULL && kheap_drain()) {
+		ptr = subpage_kmalloc(sz);
+	}
+	return ptr;
+#elif defined(LABELS)
 	return subpage_kmalloc(sz, label);
 #else
 	return subpage_kmalloc(sz);
 #endif
 }
 
+/*
+ * How much memory kmalloc(SZ) really takes: the block size it would
+ * use, or whole pages.
+ */
+size_t
+kmalloc_blocksize(size_t sz)
+{
+	size_t checksz;
+
+	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
+	if (checksz >= LARGEST_SUBPAGE_SIZE) {
+		return ROUNDUP(sz, PAGE_SIZE);
+	}
+	return sizes[blocktype(checksz)];
+}
+
 /*
  * Free a block previously returned from kmalloc.
  */
@@ -1207,11 +1978,21 @@ void
 kfree(void *ptr)
 {
 	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
+	 * Try the magazines, then subpage; if those fail, assume it's a
+	 * big allocation.
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#ifdef PROFILE
+	profile_free(ptr);
+#endif
+#ifdef MAGAZINES
+	if (mag_free(ptr)) {
+		return;
+	}
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
@@ -0,0 +1,332 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <objcache.h>
+
+/*
+ * Object caches. See objcache.h.
+ *
+ * A slab is one page: this header, then a stack of the indexes of its
+ * free objects, then the objects. An object's slab is found from its
+ * address alone. Full slabs are on no list; the rest are on the
+ * cache's partial list, which is doubly linked so a slab can come off
+ * it when its last object is handed out.
+ */
+
+struct objslab {
+	struct objcache *sl_cache;
+	struct objslab *sl_prev;
+	struct objslab *sl_next;
+	unsigned sl_nfree;
+	uint16_t sl_free[];		/* indexes of the free objects */
+};
+
+/*
+ * Empty slabs kept per cache. One is enough to absorb a create and
+ * destroy in a loop without building and tearing down a slab each time.
+ */
+#define OBJCACHE_KEEP 1
+
+/* All caches that have had a slab, for objcache_printstats. */
+static struct spinlock objcaches_lock = SPINLOCK_INITIALIZER;
+static struct objcache *objcaches;
+
+static
+void *
+objslab_obj(struct objcache *oc, struct objslab *sl, unsigned index)
+{
+	return (char *)sl + oc->oc_offset + index * oc->oc_size;
+}
+
+/*
+ * Work out the slab layout; the cache's size is fixed, so every slab
+ * gets the same one.
+ */
+static
+void
+objcache_layout(struct objcache *oc)
+{
+	unsigned n;
+
+	n = (PAGE_SIZE - sizeof(struct objslab)) / (oc->oc_size + 2);
+	while (n > 0 && ROUNDUP(sizeof(struct objslab) + n * 2, 8) +
+	       n * oc->oc_size > PAGE_SIZE) {
+		n--;
+	}
+	if (n == 0) {
+		panic("objcache %s: %u-byte objects don't fit in a page\n",
+		      oc->oc_name, (unsigned)oc->oc_size);
+	}
+	oc->oc_offset = ROUNDUP(sizeof(struct objslab) + n * 2, 8);
+	oc->oc_perslab = n;
+}
+
+/*
+ * Get a page and construct every object in it. If a constructor
+ * fails, the objects done so far are destroyed again.
+ */
+static
+struct objslab *
+objslab_create(struct objcache *oc)
+{
+	struct objslab *sl;
+	vaddr_t page;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+	sl = (struct objslab *)page;
+	sl->sl_cache = oc;
+	sl->sl_prev = sl->sl_next = NULL;
+
+	for (i = 0; i < oc->oc_perslab; i++) {
+		if (oc->oc_ctor != NULL && oc->oc_ctor(objslab_obj(oc, sl, i))) {
+			while (i-- > 0) {
+				if (oc->oc_dtor != NULL) {
+					oc->oc_dtor(objslab_obj(oc, sl, i));
+				}
+			}
+			free_kpages(page);
+			return NULL;
+		}
+		/* Hand out the lowest-addressed objects first. */
+		sl->sl_free[oc->oc_perslab - 1 - i] = i;
+	}
+	sl->sl_nfree = oc->oc_perslab;
+	return sl;
+}
+
+/*
+ * Destroy an empty slab that is no longer on any list.
+ */
+static
+void
+objslab_destroy(struct objcache *oc, struct objslab *sl)
+{
+	unsigned i;
+
+	KASSERT(sl->sl_nfree == oc->oc_perslab);
+
+	if (oc->oc_dtor != NULL) {
+		for (i = 0; i < oc->oc_perslab; i++) {
+			oc->oc_dtor(objslab_obj(oc, sl, i));
+		}
+	}
+	free_kpages((vaddr_t)sl);
+}
+
+static
+void
+objcache_link(struct objcache *oc, struct objslab *sl)
+{
+	KASSERT(spinlock_do_i_hold(&oc->oc_lock));
+
+	sl->sl_prev = NULL;
+	sl->sl_next = oc->oc_partial;
+	if (oc->oc_partial != NULL) {
+		oc->oc_partial->sl_prev = sl;
+	}
+	oc->oc_partial = sl;
+}
+
+static
+void
+objcache_unlink(struct objcache *oc, struct objslab *sl)
+{
+	KASSERT(spinlock_do_i_hold(&oc->oc_lock));
+
+	if (sl->sl_prev != NULL) {
+		sl->sl_prev->sl_next = sl->sl_next;
+	}
+	else {
+		KASSERT(oc->oc_partial == sl);
+		oc->oc_partial = sl->sl_next;
+	}
+	if (sl->sl_next != NULL) {
+		sl->sl_next->sl_prev = sl->sl_prev;
+	}
+	sl->sl_prev = sl->sl_next = NULL;
+}
+
+/*
+ * Add a slab built outside the lock.
+ */
+static
+void
+objcache_grow(struct objcache *oc, struct objslab *sl)
+{
+	bool list = false;
+
+	spinlock_acquire(&oc->oc_lock);
+	objcache_link(oc, sl);
+	oc->oc_slabs++;
+	oc->oc_nempty++;
+	oc->oc_grows++;
+	if (!oc->oc_listed) {
+		oc->oc_listed = true;
+		list = true;
+	}
+	spinlock_release(&oc->oc_lock);
+
+	if (list) {
+		spinlock_acquire(&objcaches_lock);
+		oc->oc_next = objcaches;
+		objcaches = oc;
+		spinlock_release(&objcaches_lock);
+	}
+}
+
+void *
+objcache_alloc(struct objcache *oc)
+{
+	struct objslab *sl;
+	unsigned index;
+
+	spinlock_acquire(&oc->oc_lock);
+	if (oc->oc_perslab == 0) {
+		objcache_layout(oc);
+	}
+	while (oc->oc_partial == NULL) {
+		spinlock_release(&oc->oc_lock);
+		sl = objslab_create(oc);
+		if (sl == NULL) {
+			return NULL;
+		}
+		/* Someone else may have freed objects meanwhile; fine. */
+		objcache_grow(oc, sl);
+		spinlock_acquire(&oc->oc_lock);
+	}
+
+	sl = oc->oc_partial;
+	KASSERT(sl->sl_nfree > 0);
+	if (sl->sl_nfree == oc->oc_perslab) {
+		KASSERT(oc->oc_nempty > 0);
+		oc->oc_nempty--;
+	}
+	index = sl->sl_free[--sl->sl_nfree];
+	if (sl->sl_nfree == 0) {
+		objcache_unlink(oc, sl);
+	}
+	oc->oc_inuse++;
+	oc->oc_allocs++;
+	spinlock_release(&oc->oc_lock);
+
+	return objslab_obj(oc, sl, index);
+}
+
+void
+objcache_free(struct objcache *oc, void *obj)
+{
+	struct objslab *sl;
+	vaddr_t offset;
+	unsigned index;
+
+	sl = (struct objslab *)((vaddr_t)obj & PAGE_FRAME);
+	KASSERT(sl->sl_cache == oc);
+	offset = (vaddr_t)obj - (vaddr_t)sl;
+	KASSERT(offset >= oc->oc_offset);
+	index = (offset - oc->oc_offset) / oc->oc_size;
+	KASSERT(index < oc->oc_perslab);
+	KASSERT(objslab_obj(oc, sl, index) == obj);
+
+	spinlock_acquire(&oc->oc_lock);
+	KASSERT(sl->sl_nfree < oc->oc_perslab);
+	if (sl->sl_nfree == 0) {
+		objcache_link(oc, sl);
+	}
+	sl->sl_free[sl->sl_nfree++] = index;
+	KASSERT(oc->oc_inuse > 0);
+	oc->oc_inuse--;
+	oc->oc_frees++;
+
+	if (sl->sl_nfree < oc->oc_perslab) {
+		sl = NULL;
+	}
+	else if (oc->oc_nempty < OBJCACHE_KEEP) {
+		oc->oc_nempty++;
+		sl = NULL;
+	}
+	else {
+		objcache_unlink(oc, sl);
+		oc->oc_slabs--;
+	}
+	spinlock_release(&oc->oc_lock);
+
+	if (sl != NULL) {
+		objslab_destroy(oc, sl);
+	}
+}
+
+/*
+ * Free every cache's empty slabs, including the ones it keeps.
+ */
+void
+objcache_reclaim(void)
+{
+	struct objcache *oc;
+	struct objslab *sl, *next, *empty;
+
+	/* Caches are only ever added, at the head. */
+	spinlock_acquire(&objcaches_lock);
+	oc = objcaches;
+	spinlock_release(&objcaches_lock);
+
+	for (; oc != NULL; oc = oc->oc_next) {
+		empty = NULL;
+		spinlock_acquire(&oc->oc_lock);
+		for (sl = oc->oc_partial; sl != NULL; sl = next) {
+			next = sl->sl_next;
+			if (sl->sl_nfree == oc->oc_perslab) {
+				objcache_unlink(oc, sl);
+				KASSERT(oc->oc_nempty > 0);
+				oc->oc_nempty--;
+				oc->oc_slabs--;
+				sl->sl_next = empty;
+				empty = sl;
+			}
+		}
+		spinlock_release(&oc->oc_lock);
+
+		while (empty != NULL) {
+			sl = empty;
+			empty = sl->sl_next;
+			objslab_destroy(oc, sl);
+		}
+	}
+}
+
+void
+objcache_printstats(void)
+{
+	struct objcache *oc;
+	unsigned perslab, slabs, inuse, allocs, frees, grows;
+
+	/* Caches are only ever added, at the head. */
+	spinlock_acquire(&objcaches_lock);
+	oc = objcaches;
+	spinlock_release(&objcaches_lock);
+
+	kprintf("Object caches:\n");
+	for (; oc != NULL; oc = oc->oc_next) {
+		spinlock_acquire(&oc->oc_lock);
+		perslab = oc->oc_perslab;
+		slabs = oc->oc_slabs;
+		inuse = oc->oc_inuse;
+		allocs = oc->oc_allocs;
+		frees = oc->oc_frees;
+		grows = oc->oc_grows;
+		spinlock_release(&oc->oc_lock);
+
+		kprintf("  %-8s %4u bytes: %u/%u in use, %u slabs (%u KB, "
+			"%u%% used); %u allocs, %u frees, %u slabs built\n",
+			oc->oc_name, (unsigned)oc->oc_size,
+			inuse, slabs * perslab, slabs,
+			slabs * PAGE_SIZE / 1024,
+			slabs ? inuse * (unsigned)oc->oc_size * 100 /
+				(slabs * PAGE_SIZE) : 0,
+			allocs, frees, grows);
+	}
+}
@@ -0,0 +1,246 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vm.h>
+#include <pagecache.h>
+
+/*
+ * Each slot holds the frame's physical address, which is page
+ * aligned, with PC_DIRTY in the low bit; 0 if the page is not cached.
+ */
+#define PC_DIRTY 0x1
+
+#define PC_PADDR(e) ((paddr_t)((e) & PAGE_FRAME))
+
+struct pagecache {
+	struct vnode *pc_vnode;
+	unsigned pc_users;		/* attached mappings */
+	unsigned pc_npages;		/* file pages covered */
+	paddr_t *pc_frames;		/* per file page, see above */
+	struct pagecache *pc_next;
+};
+
+/* All pagecaches; there are only ever a few. Protected by vm_lock. */
+static struct pagecache *pagecaches;
+
+/* Statistics. */
+static unsigned pc_hits;		/* faults served from the cache */
+static unsigned pc_loads;		/* pages read and cached */
+static unsigned pc_writebacks;		/* dirty pages handed back */
+static unsigned pc_reclaims;		/* idle pages given back */
+
+/*
+ * Make PC cover at least NPAGES file pages.
+ */
+static
+int
+pagecache_grow(struct pagecache *pc, unsigned npages)
+{
+	paddr_t *frames;
+
+	if (npages <= pc->pc_npages) {
+		return 0;
+	}
+
+	frames = kmalloc(npages * sizeof(paddr_t));
+	if (frames == NULL) {
+		return ENOMEM;
+	}
+	bzero(frames, npages * sizeof(paddr_t));
+	if (pc->pc_frames != NULL) {
+		memcpy(frames, pc->pc_frames, pc->pc_npages * sizeof(paddr_t));
+		kfree(pc->pc_frames);
+	}
+	pc->pc_frames = frames;
+	pc->pc_npages = npages;
+	return 0;
+}
+
+int
+pagecache_attach(struct vnode *v, unsigned npages, struct pagecache **ret)
+{
+	struct pagecache *pc;
+	int result;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	for (pc = pagecaches; pc != NULL; pc = pc->pc_next) {
+		if (pc->pc_vnode == v) {
+			result = pagecache_grow(pc, npages);
+			if (result) {
+				return result;
+			}
+			pc->pc_users++;
+			*ret = pc;
+			return 0;
+		}
+	}
+
+	pc = kmalloc(sizeof(*pc));
+	if (pc == NULL) {
+		return ENOMEM;
+	}
+	pc->pc_vnode = v;
+	pc->pc_users = 1;
+	pc->pc_npages = 0;
+	pc->pc_frames = NULL;
+	result = pagecache_grow(pc, npages);
+	if (result) {
+		kfree(pc);
+		return result;
+	}
+
+	pc->pc_next = pagecaches;
+	pagecaches = pc;
+
+	*ret = pc;
+	return 0;
+}
+
+void
+pagecache_detach(struct pagecache *pc)
+{
+	struct pagecache **p;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+	KASSERT(pc->pc_users > 0);
+
+	if (--pc->pc_users > 0) {
+		return;
+	}
+
+	for (p = &pagecaches; *p != pc; p = &(*p)->pc_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = pc->pc_next;
+
+	for (i = 0; i < pc->pc_npages; i++) {
+		KASSERT((pc->pc_frames[i] & PC_DIRTY) == 0);
+		if (pc->pc_frames[i] != 0) {
+			frame_decref(PC_PADDR(pc->pc_frames[i]));
+		}
+	}
+	kfree(pc->pc_frames);
+	kfree(pc);
+}
+
+paddr_t
+pagecache_lookup(struct pagecache *pc, unsigned index)
+{
+	paddr_t paddr;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+	KASSERT(index < pc->pc_npages);
+
+	paddr = PC_PADDR(pc->pc_frames[index]);
+	if (paddr != 0) {
+		frame_incref(paddr);
+		pc_hits++;
+	}
+	return paddr;
+}
+
+void
+pagecache_insert(struct pagecache *pc, unsigned index, paddr_t paddr)
+{
+	KASSERT(lock_do_i_hold(vm_lock));
+	KASSERT(index < pc->pc_npages);
+	KASSERT(pc->pc_frames[index] == 0);
+	KASSERT(PC_PADDR(paddr) == paddr);
+
+	frame_incref(paddr);
+	pc->pc_frames[index] = paddr;
+	pc_loads++;
+}
+
+void
+pagecache_dirty(struct pagecache *pc, unsigned index)
+{
+	KASSERT(lock_do_i_hold(vm_lock));
+	KASSERT(index < pc->pc_npages);
+	KASSERT(pc->pc_frames[index] != 0);
+
+	pc->pc_frames[index] |= PC_DIRTY;
+}
+
+/*
+ * Besides the cache's reference and the one taken here for the
+ * caller, every reference to the frame is a mapping of it; if the
+ * caller's is the only one, nobody else can dirty it again.
+ */
+paddr_t
+pagecache_clean(struct pagecache *pc, unsigned index, paddr_t mapped)
+{
+	paddr_t paddr;
+	unsigned mine;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	if (index >= pc->pc_npages || !(pc->pc_frames[index] & PC_DIRTY)) {
+		return 0;
+	}
+
+	paddr = PC_PADDR(pc->pc_frames[index]);
+	frame_incref(paddr);
+	mine = mapped == paddr ? 3 : 2;
+	if (frame_refcount(paddr) <= mine) {
+		pc->pc_frames[index] = paddr;
+	}
+	pc_writebacks++;
+	return paddr;
+}
+
+/*
+ * Give back one clean cached page nobody has mapped.
+ */
+bool
+pagecache_reclaim(void)
+{
+	struct pagecache *pc;
+	paddr_t entry;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	for (pc = pagecaches; pc != NULL; pc = pc->pc_next) {
+		for (i = 0; i < pc->pc_npages; i++) {
+			entry = pc->pc_frames[i];
+			if (entry != 0 && !(entry & PC_DIRTY) &&
+			    frame_refcount(entry) == 1) {
+				pc->pc_frames[i] = 0;
+				frame_decref(entry);
+				pc_reclaims++;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void
+pagecache_printstats(void)
+{
+	struct pagecache *pc;
+	unsigned nfiles = 0, npages = 0, ndirty = 0, i;
+
+	lock_acquire(vm_lock);
+	for (pc = pagecaches; pc != NULL; pc = pc->pc_next) {
+		nfiles++;
+		for (i = 0; i < pc->pc_npages; i++) {
+			if (pc->pc_frames[i] != 0) {
+				npages++;
+			}
+			if (pc->pc_frames[i] & PC_DIRTY) {
+				ndirty++;
+			}
+		}
+	}
+	lock_release(vm_lock);
+
+	kprintf("Mapped files: %u pages (%u dirty) in %u files, "
+		"%u hits, %u loads, %u written back, %u reclaimed\n",
+		npages, ndirty, nfiles, pc_hits, pc_loads, pc_writebacks,
+		pc_reclaims);
+}
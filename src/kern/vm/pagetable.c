@@ -0,0 +1,237 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <vm.h>
+#include <swap.h>
+
+#if !OPT_HASHPT
+
+/*
+ * Two-level page table. See pagetable.h.
+ */
+
+#define PT1_BYTES (sizeof(page_table_entry *) * PAGE_TABLE_SIZE)
+#define PT2_BYTES (sizeof(page_table_entry) * PAGE_TABLE_SIZE)
+
+/* Tables of both levels in existence; roots come and go without vm_lock. */
+static struct spinlock pt_statlock = SPINLOCK_INITIALIZER;
+static unsigned pt_nroots;
+static unsigned pt_ntables;
+
+void
+pt_bootstrap(void)
+{
+	/* Nothing global to set up. */
+}
+
+int
+pt_create(struct addrspace *as)
+{
+	as->page_table = kmalloc(PT1_BYTES);
+	if (as->page_table == NULL) {
+		return ENOMEM;
+	}
+	bzero(as->page_table, PT1_BYTES);
+
+	spinlock_acquire(&pt_statlock);
+	pt_nroots++;
+	spinlock_release(&pt_statlock);
+	return 0;
+}
+
+/*
+ * Make the second-level table for PT1, counting it.
+ */
+static
+page_table_entry *
+pt_alloc_pt2(struct addrspace *as, unsigned pt1)
+{
+	page_table_entry *pt2;
+
+	pt2 = kmalloc(PT2_BYTES);
+	if (pt2 == NULL) {
+		return NULL;
+	}
+	as->page_table[pt1] = pt2;
+
+	spinlock_acquire(&pt_statlock);
+	pt_ntables++;
+	spinlock_release(&pt_statlock);
+	return pt2;
+}
+
+page_table_entry *
+pt_lookup(struct addrspace *as, vaddr_t vaddr, bool create)
+{
+	page_table_entry *pt2;
+	unsigned pt1;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	pt1 = PT1_INDEX(vaddr);
+	pt2 = as->page_table[pt1];
+
+	if (pt2 == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		pt2 = pt_alloc_pt2(as, pt1);
+		if (pt2 == NULL) {
+			return NULL;
+		}
+		bzero(pt2, PT2_BYTES);
+	}
+
+	return &pt2[PT2_INDEX(vaddr)];
+}
+
+int
+pt_copy(struct addrspace *old, struct addrspace *new)
+{
+	page_table_entry *oldpt2, *newpt2;
+	page_table_entry pte;
+	unsigned i, j;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	for (i = 0; i < PAGE_TABLE_SIZE; i++) {
+		oldpt2 = old->page_table[i];
+		if (oldpt2 == NULL) {
+			continue;
+		}
+
+		newpt2 = pt_alloc_pt2(new, i);
+		if (newpt2 == NULL) {
+			return ENOMEM;
+		}
+
+		for (j = 0; j < PAGE_TABLE_SIZE; j++) {
+			pte = oldpt2[j];
+			if (pte & PTE_VALID) {
+				/* Share the frame; whoever writes first copies. */
+				pte &= ~PTE_WRITE;
+				oldpt2[j] = pte;
+				frame_incref(PTE_PADDR(pte));
+			}
+			else if (pte & PTE_SWAPPED) {
+				swap_incref(PTE_SLOT(pte));
+			}
+			newpt2[j] = pte;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Drop the page's reference to its frame (batched) or swap slot.
+ */
+static
+void
+pt_release_entry(struct frame_batch *fb, page_table_entry pte)
+{
+	if (pte & PTE_VALID) {
+		frame_batch_add(fb, PTE_PADDR(pte));
+	}
+	else if (pte & PTE_SWAPPED) {
+		swap_decref(PTE_SLOT(pte));
+	}
+}
+
+/*
+ * Second-level tables are walked whole and ones never touched are
+ * skipped, so releasing a large, sparsely used range is cheap. The
+ * tables themselves are kept; the range is likely to be used again.
+ */
+void
+pt_release(struct addrspace *as, vaddr_t base, vaddr_t top)
+{
+	struct frame_batch fb;
+	page_table_entry *pt2;
+	vaddr_t va, next;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+	KASSERT((base & PAGE_FRAME) == base);
+	KASSERT((top & PAGE_FRAME) == top);
+
+	frame_batch_init(&fb, as);
+
+	for (va = base; va < top; va = next) {
+		/* Start of the next 4M, or 0 at the top of memory. */
+		next = (va + (PAGE_SIZE * PAGE_TABLE_SIZE)) &
+			~(vaddr_t)(PAGE_SIZE * PAGE_TABLE_SIZE - 1);
+		if (next == 0 || next > top) {
+			next = top;
+		}
+
+		pt2 = as->page_table[PT1_INDEX(va)];
+		if (pt2 == NULL) {
+			continue;
+		}
+		for (; va < next; va += PAGE_SIZE) {
+			pt_release_entry(&fb, pt2[PT2_INDEX(va)]);
+			pt2[PT2_INDEX(va)] = 0;
+		}
+	}
+	frame_batch_flush(&fb);
+}
+
+void
+pt_destroy(struct addrspace *as)
+{
+	struct frame_batch fb;
+	page_table_entry *pt2;
+	unsigned i, j, n = 0;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	frame_batch_init(&fb, as);
+
+	for (i = 0; i < PAGE_TABLE_SIZE; i++) {
+		pt2 = as->page_table[i];
+		if (pt2 == NULL) {
+			continue;
+		}
+
+		for (j = 0; j < PAGE_TABLE_SIZE; j++) {
+			pt_release_entry(&fb, pt2[j]);
+		}
+		kfree(pt2);
+		as->page_table[i] = NULL;
+		n++;
+	}
+
+	frame_batch_flush(&fb);
+	kfree(as->page_table);
+	as->page_table = NULL;
+
+	spinlock_acquire(&pt_statlock);
+	pt_nroots--;
+	pt_ntables -= n;
+	spinlock_release(&pt_statlock);
+}
+
+size_t
+pt_overhead(void)
+{
+	size_t bytes;
+
+	spinlock_acquire(&pt_statlock);
+	bytes = pt_nroots * PT1_BYTES + pt_ntables * PT2_BYTES;
+	spinlock_release(&pt_statlock);
+	return bytes;
+}
+
+void
+pt_printstats(void)
+{
+	kprintf("Page tables: two-level, %u roots and %u second-level "
+		"tables, %u KB\n", pt_nroots, pt_ntables,
+		(unsigned)(pt_overhead() / 1024));
+}
+
+#endif /* !OPT_HASHPT */
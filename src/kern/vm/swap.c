@@ -0,0 +1,347 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swap.h>
+#include <zswap.h>
+
+/*
+ * The bitmap and reference counts are protected by swap_lock. I/O is
+ * done without it; a slot being read or written is referenced by its
+ * caller, so it cannot be reused underneath it.
+ */
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+static struct vnode *swap_vnode;
+static struct bitmap *swap_map;
+static uint16_t *swap_refs;
+static unsigned swap_nslots;
+static unsigned swap_nused;
+static unsigned swap_rotor;		/* where the next cluster search starts */
+
+/* Statistics (swap_lock); these count disk I/O only. */
+static unsigned swap_pageouts;
+static unsigned swap_pageins;
+static unsigned swap_writes;		/* requests, of one or more pages */
+static unsigned swap_reads;
+static unsigned stats_lastops;
+static struct timespec stats_lasttime;
+
+void
+swap_bootstrap(void)
+{
+	char path[] = SWAP_DEVICE;
+	struct stat st;
+	int result;
+
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: %s: %s; paging disabled\n",
+			SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		goto fail;
+	}
+	swap_nslots = st.st_size / PAGE_SIZE;
+	if (swap_nslots == 0) {
+		result = ENOSPC;
+		goto fail;
+	}
+
+	swap_map = bitmap_create(swap_nslots);
+	if (swap_map == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	swap_refs = kmalloc(swap_nslots * sizeof(swap_refs[0]));
+	if (swap_refs == NULL) {
+		bitmap_destroy(swap_map);
+		swap_map = NULL;
+		result = ENOMEM;
+		goto fail;
+	}
+	bzero(swap_refs, swap_nslots * sizeof(swap_refs[0]));
+
+	kprintf("swap: %s, %u pages\n", SWAP_DEVICE, swap_nslots);
+	zswap_bootstrap(swap_nslots);
+	return;
+
+ fail:
+	kprintf("swap: %s: %s; paging disabled\n",
+		SWAP_DEVICE, strerror(result));
+	vfs_close(swap_vnode);
+	swap_vnode = NULL;
+	swap_nslots = 0;
+}
+
+/*
+ * How far swap_alloc_cluster looks for a full-sized run once it has
+ * found a shorter one; a fragmented swap disk shouldn't make every
+ * eviction scan all of it.
+ */
+#define SWAP_SCAN 256
+
+/*
+ * Next fit: look for WANT free slots in a row, starting where the last
+ * search left off, and settle for the longest run seen if there is no
+ * run that long nearby. Taking slots in order this way keeps the pages
+ * evicted together next to each other on disk.
+ */
+int
+swap_alloc_cluster(unsigned want, unsigned *first, unsigned *got)
+{
+	unsigned i, n, slot, start, best, bestlen;
+
+	KASSERT(want > 0 && want <= SWAP_CLUSTER);
+
+	if (swap_map == NULL) {
+		return ENOSPC;
+	}
+
+	spinlock_acquire(&swap_lock);
+	best = bestlen = 0;
+	start = 0;
+	n = 0;
+	for (i = 0; i < swap_nslots && bestlen < want; i++) {
+		if (bestlen > 0 && i >= SWAP_SCAN) {
+			break;
+		}
+		slot = (swap_rotor + i) % swap_nslots;
+		if (slot == 0) {
+			/* A run can't wrap around the end of the disk. */
+			n = 0;
+		}
+		if (bitmap_isset(swap_map, slot)) {
+			n = 0;
+			continue;
+		}
+		if (n++ == 0) {
+			start = slot;
+		}
+		if (n > bestlen) {
+			best = start;
+			bestlen = n;
+		}
+	}
+	if (bestlen == 0) {
+		spinlock_release(&swap_lock);
+		return ENOSPC;
+	}
+	for (i = best; i < best + bestlen; i++) {
+		KASSERT(swap_refs[i] == 0);
+		bitmap_mark(swap_map, i);
+		swap_refs[i] = 1;
+	}
+	swap_nused += bestlen;
+	swap_rotor = (best + bestlen) % swap_nslots;
+	spinlock_release(&swap_lock);
+
+	*first = best;
+	*got = bestlen;
+	return 0;
+}
+
+void
+swap_incref(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_refs[slot] > 0);
+	KASSERT(swap_refs[slot] < 0xffff);
+	swap_refs[slot]++;
+	spinlock_release(&swap_lock);
+}
+
+void
+swap_decref(unsigned slot)
+{
+	bool freed = false;
+
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_refs[slot] > 0);
+	if (--swap_refs[slot] == 0) {
+		freed = true;
+	}
+	spinlock_release(&swap_lock);
+
+	if (freed) {
+		/* Before the slot can be handed out again. */
+		zswap_drop(slot);
+		spinlock_acquire(&swap_lock);
+		bitmap_unmark(swap_map, slot);
+		swap_nused--;
+		spinlock_release(&swap_lock);
+	}
+}
+
+/*
+ * Move N pages between memory and the consecutive slots starting at
+ * FIRST, as one request to the device.
+ */
+static
+int
+swap_io(unsigned first, const vaddr_t *kpages, unsigned n, enum uio_rw rw)
+{
+	struct iovec iov[SWAP_CLUSTER];
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+	KASSERT(n > 0 && n <= SWAP_CLUSTER);
+	KASSERT(first + n <= swap_nslots);
+
+	for (i = 0; i < n; i++) {
+		KASSERT((kpages[i] & PAGE_FRAME) == kpages[i]);
+		iov[i].iov_kbase = (void *)kpages[i];
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = (off_t)first * PAGE_SIZE;
+	ku.uio_resid = n * PAGE_SIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+
+	spinlock_acquire(&swap_lock);
+	if (rw == UIO_READ) {
+		swap_reads++;
+		swap_pageins += n;
+	}
+	else {
+		swap_writes++;
+		swap_pageouts += n;
+	}
+	spinlock_release(&swap_lock);
+
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		kprintf("swap: short %s on slots %u-%u\n",
+			rw == UIO_READ ? "read" : "write", first, first + n - 1);
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+ * Pages go to the compressed pool if they can, and to disk if not;
+ * each run of consecutive pages the pool does not take (or does not
+ * have) is one disk request.
+ */
+static
+int
+swap_cluster_io(unsigned first, const vaddr_t *kpages, unsigned n,
+		enum uio_rw rw)
+{
+	unsigned i, j;
+	int result;
+
+	i = 0;
+	while (i < n) {
+		for (j = i; j < n; j++) {
+			if (rw == UIO_WRITE ?
+			    zswap_store(first + j, kpages[j]) :
+			    zswap_load(first + j, kpages[j])) {
+				break;
+			}
+		}
+		if (j > i) {
+			result = swap_io(first + i, &kpages[i], j - i, rw);
+			if (result) {
+				return result;
+			}
+		}
+		/* Page J, if any, went through the pool. */
+		i = j + 1;
+	}
+	return 0;
+}
+
+int
+swap_out(unsigned slot, vaddr_t kpage)
+{
+	return swap_cluster_io(slot, &kpage, 1, UIO_WRITE);
+}
+
+int
+swap_in(unsigned slot, vaddr_t kpage)
+{
+	return swap_cluster_io(slot, &kpage, 1, UIO_READ);
+}
+
+int
+swap_out_cluster(unsigned first, const vaddr_t *kpages, unsigned n)
+{
+	return swap_cluster_io(first, kpages, n, UIO_WRITE);
+}
+
+int
+swap_in_cluster(unsigned first, const vaddr_t *kpages, unsigned n)
+{
+	return swap_cluster_io(first, kpages, n, UIO_READ);
+}
+
+bool
+swap_incore(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+	return zswap_contains(slot);
+}
+
+void
+swap_printstats(void)
+{
+	struct timespec now, diff;
+	unsigned ops;
+	uint64_t ms;
+
+	if (swap_map == NULL) {
+		kprintf("Swap: none\n");
+		return;
+	}
+	kprintf("Swap: %u/%u pages used, %u pageouts, %u pageins\n",
+		swap_nused, swap_nslots, swap_pageouts, swap_pageins);
+
+	gettime(&now);
+	timespec_sub(&now, &stats_lasttime, &diff);
+	ops = swap_writes + swap_reads;
+	ms = diff.tv_sec * 1000 + diff.tv_nsec / 1000000;
+	kprintf("Swap I/O: %u writes (%u.%u pages each), %u reads "
+		"(%u.%u pages each); %u in the last %llu.%03llu s (%llu/s)\n",
+		swap_writes,
+		swap_writes ? swap_pageouts / swap_writes : 0,
+		swap_writes ? swap_pageouts * 10 / swap_writes % 10 : 0,
+		swap_reads,
+		swap_reads ? swap_pageins / swap_reads : 0,
+		swap_reads ? swap_pageins * 10 / swap_reads % 10 : 0,
+		ops - stats_lastops, ms / 1000, ms % 1000,
+		ms ? (ops - stats_lastops) * 1000ULL / ms : 0ULL);
+	stats_lasttime = now;
+	stats_lastops = ops;
+
+	zswap_printstats();
+}
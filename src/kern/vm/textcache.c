@@ -0,0 +1,304 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vm.h>
+#include <textcache.h>
+
+struct textcache {
+	struct vnode *tc_vnode;
+	vaddr_t tc_base;		/* first page covered */
+	unsigned tc_npages;
+	unsigned tc_users;		/* attached address spaces */
+	unsigned tc_writes;		/* vnode_writes() when loaded */
+	paddr_t *tc_frames;		/* per page; 0 if not loaded */
+	struct textcache *tc_next;
+};
+
+/* All textcaches; there are only ever a few. Protected by vm_lock. */
+static struct textcache *textcaches;
+
+/* Statistics. */
+static unsigned tc_hits;		/* faults served from the cache */
+static unsigned tc_loads;		/* pages read and cached */
+static unsigned tc_reclaims;		/* idle pages given back */
+static unsigned tc_stale;		/* unused caches found out of date */
+
+/*
+ * Give back every frame TC remembers.
+ */
+static
+void
+textcache_flush(struct textcache *tc)
+{
+	unsigned i;
+
+	for (i = 0; i < tc->tc_npages; i++) {
+		if (tc->tc_frames[i] != 0) {
+			frame_decref(tc->tc_frames[i]);
+			tc->tc_frames[i] = 0;
+		}
+	}
+}
+
+int
+textcache_attach(struct vnode *v, vaddr_t base, vaddr_t top,
+		 struct textcache **ret)
+{
+	struct textcache *tc;
+	paddr_t *frames;
+	unsigned npages, writes;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+	KASSERT((base & PAGE_FRAME) == base);
+	KASSERT((top & PAGE_FRAME) == top);
+
+	npages = (top - base) / PAGE_SIZE;
+	writes = vnode_writes(v);
+
+	for (tc = textcaches; tc != NULL; tc = tc->tc_next) {
+		if (tc->tc_vnode != v) {
+			continue;
+		}
+		if (tc->tc_writes == writes &&
+		    tc->tc_base == base && tc->tc_npages == npages) {
+			tc->tc_users++;
+			*ret = tc;
+			return 0;
+		}
+		if (tc->tc_users > 0) {
+			/* Not the text we have; don't share. */
+			return EINVAL;
+		}
+
+		/*
+		 * Nobody is using it and the file or its layout has
+		 * changed since it was loaded; start it over for us.
+		 */
+		frames = kmalloc(npages * sizeof(paddr_t));
+		if (frames == NULL) {
+			return ENOMEM;
+		}
+		bzero(frames, npages * sizeof(paddr_t));
+		textcache_flush(tc);
+		kfree(tc->tc_frames);
+		tc->tc_frames = frames;
+		tc->tc_base = base;
+		tc->tc_npages = npages;
+		tc->tc_writes = writes;
+		tc->tc_users = 1;
+		tc_stale++;
+		*ret = tc;
+		return 0;
+	}
+
+	tc = kmalloc(sizeof(*tc));
+	if (tc == NULL) {
+		return ENOMEM;
+	}
+	tc->tc_frames = kmalloc(npages * sizeof(paddr_t));
+	if (tc->tc_frames == NULL) {
+		kfree(tc);
+		return ENOMEM;
+	}
+	bzero(tc->tc_frames, npages * sizeof(paddr_t));
+	/* Our own reference, so the vnode outlives its last user. */
+	VOP_INCREF(v);
+	tc->tc_vnode = v;
+	tc->tc_base = base;
+	tc->tc_npages = npages;
+	tc->tc_users = 1;
+	tc->tc_writes = writes;
+
+	tc->tc_next = textcaches;
+	textcaches = tc;
+
+	*ret = tc;
+	return 0;
+}
+
+void
+textcache_share(struct textcache *tc)
+{
+	KASSERT(lock_do_i_hold(vm_lock));
+	KASSERT(tc->tc_users > 0);
+
+	tc->tc_users++;
+}
+
+/*
+ * The last detach leaves the textcache and its frames in place, so
+ * the next run of the same program finds its text already loaded.
+ * textcache_reclaim takes them back when memory is short.
+ */
+void
+textcache_detach(struct textcache *tc)
+{
+	KASSERT(lock_do_i_hold(vm_lock));
+	KASSERT(tc->tc_users > 0);
+
+	tc->tc_users--;
+}
+
+bool
+textcache_covers(struct textcache *tc, vaddr_t vaddr)
+{
+	return vaddr >= tc->tc_base &&
+		vaddr < tc->tc_base + tc->tc_npages * PAGE_SIZE;
+}
+
+paddr_t
+textcache_lookup(struct textcache *tc, vaddr_t vaddr)
+{
+	paddr_t paddr;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+	KASSERT(textcache_covers(tc, vaddr));
+
+	paddr = tc->tc_frames[(vaddr - tc->tc_base) / PAGE_SIZE];
+	if (paddr != 0) {
+		frame_incref(paddr);
+		tc_hits++;
+	}
+	return paddr;
+}
+
+void
+textcache_insert(struct textcache *tc, vaddr_t vaddr, paddr_t paddr)
+{
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+	KASSERT(textcache_covers(tc, vaddr));
+
+	i = (vaddr - tc->tc_base) / PAGE_SIZE;
+	KASSERT(tc->tc_frames[i] == 0);
+	frame_incref(paddr);
+	tc->tc_frames[i] = paddr;
+	tc_loads++;
+}
+
+/*
+ * Whether TC remembers any frames.
+ */
+static
+bool
+textcache_empty(struct textcache *tc)
+{
+	unsigned i;
+
+	for (i = 0; i < tc->tc_npages; i++) {
+		if (tc->tc_frames[i] != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Give back one cached page nobody has mapped. These are clean, so
+ * this is much cheaper than paging something out.
+ */
+bool
+textcache_reclaim(void)
+{
+	struct textcache *tc;
+	paddr_t paddr;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	for (tc = textcaches; tc != NULL; tc = tc->tc_next) {
+		for (i = 0; i < tc->tc_npages; i++) {
+			paddr = tc->tc_frames[i];
+			if (paddr != 0 && frame_refcount(paddr) == 1) {
+				tc->tc_frames[i] = 0;
+				frame_decref(paddr);
+				tc_reclaims++;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/*
+ * Free the textcaches nobody is attached to that have no frames left
+ * or, if ALL, every textcache nobody is attached to. Dropping the
+ * vnode can go into the file system, which mustn't happen under
+ * vm_lock, so they are unlinked first and freed after.
+ */
+static
+void
+textcache_free_unused(bool all)
+{
+	struct textcache *tc, **p, *dead = NULL;
+
+	KASSERT(!lock_do_i_hold(vm_lock));
+
+	lock_acquire(vm_lock);
+	p = &textcaches;
+	while ((tc = *p) != NULL) {
+		if (tc->tc_users == 0 && (all || textcache_empty(tc))) {
+			*p = tc->tc_next;
+			textcache_flush(tc);
+			tc->tc_next = dead;
+			dead = tc;
+		}
+		else {
+			p = &tc->tc_next;
+		}
+	}
+	lock_release(vm_lock);
+
+	while (dead != NULL) {
+		tc = dead;
+		dead = tc->tc_next;
+		VOP_DECREF(tc->tc_vnode);
+		kfree(tc->tc_frames);
+		kfree(tc);
+	}
+}
+
+void
+textcache_reap(void)
+{
+	textcache_free_unused(false);
+}
+
+/*
+ * Called before unmounting: the references unused textcaches hold
+ * would otherwise keep the file system busy.
+ */
+void
+textcache_purge(void)
+{
+	textcache_free_unused(true);
+}
+
+void
+textcache_printstats(void)
+{
+	struct textcache *tc;
+	unsigned ncaches = 0, nunused = 0, npages = 0, i;
+
+	lock_acquire(vm_lock);
+	for (tc = textcaches; tc != NULL; tc = tc->tc_next) {
+		ncaches++;
+		if (tc->tc_users == 0) {
+			nunused++;
+		}
+		for (i = 0; i < tc->tc_npages; i++) {
+			if (tc->tc_frames[i] != 0) {
+				npages++;
+			}
+		}
+	}
+	lock_release(vm_lock);
+
+	kprintf("Shared text: %u pages in %u executables (%u not running), "
+		"%u hits, %u loads, %u reclaimed, %u found out of date\n",
+		npages, ncaches, nunused, tc_hits, tc_loads, tc_reclaims,
+		tc_stale);
+}
@@ -1,6 +1,8 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <uio.h>
+#include <vnode.h>
 #include <thread.h>
 #include <addrspace.h>
 #include <vm.h>
@@ -8,32 +10,1086 @@
 #include <current.h>
 #include <proc.h>
 #include <spl.h>
+#include <cpu.h>
+#include <synch.h>
+#include <objcache.h>
+#include <swap.h>
+#include <textcache.h>
+#include <pagecache.h>
+#include <clock.h>
+#include <platform/maxcpus.h>
 
 /* Place your page table functions here */
 
+/*
+ * Copy-on-write statistics. Updated without a lock, so they are only
+ * approximately right on a multiprocessor.
+ */
+static unsigned cow_copies;     /* shared frames copied on write */
+static unsigned cow_reuses;     /* last sharer just made writable */
+
+/*
+ * The shared zero page. First reads of anonymous memory map it
+ * read-only instead of getting a frame of their own; a write then
+ * takes a private (zeroed) copy through the copy-on-write path. It
+ * keeps a reference of its own, so it is never freed or paged out.
+ */
+static paddr_t zero_paddr;
+static unsigned zero_maps;      /* read faults that mapped it (vm_lock) */
+static unsigned zero_breaks;    /* ... later written (vm_lock) */
+
+/* Fault-around statistics (vm_lock). */
+static unsigned fa_pages;       /* pages mapped ahead of a fault */
+static unsigned fa_grows;       /* windows doubled */
+static unsigned fa_shrinks;     /* windows halved */
+
+/*
+ * TLB statistics, likewise approximate. The refill rate is measured
+ * between successive calls to vm_printstats.
+ */
+static struct cpu_tlb *cpu_tlbs[MAXCPUS];
+static unsigned asid_rollovers; /* generations started, all cpus */
+static unsigned stats_lastrefills;
+static struct timespec stats_lasttime;
+
+struct lock *vm_lock;
+
+/*
+ * Broadcast (with vm_lock) when pages in transit to or from swap
+ * land; see vm_evict_cluster.
+ */
+static struct cv *vm_transit_cv;
+
+/* Acknowledgements from other cpus for a page-out shootdown. */
+static struct semaphore *vm_shootdown_sem;
+
+/*
+ * The page-out daemon and its free frame watermarks. pageout_kicked
+ * is set while a wakeup is pending or being served, so allocations
+ * only V the semaphore once per pass; it is read and written without
+ * a lock, which at worst costs an extra pass.
+ */
+static struct thread *pageout_thread;
+static struct semaphore *pageout_sem;
+static volatile bool pageout_kicked;
+static unsigned pageout_low;
+static unsigned pageout_high;
+
+/* Page-out statistics (vm_lock). */
+static unsigned pageout_wakeups;   /* passes of the daemon */
+static unsigned evict_clean;       /* evictions that wrote nothing */
+static unsigned evict_dirty;       /* ... that wrote to swap */
+static unsigned evict_direct;      /* ... not made by the daemon */
+static unsigned swapin_faults;     /* faults that read swap from disk */
+static unsigned swapin_ahead;      /* ... neighbours read along with them */
+
 
 void vm_bootstrap(void)
 {
+    vaddr_t zero_kpage;
+
     /* Initialise VM sub-system.  You probably want to initialise your 
        frame table here as well.
     */
     frame_table_init();
+    pt_bootstrap();
+
+    zero_kpage = alloc_kpages(1);
+    if (zero_kpage == 0) {
+        panic("vm_bootstrap: no zero page\n");
+    }
+    bzero((void *)zero_kpage, PAGE_SIZE);
+    zero_paddr = KVADDR_TO_PADDR(zero_kpage);
+
+    vm_lock = lock_create("vm");
+    vm_transit_cv = cv_create("vm transit");
+    vm_shootdown_sem = sem_create("vm shootdown", 0);
+    if (vm_lock == NULL || vm_transit_cv == NULL || vm_shootdown_sem == NULL) {
+        panic("vm_bootstrap: out of memory\n");
+    }
 }
 
-int
-vm_fault(int faulttype, vaddr_t faultaddress)
+void
+vm_asid_init(struct cpu_asids *ca)
+{
+    ca->ca_generation = 1;
+    ca->ca_next = 1;
+    ca->ca_current = 0;
+}
+
+void
+vm_tlb_init(struct cpu_tlb *ct, unsigned cpunum)
+{
+    KASSERT(cpunum < MAXCPUS);
+
+    ct->ct_hand = 0;
+    ct->ct_misses = 0;
+    ct->ct_evictions = 0;
+    cpu_tlbs[cpunum] = ct;
+}
+
+/*
+ * Put this cpu's current ASID back in EntryHi after a TLB operation
+ * clobbered it.
+ */
+static
+void
+vm_asid_restore(void)
+{
+    tlb_setasid(curcpu->c_asids.ca_current << TLBHI_PIDSHIFT);
+}
+
+void
+vm_asid_activate(struct addrspace *as)
+{
+    struct cpu_asids *ca;
+    uint32_t ctx;
+    unsigned cpunum;
+    int i;
+
+    KASSERT(curthread->t_curspl > 0);
+
+    ca = &curcpu->c_asids;
+    cpunum = curcpu->c_number;
+    ctx = as->as_asid[cpunum];
+
+    if (ASID_GEN(ctx) != ca->ca_generation) {
+        if (ca->ca_next == NUM_ASID) {
+            /* Out of ASIDs: new generation, empty TLB. */
+            for (i = 0; i < NUM_TLB; i++) {
+                tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+            }
+            ca->ca_generation++;
+            ca->ca_next = 1;
+            asid_rollovers++;
+        }
+        ctx = (ca->ca_generation << ASID_BITS) | ca->ca_next++;
+        as->as_asid[cpunum] = ctx;
+    }
+
+    ca->ca_current = ASID_NUM(ctx);
+    vm_asid_restore();
+}
+
+/*
+ * ASIDs are never reused within a generation, so entries under the
+ * abandoned ones can never match again; they age out at the next
+ * rollover. The caller re-activates AS if it is current.
+ */
+void
+vm_asid_retire(struct addrspace *as)
+{
+    int spl;
+
+    spl = splhigh();
+    bzero(as->as_asid, sizeof(as->as_asid));
+    splx(spl);
+}
+
+/*
+ * AS is being destroyed. Its entries in this cpu's TLB (where it most
+ * likely ran last) are dropped in one sweep, so they don't crowd out
+ * live ones; if its ASID here was the last one handed out, it is
+ * handed back. Elsewhere its ASIDs are abandoned as in
+ * vm_asid_retire, so no page needs a shootdown as its frame is freed.
+ */
+void
+vm_asid_release(struct addrspace *as)
+{
+    struct cpu_asids *ca;
+    uint32_t ctx, ehi, elo;
+    unsigned asid;
+    int i, spl;
+
+    spl = splhigh();
+
+    ca = &curcpu->c_asids;
+    ctx = as->as_asid[curcpu->c_number];
+    if (ASID_GEN(ctx) == ca->ca_generation) {
+        asid = ASID_NUM(ctx);
+        for (i = 0; i < NUM_TLB; i++) {
+            tlb_read(&ehi, &elo, i);
+            if ((elo & TLBLO_VALID) &&
+                (ehi & TLBHI_PID) >> TLBHI_PIDSHIFT == asid) {
+                tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+            }
+        }
+        if (ca->ca_current == asid) {
+            ca->ca_current = 0;
+        }
+        if (asid == ca->ca_next - 1) {
+            ca->ca_next--;
+        }
+        vm_asid_restore();
+    }
+    bzero(as->as_asid, sizeof(as->as_asid));
+
+    splx(spl);
+}
+
+void
+vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr)
+{
+    uint32_t ctx;
+    int i;
+
+    KASSERT(curthread->t_curspl > 0);
+
+    ctx = as->as_asid[curcpu->c_number];
+    if (ASID_GEN(ctx) != curcpu->c_asids.ca_generation) {
+        /* AS has nothing in this cpu's TLB. */
+        return;
+    }
+
+    i = tlb_probe(vaddr | (ASID_NUM(ctx) << TLBHI_PIDSHIFT), 0);
+    if (i >= 0) {
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    }
+    vm_asid_restore();
+}
+
+/*
+ * Drop AS's mapping of VADDR from every cpu's TLB, and wait until it
+ * is gone: the page is about to be written out, and must not change
+ * after that. The pager waits for each shootdown before sending
+ * the next, so a cpu never has enough queued to overflow into a full
+ * flush (which would not acknowledge).
+ */
+static
+void
+vm_shootdown_page(struct addrspace *as, vaddr_t vaddr)
+{
+    struct tlbshootdown ts;
+    unsigned n;
+    int spl;
+
+    KASSERT(lock_do_i_hold(vm_lock));
+
+    spl = splhigh();
+    vm_tlb_invalidate(as, vaddr);
+    splx(spl);
+
+    ts.ts_as = as;
+    ts.ts_vaddr = vaddr;
+    ts.ts_done = vm_shootdown_sem;
+    n = ipi_tlbshootdown_broadcast(&ts);
+    while (n-- > 0) {
+        P(vm_shootdown_sem);
+    }
+}
+
+void
+vm_transit_wait(struct addrspace *as)
+{
+    KASSERT(lock_do_i_hold(vm_lock));
+
+    while (as->as_transit > 0) {
+        cv_wait(vm_transit_cv, vm_lock);
+    }
+}
+
+/*
+ * Write out the DIRTY page AS maps at VADDR (whose entry is PTE), and
+ * with it the pages just after it in the same region that are due
+ * for eviction too, to consecutive swap slots: one disk request
+ * instead of several, and a later fault on any of them can read its
+ * neighbours back the same way (see vm_swapin_cluster). Returns the
+ * number of pages evicted, 0 if none could be.
+ *
+ * The pages are unmapped and their entries marked PTE_BUSY first, and
+ * their frames disowned, so the write can go on with vm_lock dropped
+ * (if UNLOCK is set): a fault on one of them waits for it to land,
+ * the clock passes the frames by, and vm_transit_wait keeps AS's page
+ * table from being walked or torn down meanwhile. Nobody else changes
+ * a PTE_BUSY entry, so afterwards the entries are only checked (by
+ * assertion) before they are filled in.
+ */
+static
+unsigned
+vm_evict_cluster(struct addrspace *as, vaddr_t vaddr, page_table_entry *pte,
+                 bool unlock)
+{
+    page_table_entry *ptes[SWAP_CLUSTER];
+    page_table_entry oldptes[SWAP_CLUSTER];
+    vaddr_t kpages[SWAP_CLUSTER];
+    vaddr_t base, top, va;
+    paddr_t paddr;
+    unsigned first, n, i;
+    int result;
+
+    KASSERT(lock_do_i_hold(vm_lock));
+
+    ptes[0] = pte;
+    n = 1;
+    if (as_region_bounds(as, vaddr, &base, &top)) {
+        for (va = vaddr + PAGE_SIZE; va < top && n < SWAP_CLUSTER;
+             va += PAGE_SIZE) {
+            pte = pt_lookup(as, va, false);
+            if (pte == NULL || !(*pte & PTE_VALID) ||
+                !frame_evictable(PTE_PADDR(*pte), as, va)) {
+                break;
+            }
+            ptes[n++] = pte;
+        }
+    }
+
+    if (swap_alloc_cluster(n, &first, &n)) {
+        return 0;
+    }
+
+    for (i = 0; i < n; i++) {
+        oldptes[i] = *ptes[i];
+        paddr = PTE_PADDR(oldptes[i]);
+        kpages[i] = PADDR_TO_KVADDR(paddr);
+        *ptes[i] = PTE_MKSWAP(first + i) | PTE_BUSY;
+        vm_shootdown_page(as, vaddr + i * PAGE_SIZE);
+        frame_disown(paddr, as);
+    }
+    as->as_transit += n;
+
+    if (unlock) {
+        lock_release(vm_lock);
+    }
+    result = swap_out_cluster(first, kpages, n);
+    if (unlock) {
+        lock_acquire(vm_lock);
+    }
+
+    KASSERT(as->as_transit >= n);
+    as->as_transit -= n;
+    for (i = 0; i < n; i++) {
+        KASSERT(*ptes[i] == (PTE_MKSWAP(first + i) | PTE_BUSY));
+        paddr = PTE_PADDR(oldptes[i]);
+        if (result) {
+            /* The frame is owned again at its next TLB load. */
+            *ptes[i] = oldptes[i];
+            swap_decref(first + i);
+        }
+        else {
+            *ptes[i] = PTE_MKSWAP(first + i);
+            frame_decref(paddr);
+        }
+    }
+    cv_broadcast(vm_transit_cv, vm_lock);
+
+    if (result) {
+        kprintf("vm: pageout of 0x%x failed: %s\n",
+                vaddr, strerror(result));
+        return 0;
+    }
+    return n;
+}
+
+/*
+ * Free frames, cheapest first: an idle shared text or file page, then
+ * a CLEAN page, which is already in swap, and only then pages that
+ * have to be written to swap, a cluster at a time. Victims are picked
+ * with the clock. The owner's page table entry is marked in transit
+ * (and the TLBs shot down) before the copy starts; the owner faulting
+ * on it meanwhile waits for it, and then finds it in swap.
+ *
+ * May be called with vm_lock already held, from an allocation inside
+ * vm_fault or while a page table is being copied; the caller is then
+ * in the middle of changing page tables, so the write is done with
+ * vm_lock held. Otherwise (the daemon, and allocations elsewhere in
+ * the kernel) vm_lock is taken here and dropped for the write, so
+ * faults by other processes go on meanwhile.
+ *
+ * An allocation made by the pager itself (in the disk driver or the
+ * compressed pool) fails instead of recursing.
+ */
+bool
+vm_evict_page(void)
 {
     struct addrspace *as;
-    int pt1, pt2;
+    page_table_entry *pte;
+    paddr_t paddr;
+    vaddr_t vaddr;
+    unsigned slot, n;
+    bool held, evicted = false;
+
+    if (vm_lock == NULL || curthread->t_vm_evicting) {
+        return false;
+    }
+    curthread->t_vm_evicting = true;
+
+    held = lock_do_i_hold(vm_lock);
+    if (!held) {
+        lock_acquire(vm_lock);
+    }
+
+    /*
+     * Spare kernel heap pages, and idle shared text and file pages
+     * (which are clean), can go with no I/O.
+     */
+    if (kheap_reclaim() || textcache_reclaim() || pagecache_reclaim()) {
+        evicted = true;
+        goto done;
+    }
+
+    while (frame_clock_victim(&paddr, &as, &vaddr, true) ||
+           frame_clock_victim(&paddr, &as, &vaddr, false)) {
+        pte = pt_lookup(as, vaddr, false);
+        if (pte == NULL || !(*pte & PTE_VALID) || PTE_PADDR(*pte) != paddr) {
+            /* Owner no longer maps it here; never pick it again. */
+            frame_disown(paddr, as);
+            continue;
+        }
+
+        /* A clean page is read-only, so nobody can dirty it meanwhile. */
+        if (frame_take_slot(paddr, &slot)) {
+            *pte = 0;
+            vm_shootdown_page(as, vaddr);
+            *pte = PTE_MKSWAP(slot);
+            frame_disown(paddr, as);
+            frame_decref(paddr);
+            n = 1;
+            evict_clean++;
+        }
+        else {
+            n = vm_evict_cluster(as, vaddr, pte, !held);
+            if (n == 0) {
+                break;
+            }
+            evict_dirty += n;
+        }
+        if (curthread != pageout_thread) {
+            evict_direct += n;
+        }
+        evicted = true;
+        break;
+    }
+
+ done:
+    if (!held) {
+        lock_release(vm_lock);
+    }
+    curthread->t_vm_evicting = false;
+    return evicted;
+}
+
+/*
+ * Watermarks scale with memory: the low one is 1/32 of the frames
+ * user pages can have, within [PAGEOUT_MIN, PAGEOUT_MAX], and the
+ * daemon frees twice that before going back to sleep.
+ */
+#define PAGEOUT_MIN 8
+#define PAGEOUT_MAX 256
+
+static
+void
+vm_pageout_daemon(void *data1, unsigned long data2)
+{
+    bool progress;
+
+    (void)data1;
+    (void)data2;
+
+    pageout_thread = curthread;
+
+    while (true) {
+        P(pageout_sem);
+        pageout_wakeups++;
+
+        progress = false;
+        while (frame_table_nfree() < pageout_high && vm_evict_page()) {
+            progress = true;
+        }
+
+        /*
+         * If there was nothing to evict (everything shared, or
+         * swap full), every allocation would wake us again for
+         * another futile sweep of the frame table; back off.
+         */
+        if (!progress) {
+            clocksleep(1);
+        }
+        pageout_kicked = false;
+    }
+}
+
+void
+vm_pageout_bootstrap(void)
+{
+    struct frame_stats fs;
+    int result;
+
+    frame_table_getstats(&fs);
+    pageout_low = (fs.fs_free + fs.fs_used + fs.fs_cached + fs.fs_zeroed) / 32;
+    if (pageout_low < PAGEOUT_MIN) {
+        pageout_low = PAGEOUT_MIN;
+    }
+    if (pageout_low > PAGEOUT_MAX) {
+        pageout_low = PAGEOUT_MAX;
+    }
+    pageout_high = 2 * pageout_low;
+
+    pageout_sem = sem_create("pageout", 0);
+    if (pageout_sem == NULL) {
+        panic("vm_pageout_bootstrap: out of memory\n");
+    }
+    result = thread_fork("pageout", NULL, vm_pageout_daemon, NULL, 0);
+    if (result) {
+        panic("vm_pageout_bootstrap: thread_fork: %s\n", strerror(result));
+    }
+}
+
+void
+vm_pageout_kick(void)
+{
+    if (pageout_sem == NULL || pageout_kicked ||
+        frame_table_nfree() >= pageout_low) {
+        return;
+    }
+    pageout_kicked = true;
+    V(pageout_sem);
+}
+
+void
+vm_drain(void)
+{
+    textcache_purge();
+
+    lock_acquire(vm_lock);
+    while (textcache_reclaim() || pagecache_reclaim()) {
+        /* nothing */
+    }
+    lock_release(vm_lock);
+
+    /* Last, since freeing the rest may have emptied heap pages. */
+    objcache_reclaim();
+    kheap_drain();
+}
+
+/*
+ * Bring in a page of the mapped file M from the file's pagecache,
+ * reading it first if no mapping of the file has touched it yet. The
+ * page is mapped read-only whatever M's protection: a write to it
+ * either marks it dirty or takes a private copy (see vm_fault).
+ *
+ * The file is read without vm_lock, as in vm_pagein. Past the end of
+ * file the read comes up short, leaving the rest of the page zero.
+ */
+static
+int
+vm_pagein_file(struct as_mmap *m, vaddr_t vaddr, page_table_entry *pte)
+{
+    struct iovec iov;
+    struct uio ku;
+    vaddr_t kpage;
+    paddr_t paddr;
+    unsigned index;
+    off_t off;
+    int result;
+
+    KASSERT(lock_do_i_hold(vm_lock));
+
+    off = m->mm_offset + (vaddr - m->mm_base);
+    index = off / PAGE_SIZE;
+
+    paddr = pagecache_lookup(m->mm_cache, index);
+    if (paddr != 0) {
+        *pte = paddr | PTE_VALID;
+        return 0;
+    }
+
+    lock_release(vm_lock);
+
+    kpage = alloc_zeroed_kpage();
+    if (kpage == 0) {
+        DEBUG(DB_VM, "vm: no frame for 0x%x (%u free)\n",
+              vaddr, frame_table_nfree());
+        lock_acquire(vm_lock);
+        return ENOMEM;
+    }
+    uio_kinit(&iov, &ku, (void *)kpage, PAGE_SIZE, off, UIO_READ);
+    result = VOP_READ(m->mm_vnode, &ku);
+
+    lock_acquire(vm_lock);
+
+    if (result) {
+        free_kpages(kpage);
+        return result;
+    }
+    if (*pte & PTE_VALID) {
+        /* Someone else brought it in first. */
+        free_kpages(kpage);
+        return 0;
+    }
+
+    paddr = pagecache_lookup(m->mm_cache, index);
+    if (paddr != 0) {
+        /* Another process read it meanwhile. */
+        free_kpages(kpage);
+        *pte = paddr | PTE_VALID;
+        return 0;
+    }
+    pagecache_insert(m->mm_cache, index, KVADDR_TO_PADDR(kpage));
+    *pte = KVADDR_TO_PADDR(kpage) | PTE_VALID;
+    return 0;
+}
+
+/*
+ * The swapped-out page AS has at VA, if it is on disk in SLOT.
+ */
+static
+page_table_entry *
+vm_swap_neighbour(struct addrspace *as, vaddr_t va, unsigned slot)
+{
+    page_table_entry *pte;
+
+    pte = pt_lookup(as, va, false);
+    if (pte == NULL || (*pte & (PTE_SWAPPED | PTE_BUSY)) != PTE_SWAPPED ||
+        PTE_SLOT(*pte) != slot || swap_incore(slot)) {
+        return NULL;
+    }
+    return pte;
+}
+
+/*
+ * Read the page AS has swapped out at VADDR (whose entry is PTE), in
+ * SLOT, into KPAGE, and with it the neighbouring pages of the same
+ * region that sit in the neighbouring slots, as vm_evict_cluster
+ * leaves them: one disk request brings in the lot. The neighbours are
+ * mapped read-only and CLEAN, so if they turn out not to be wanted,
+ * evicting them again costs no I/O. Neighbours are only read while
+ * memory is plentiful.
+ *
+ * As in vm_evict_cluster, the entries are marked PTE_BUSY and the
+ * read is done without vm_lock. PTE is left swapped out for the
+ * caller to fill in.
+ */
+static
+int
+vm_swapin_cluster(struct addrspace *as, vaddr_t vaddr, page_table_entry *pte,
+                  vaddr_t kpage)
+{
+    page_table_entry *ptes[SWAP_CLUSTER];
+    vaddr_t kpages[SWAP_CLUSTER];
+    vaddr_t base, top, lo, hi;
+    paddr_t paddr;
+    unsigned slot, first, n, i, self;
+    int result;
+
+    KASSERT(lock_do_i_hold(vm_lock));
+    KASSERT((*pte & (PTE_SWAPPED | PTE_BUSY)) == PTE_SWAPPED);
+
+    slot = PTE_SLOT(*pte);
+    lo = hi = vaddr;
+    n = 1;
+    if (!swap_incore(slot)) {
+        swapin_faults++;
+        if (frame_table_nfree() >= pageout_high + SWAP_CLUSTER &&
+            as_region_bounds(as, vaddr, &base, &top)) {
+            /* The slots run up with the addresses; see how far, both ways. */
+            while (n < SWAP_CLUSTER && hi + PAGE_SIZE < top &&
+                   vm_swap_neighbour(as, hi + PAGE_SIZE, slot +
+                                     (hi + PAGE_SIZE - vaddr) / PAGE_SIZE)) {
+                hi += PAGE_SIZE;
+                n++;
+            }
+            while (n < SWAP_CLUSTER && lo > base &&
+                   (vaddr - lo) / PAGE_SIZE < slot &&
+                   vm_swap_neighbour(as, lo - PAGE_SIZE,
+                                     slot - (vaddr - lo) / PAGE_SIZE - 1)) {
+                lo -= PAGE_SIZE;
+                n++;
+            }
+        }
+    }
+
+    self = (vaddr - lo) / PAGE_SIZE;
+    first = slot - self;
+    for (i = 0; i < n; i++) {
+        if (i == self) {
+            ptes[i] = pte;
+            kpages[i] = kpage;
+            continue;
+        }
+        ptes[i] = vm_swap_neighbour(as, lo + i * PAGE_SIZE, first + i);
+        KASSERT(ptes[i] != NULL);
+        kpages[i] = alloc_kpages(1);
+        if (kpages[i] == 0) {
+            /* Memory got short after all; read just the one. */
+            while (i-- > 0) {
+                if (i != self) {
+                    free_kpages(kpages[i]);
+                }
+            }
+            ptes[0] = pte;
+            kpages[0] = kpage;
+            first = slot;
+            self = 0;
+            lo = vaddr;
+            n = 1;
+            break;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        *ptes[i] |= PTE_BUSY;
+    }
+    as->as_transit += n;
+
+    lock_release(vm_lock);
+    result = swap_in_cluster(first, kpages, n);
+    lock_acquire(vm_lock);
+
+    KASSERT(as->as_transit >= n);
+    as->as_transit -= n;
+    for (i = 0; i < n; i++) {
+        KASSERT(*ptes[i] == (PTE_MKSWAP(first + i) | PTE_BUSY));
+        *ptes[i] &= ~PTE_BUSY;
+    }
+    cv_broadcast(vm_transit_cv, vm_lock);
+
+    for (i = 0; i < n; i++) {
+        if (i == self) {
+            continue;
+        }
+        if (result) {
+            free_kpages(kpages[i]);
+            continue;
+        }
+        /* The page table entry's slot reference passes to the frame. */
+        paddr = KVADDR_TO_PADDR(kpages[i]);
+        frame_set_clean(paddr, first + i);
+        *ptes[i] = paddr | PTE_VALID;
+        frame_set_owner(paddr, as, lo + i * PAGE_SIZE);
+        swapin_ahead++;
+    }
+    return result;
+}
+
+/*
+ * Bring in a page that is not resident: from swap if it was paged
+ * out (leaving it CLEAN if it is only being read), from the file's
+ * pagecache if it is in a mapped file, from the shared text cache if
+ * it is text some other process has loaded, from the zero page if it
+ * is anonymous memory being read, otherwise a zero-filled frame with
+ * whatever part of the executable backs the page read in on top.
+ *
+ * Reading the executable can sleep on file system locks whose holders
+ * may be faulting themselves, so vm_lock is dropped meanwhile; the
+ * frame belongs to nobody until it is entered in the page table. It
+ * is dropped for reading swap too, see vm_swapin_cluster.
+ */
+static
+int
+vm_pagein(struct addrspace *as, vaddr_t vaddr, page_table_entry *pte,
+          bool write)
+{
+    struct as_mmap *m;
+    page_table_entry wbit;
+    vaddr_t kpage;
+    paddr_t paddr;
+    unsigned slot;
+    bool shared;
+    int result;
+
+    KASSERT(lock_do_i_hold(vm_lock));
+
+    /* Read-only pages never get PTE_WRITE, and so never TLBLO_DIRTY. */
+    wbit = (as_perm(as, vaddr) & AS_PERM_WRITE) ? PTE_WRITE : 0;
+
+    if (*pte & PTE_SWAPPED) {
+        slot = PTE_SLOT(*pte);
+        kpage = alloc_kpages(1);
+        if (kpage == 0) {
+            DEBUG(DB_VM, "vm: no frame for 0x%x (%u free)\n",
+                  vaddr, frame_table_nfree());
+            return ENOMEM;
+        }
+        result = vm_swapin_cluster(as, vaddr, pte, kpage);
+        if (result) {
+            free_kpages(kpage);
+            return result;
+        }
+        if (write || swap_incore(slot)) {
+            /*
+             * A compressed copy would only take up memory, when
+             * paging out again is cheap anyway.
+             */
+            swap_decref(slot);
+            *pte = KVADDR_TO_PADDR(kpage) | PTE_VALID | wbit;
+        }
+        else {
+            /* Keep the disk copy until the page is written. */
+            frame_set_clean(KVADDR_TO_PADDR(kpage), slot);
+            *pte = KVADDR_TO_PADDR(kpage) | PTE_VALID;
+        }
+        return 0;
+    }
+
+    m = as_mmap_lookup(as, vaddr);
+    if (m != NULL) {
+        return vm_pagein_file(m, vaddr, pte);
+    }
+
+    /* Text another run of the program already loaded? */
+    shared = as_shares_text(as, vaddr);
+    if (shared) {
+        paddr = textcache_lookup(as->as_text, vaddr);
+        if (paddr != 0) {
+            *pte = paddr | PTE_VALID;
+            return 0;
+        }
+    }
+
+    if (!shared && !write && as_page_is_anon(as, vaddr)) {
+        frame_incref(zero_paddr);
+        *pte = zero_paddr | PTE_VALID;
+        zero_maps++;
+        return 0;
+    }
+
+    lock_release(vm_lock);
+
+    kpage = alloc_zeroed_kpage();
+    if (kpage == 0) {
+        DEBUG(DB_VM, "vm: no frame for 0x%x (%u free)\n",
+              vaddr, frame_table_nfree());
+        lock_acquire(vm_lock);
+        return ENOMEM;
+    }
+    result = as_fill_page(as, vaddr, kpage);
+
+    lock_acquire(vm_lock);
+
+    if (result) {
+        free_kpages(kpage);
+        return result;
+    }
+    if (*pte & (PTE_VALID | PTE_SWAPPED)) {
+        /* Someone else brought it in first. */
+        free_kpages(kpage);
+        return 0;
+    }
+
+    if (shared) {
+        paddr = textcache_lookup(as->as_text, vaddr);
+        if (paddr != 0) {
+            /* Another process loaded it meanwhile. */
+            free_kpages(kpage);
+            *pte = paddr | PTE_VALID;
+            return 0;
+        }
+        /*
+         * Read-only from the start: the cache's reference makes
+         * the frame shared, so a write takes a private copy.
+         */
+        textcache_insert(as->as_text, vaddr, KVADDR_TO_PADDR(kpage));
+        *pte = KVADDR_TO_PADDR(kpage) | PTE_VALID;
+        return 0;
+    }
+
+    *pte = KVADDR_TO_PADDR(kpage) | PTE_VALID | wbit;
+    return 0;
+}
+
+/*
+ * Resolve a write to a page that is shared copy-on-write, or CLEAN.
+ * If nobody else refers to the frame any more it is simply made
+ * writable; otherwise the page gets a private copy.
+ */
+static
+int
+vm_cow_break(struct addrspace *as, page_table_entry *pte)
+{
+    paddr_t oldaddr;
+    vaddr_t newpage;
+    unsigned slot;
+
+    KASSERT(*pte & PTE_VALID);
+    oldaddr = PTE_PADDR(*pte);
+
+    if (frame_refcount(oldaddr) == 1) {
+        /* About to differ from its swap copy, if it has one. */
+        if (frame_take_slot(oldaddr, &slot)) {
+            swap_decref(slot);
+        }
+        *pte |= PTE_WRITE;
+        cow_reuses++;
+        return 0;
+    }
+
+    if (oldaddr == zero_paddr) {
+        newpage = alloc_zeroed_kpage();
+        zero_breaks++;
+    }
+    else {
+        newpage = alloc_kpages(1);
+        if (newpage != 0) {
+            memcpy((void *)newpage, (void *)PADDR_TO_KVADDR(oldaddr),
+                   PAGE_SIZE);
+        }
+        cow_copies++;
+    }
+    if (newpage == 0) {
+        return ENOMEM;
+    }
+    *pte = KVADDR_TO_PADDR(newpage) | PTE_VALID | PTE_WRITE;
+    frame_disown(oldaddr, as);
+    frame_decref(oldaddr);
+
+    return 0;
+}
+
+/*
+ * Load the TLB entry for resident page VADDR of the current address
+ * space. MISS is false when mapping ahead rather than for a fault.
+ */
+static
+void
+vm_tlb_load(struct addrspace *as, vaddr_t vaddr, page_table_entry pte,
+            bool miss)
+{
+    struct cpu_tlb *ct;
     uint32_t ehi, elo;
+    uint32_t oldhi, oldlo;
     paddr_t addr;
     int spl;
+    int index;
+
+    KASSERT(lock_do_i_hold(vm_lock));
+    KASSERT(pte & PTE_VALID);
+
+    addr = PTE_PADDR(pte);
 
-    // panic("vm_fault hasn't been written yet\n");
+    KASSERT((addr & PAGE_FRAME) == addr);
+
+    /*
+     * A frame only we map is pageable; (re)claiming it here also
+     * tells the clock the page is in use.
+     */
+    if (frame_refcount(addr) == 1) {
+        frame_set_owner(addr, as, vaddr);
+    }
+
+    elo = addr | TLBLO_VALID;
+    if (pte & PTE_WRITE) {
+        elo |= TLBLO_DIRTY;
+    }
+
+    spl = splhigh();
+
+    /* We may have slept and moved; the ASID and slots are this cpu's. */
+    ct = &curcpu->c_tlb;
+    ehi = vaddr | (curcpu->c_asids.ca_current << TLBHI_PIDSHIFT);
+    if (miss) {
+        ct->ct_misses++;
+    }
+
+    /* Replace a stale (e.g. read-only) entry for this page if present. */
+    index = tlb_probe(ehi, 0);
+    if (index < 0) {
+        index = ct->ct_hand;
+        ct->ct_hand = (ct->ct_hand + 1) % NUM_TLB;
+
+        tlb_read(&oldhi, &oldlo, index);
+        if (oldlo & TLBLO_VALID) {
+            ct->ct_evictions++;
+        }
+    }
+
+    DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", vaddr, addr);
+    tlb_write(ehi, elo, index);
+
+    splx(spl);
+}
+
+/*
+ * Fault-around: when faults walk through a region a page at a time,
+ * map the next few pages of the walk as well, so the stream takes one
+ * trap per window instead of one per page.
+ *
+ * The window adapts. A fault landing just past the pages mapped ahead
+ * means they were all used, so the window doubles; a fault anywhere
+ * else halves it. A fresh stream starts at FAULTAROUND_MIN once two
+ * consecutive faults hit adjacent pages.
+ *
+ * Pages mapped ahead of a write fault get frames of their own rather
+ * than the zero page, since the stream is presumably going to write
+ * them too. Pages in swap are left for their own fault. When memory
+ * is short only pages already resident are mapped, so mapping ahead
+ * never pushes anything out.
+ */
+#define FAULTAROUND_MIN 2
+#define FAULTAROUND_MAX 16
+
+static
+void
+vm_faultaround(struct addrspace *as, vaddr_t faultaddress, bool write)
+{
+    page_table_entry *pte;
+    vaddr_t base, top, va, next;
+    bool alloc;
+    unsigned n;
+
+    KASSERT(lock_do_i_hold(vm_lock));
+
+    if (as->as_fa_window > 0 && faultaddress == as->as_fa_next) {
+        as->as_fa_window *= 2;
+        if (as->as_fa_window > FAULTAROUND_MAX) {
+            as->as_fa_window = FAULTAROUND_MAX;
+        }
+        fa_grows++;
+    }
+    else if (faultaddress == as->as_fa_last + PAGE_SIZE ||
+             faultaddress == as->as_fa_last - PAGE_SIZE) {
+        as->as_fa_dir = faultaddress > as->as_fa_last ? 1 : -1;
+        if (as->as_fa_window < FAULTAROUND_MIN) {
+            as->as_fa_window = FAULTAROUND_MIN;
+        }
+    }
+    else if (as->as_fa_window > 0) {
+        as->as_fa_window /= 2;
+        fa_shrinks++;
+    }
+    as->as_fa_last = faultaddress;
+
+    if (as->as_fa_window == 0 ||
+        !as_region_bounds(as, faultaddress, &base, &top)) {
+        as->as_fa_next = 0;
+        return;
+    }
+
+    alloc = frame_table_nfree() >= 2 * FAULTAROUND_MAX;
+    va = faultaddress;
+    for (n = 0; n < as->as_fa_window; n++) {
+        next = as->as_fa_dir > 0 ? va + PAGE_SIZE : va - PAGE_SIZE;
+        if (next < base || next >= top) {
+            break;
+        }
+
+        pte = pt_lookup(as, next, alloc);
+        if (pte == NULL || (*pte & PTE_SWAPPED)) {
+            break;
+        }
+        if (!(*pte & PTE_VALID)) {
+            if (!alloc || vm_pagein(as, next, pte, write)) {
+                break;
+            }
+        }
+        vm_tlb_load(as, next, *pte, false);
+        fa_pages++;
+        va = next;
+    }
+    as->as_fa_next = as->as_fa_dir > 0 ? va + PAGE_SIZE : va - PAGE_SIZE;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+    struct addrspace *as;
+    struct as_mmap *m;
+    page_table_entry *pte;
+    unsigned perm;
+    bool write;
+    int result;
 
     switch (faulttype) {
         case VM_FAULT_READONLY:
-            panic("dumbvm: got VM_FAULT_READONLY\n");
         case VM_FAULT_READ:
         case VM_FAULT_WRITE:
             break;
@@ -63,63 +1119,160 @@ vm_fault(int faulttype, vaddr_t faultaddress)
         return EFAULT;
     }
 
-    /* Assert that the address space has been set up properly. */
-    KASSERT(as->as_vbase1 != 0);
-    KASSERT(as->as_npages1 != 0);
-    KASSERT(as->as_vbase2 != 0);
-    KASSERT(as->as_npages2 != 0);
-    KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
+    faultaddress &= PAGE_FRAME;
+    write = faulttype != VM_FAULT_READ;
 
-    pt1 = PT1_INDEX(faultaddress);
-    pt2 = PT2_INDEX(faultaddress);
+    /*
+     * Read-only pages are never loaded dirty, so a write to one
+     * comes here as a READONLY fault and is refused.
+     */
+    perm = as_perm(as, faultaddress);
+    if (perm == 0 || (write && !(perm & AS_PERM_WRITE))) {
+        return EFAULT;
+    }
+    m = as_mmap_lookup(as, faultaddress);
 
-    if (as->page_table[pt1] == NULL){
-        as->page_table[pt1] = kmalloc(sizeof(page_table_entry) * PAGE_TABLE_SIZE);
+    /* Above everything else but below the stack's pages: it grows. */
+    if (faultaddress >= as_stack_floor(as) &&
+        faultaddress < as->as_stackbase) {
+        as->as_stackbase = faultaddress;
     }
 
-    if (as->page_table[pt1][pt2] == 0) {
-        getppages(as, faultaddress, 1);
-        return 0;
+    lock_acquire(vm_lock);
+
+    pte = pt_lookup(as, faultaddress, true);
+    if (pte == NULL) {
+        lock_release(vm_lock);
+        return ENOMEM;
     }
 
-    addr = as->page_table[pt1][pt2] - MIPS_KSEG0;
+    /* On its way to or from swap: wait for it to land. */
+    while (*pte & PTE_BUSY) {
+        cv_wait(vm_transit_cv, vm_lock);
+    }
 
-    KASSERT((addr & PAGE_FRAME) == addr);
+    if (!(*pte & PTE_VALID)) {
+        result = vm_pagein(as, faultaddress, pte, write);
+        if (result) {
+            lock_release(vm_lock);
+            return result;
+        }
+    }
 
-    spl = splhigh();
+    /*
+     * A write to a page without PTE_WRITE is a write to a shared
+     * copy-on-write page or a CLEAN one, or the first write to a
+     * page of a shared mapping since it was read in. In the latter
+     * case the page just becomes writable and dirty. Otherwise break
+     * the sharing now rather than loading a read-only entry and
+     * taking a second (READONLY) fault.
+     */
+    if (write && !(*pte & PTE_WRITE) && m != NULL && m->mm_shared) {
+        pagecache_dirty(m->mm_cache,
+                        (m->mm_offset + (faultaddress - m->mm_base)) /
+                        PAGE_SIZE);
+        *pte |= PTE_WRITE;
+    }
+    else if (write && !(*pte & PTE_WRITE)) {
+        result = vm_cow_break(as, pte);
+        if (result) {
+            lock_release(vm_lock);
+            return result;
+        }
+    }
 
-    // ehi = faultaddress;
-    // elo = addr | TLBLO_DIRTY | TLBLO_VALID;
-    // tlb_random(ehi, elo);
+    vm_tlb_load(as, faultaddress, *pte, true);
+    vm_faultaround(as, faultaddress, write);
+
+    lock_release(vm_lock);
+
+    return 0;
+}
+
+static
+void
+vm_tlb_printstats(void)
+{
+    struct cpu_tlb *ct;
 
-    for (int i=0; i<NUM_TLB; i++) {
-        tlb_read(&ehi, &elo, i);
-        if (elo & TLBLO_VALID) {
+    for (unsigned i = 0; i < MAXCPUS; i++) {
+        ct = cpu_tlbs[i];
+        if (ct == NULL) {
             continue;
         }
-        ehi = faultaddress & PAGE_FRAME;
-        elo = addr | TLBLO_DIRTY | TLBLO_VALID;
-        DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, addr);
-        tlb_write(ehi, elo, i);
-        splx(spl);
-        return 0;
+        kprintf("cpu%u TLB: %u misses, %u evictions (%u%%)\n",
+                i, ct->ct_misses, ct->ct_evictions,
+                ct->ct_misses ? ct->ct_evictions * 100 / ct->ct_misses : 0);
     }
+}
 
-    splx(spl);
+/*
+ * Print VM statistics for the kernel menu.
+ */
+void
+vm_printstats(void)
+{
+    struct frame_stats fs;
+    struct timespec now, diff;
+    unsigned refills;
+    uint64_t ms;
 
-    return 0;
+    frame_table_getstats(&fs);
+    kprintf("Frames: %u free, %u used, %u fixed, %u cached, %u zeroed "
+            "(%u total)\n",
+            fs.fs_free, fs.fs_used, fs.fs_fixed, fs.fs_cached, fs.fs_zeroed,
+            fs.fs_free + fs.fs_used + fs.fs_fixed + fs.fs_cached +
+            fs.fs_zeroed);
+    frame_cache_printstats();
+    frame_zeropool_printstats();
+    vm_tlb_printstats();
+    kprintf("Copy-on-write: %u pages copied, %u made writable in place\n",
+            cow_copies, cow_reuses);
+    kprintf("Fault-around: %u pages mapped ahead, windows grown %u, "
+            "shrunk %u\n", fa_pages, fa_grows, fa_shrinks);
+    kprintf("Zero page: %u read faults mapped it, %u later written\n",
+            zero_maps, zero_breaks);
+    pt_printstats();
+    textcache_printstats();
+    pagecache_printstats();
+    swap_printstats();
+    kprintf("Pageout: watermarks %u/%u, %u wakeups; evicted %u clean, "
+            "%u written, %u of them by faulting threads\n",
+            pageout_low, pageout_high, pageout_wakeups,
+            evict_clean, evict_dirty, evict_direct);
+    kprintf("Swap-in: %u faults read from disk, %u more pages read "
+            "ahead with them\n", swapin_faults, swapin_ahead);
+
+    gettime(&now);
+    timespec_sub(&now, &stats_lasttime, &diff);
+    refills = 0;
+    for (unsigned i = 0; i < MAXCPUS; i++) {
+        if (cpu_tlbs[i] != NULL) {
+            refills += cpu_tlbs[i]->ct_misses;
+        }
+    }
+    ms = diff.tv_sec * 1000 + diff.tv_nsec / 1000000;
+    kprintf("TLB: %u refills, %u in the last %llu.%03llu s (%llu/s), "
+            "%u ASID rollovers\n",
+            refills, refills - stats_lastrefills,
+            ms / 1000, ms % 1000,
+            ms ? (refills - stats_lastrefills) * 1000ULL / ms : 0ULL,
+            asid_rollovers);
+    stats_lasttime = now;
+    stats_lastrefills = refills;
 }
 
 /*
  *
- * SMP-specific functions.  Unused in our configuration.
+ * SMP-specific functions.
  */
 
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("vm tried to do tlb shootdown?!\n");
+    /* Called from the IPI handler, with interrupts off. */
+    vm_tlb_invalidate(ts->ts_as, ts->ts_vaddr);
+    V(ts->ts_done);
 }
 
 void
@@ -127,6 +1280,7 @@ vm_tlbshootdown_all(void)
 {
     // panic("vm tried to do tlb shootdown?!\n");
     for(int i = 0; i < NUM_TLB; i++){
-        tlb_write(TLBHI_INVALID(0),TLBLO_INVALID(), i);
+        tlb_write(TLBHI_INVALID(i),TLBLO_INVALID(), i);
     }
+    vm_asid_restore();
 }
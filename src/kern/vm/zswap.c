@@ -0,0 +1,392 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <vm.h>
+#include <zswap.h>
+
+/* A compressed page. */
+struct zpage {
+	uint16_t zp_len;
+	unsigned char zp_data[];
+};
+
+/*
+ * The pool may hold up to 1/ZSWAP_POOL_DIV of memory's worth of
+ * kmalloc blocks. A page must shrink to fit a subpage block: a bigger
+ * one would take a whole page from kmalloc, saving nothing, and goes
+ * to disk instead.
+ */
+#define ZSWAP_POOL_DIV 4
+#define ZSWAP_MAXLEN (KMALLOC_LARGEST_SUBPAGE - 1 - sizeof(struct zpage))
+
+/*
+ * The compressor is LZ77 in the style of LZ4: the page is encoded as
+ * a series of sequences, each a run of literal bytes followed by a
+ * match (offset, length) against the bytes already encoded. Matches
+ * are found through a hash table of the last position each 4-byte
+ * string was seen at, so compressing is a single pass. A sequence is
+ *
+ *	token		literal length (high nibble) and match
+ *			length - LZ_MINMATCH (low nibble); 15 means
+ *			more bytes follow, each adding up to 255
+ *	[length bytes]	for the literal length
+ *	literals
+ *	offset		2 bytes, little-endian
+ *	[length bytes]	for the match length
+ *
+ * and the last sequence stops after its literals.
+ */
+#define LZ_MINMATCH   4
+#define LZ_HASH_BITS  12
+
+/* The pool, indexed by slot. Protected by zswap_lock. */
+static struct spinlock zswap_lock = SPINLOCK_INITIALIZER;
+static struct zpage **zswap_pages;
+static unsigned zswap_nslots;
+static unsigned zswap_npages;
+static size_t zswap_bytes;		/* in kmalloc blocks, as allocated */
+static size_t zswap_limit;
+
+/*
+ * Compression workspace; protected by lz_lock. Pages are written out
+ * without vm_lock, so more than one may be compressed at once.
+ */
+static struct lock *lz_lock;
+static unsigned char lz_buf[ZSWAP_MAXLEN];
+static uint16_t lz_table[1 << LZ_HASH_BITS];
+
+/*
+ * Statistics; zswap_loads is protected by zswap_lock, the rest by
+ * lz_lock. zswap_ratios counts stored pages by compressed size, in
+ * quarters of a page (only the first two can happen).
+ */
+static unsigned zswap_stores;		/* pages kept in the pool */
+static unsigned zswap_loads;		/* faults served from the pool */
+static unsigned zswap_rejects;		/* did not compress enough */
+static unsigned zswap_spills;		/* pool full */
+static unsigned zswap_ratios[2];
+
+static
+uint32_t
+lz_read32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static
+unsigned
+lz_hash(uint32_t seq)
+{
+	return (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+ * Append LEN in the token's extra length bytes; LEN is what is left
+ * over after the 15 in the token.
+ */
+static
+size_t
+lz_putlen(unsigned char *dst, size_t op, size_t len)
+{
+	while (len >= 255) {
+		dst[op++] = 255;
+		len -= 255;
+	}
+	dst[op++] = len;
+	return op;
+}
+
+/*
+ * Append one sequence; a zero MLEN makes it the last. Returns the
+ * new output length, or 0 if it would not fit in MAX bytes.
+ */
+static
+size_t
+lz_emit(unsigned char *dst, size_t op, size_t max,
+	const unsigned char *lit, size_t litlen, size_t offset, size_t mlen)
+{
+	size_t mcode = mlen > 0 ? mlen - LZ_MINMATCH : 0;
+
+	/* Worst case, so the writes below need no checks. */
+	if (op + 1 + litlen / 255 + 1 + litlen + 2 + mcode / 255 + 1 > max) {
+		return 0;
+	}
+
+	dst[op++] = ((litlen < 15 ? litlen : 15) << 4) |
+		(mcode < 15 ? mcode : 15);
+	if (litlen >= 15) {
+		op = lz_putlen(dst, op, litlen - 15);
+	}
+	memcpy(dst + op, lit, litlen);
+	op += litlen;
+
+	if (mlen == 0) {
+		return op;
+	}
+	dst[op++] = offset & 0xff;
+	dst[op++] = offset >> 8;
+	if (mcode >= 15) {
+		op = lz_putlen(dst, op, mcode - 15);
+	}
+	return op;
+}
+
+/*
+ * Compress N bytes at SRC into at most MAX bytes at DST. Returns the
+ * compressed length, or 0 if it does not fit. Stale hash table
+ * entries left over from other pages are harmless: every candidate
+ * match is checked against the data.
+ */
+static
+size_t
+lz_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t max)
+{
+	size_t ip = 0, anchor = 0, op = 0;
+	size_t ref, mlen;
+	uint32_t seq;
+	unsigned h;
+
+	while (ip + LZ_MINMATCH <= n) {
+		seq = lz_read32(src + ip);
+		h = lz_hash(seq);
+		ref = lz_table[h];
+		lz_table[h] = ip;
+		if (ref >= ip || lz_read32(src + ref) != seq) {
+			ip++;
+			continue;
+		}
+
+		mlen = LZ_MINMATCH;
+		while (ip + mlen < n && src[ref + mlen] == src[ip + mlen]) {
+			mlen++;
+		}
+		op = lz_emit(dst, op, max, src + anchor, ip - anchor,
+			     ip - ref, mlen);
+		if (op == 0) {
+			return 0;
+		}
+		ip += mlen;
+		anchor = ip;
+	}
+
+	return lz_emit(dst, op, max, src + anchor, n - anchor, 0, 0);
+}
+
+static
+size_t
+lz_getlen(const unsigned char *src, size_t *ip, size_t len)
+{
+	unsigned char b;
+
+	do {
+		b = src[(*ip)++];
+		len += b;
+	} while (b == 255);
+	return len;
+}
+
+/*
+ * Uncompress LEN bytes at SRC, which must be lz_compress output, into
+ * the N bytes at DST. Matches may overlap what they produce (a run of
+ * one byte is a match at offset 1), so they are copied a byte at a time.
+ */
+static
+void
+lz_decompress(const unsigned char *src, size_t len, unsigned char *dst,
+	      size_t n)
+{
+	size_t ip = 0, op = 0;
+	size_t lit, offset, mlen;
+	unsigned char token;
+
+	while (true) {
+		token = src[ip++];
+		lit = token >> 4;
+		if (lit == 15) {
+			lit = lz_getlen(src, &ip, lit);
+		}
+		KASSERT(ip + lit <= len && op + lit <= n);
+		memcpy(dst + op, src + ip, lit);
+		ip += lit;
+		op += lit;
+		if (ip == len) {
+			break;
+		}
+
+		offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		mlen = token & 15;
+		if (mlen == 15) {
+			mlen = lz_getlen(src, &ip, mlen);
+		}
+		mlen += LZ_MINMATCH;
+		KASSERT(offset > 0 && offset <= op && op + mlen <= n);
+		while (mlen-- > 0) {
+			dst[op] = dst[op - offset];
+			op++;
+		}
+	}
+	KASSERT(op == n);
+}
+
+void
+zswap_bootstrap(unsigned nslots)
+{
+	struct frame_stats fs;
+
+	lz_lock = lock_create("zswap");
+	if (lz_lock == NULL) {
+		kprintf("zswap: out of memory; not compressing swap\n");
+		return;
+	}
+	zswap_pages = kmalloc(nslots * sizeof(zswap_pages[0]));
+	if (zswap_pages == NULL) {
+		kprintf("zswap: out of memory; not compressing swap\n");
+		lock_destroy(lz_lock);
+		lz_lock = NULL;
+		return;
+	}
+	bzero(zswap_pages, nslots * sizeof(zswap_pages[0]));
+	zswap_nslots = nslots;
+
+	frame_table_getstats(&fs);
+	zswap_limit = (size_t)(fs.fs_free + fs.fs_used + fs.fs_cached +
+			       fs.fs_zeroed) * PAGE_SIZE / ZSWAP_POOL_DIV;
+	kprintf("zswap: up to %u KB of compressed pages\n",
+		(unsigned)(zswap_limit / 1024));
+}
+
+bool
+zswap_store(unsigned slot, vaddr_t kpage)
+{
+	struct zpage *zp;
+	size_t len, size;
+
+	if (zswap_pages == NULL) {
+		return false;
+	}
+	KASSERT(slot < zswap_nslots);
+
+	lock_acquire(lz_lock);
+
+	len = lz_compress((const unsigned char *)kpage, PAGE_SIZE,
+			  lz_buf, sizeof(lz_buf));
+	if (len == 0) {
+		zswap_rejects++;
+		goto fail;
+	}
+	/* Only drops run concurrently, so this can only get better. */
+	size = kmalloc_blocksize(sizeof(*zp) + len);
+	if (zswap_bytes + size > zswap_limit) {
+		zswap_spills++;
+		goto fail;
+	}
+
+	/* This does not recurse into the pager; see vm_evict_page. */
+	zp = kmalloc(sizeof(*zp) + len);
+	if (zp == NULL) {
+		zswap_spills++;
+		goto fail;
+	}
+	zp->zp_len = len;
+	memcpy(zp->zp_data, lz_buf, len);
+
+	spinlock_acquire(&zswap_lock);
+	KASSERT(zswap_pages[slot] == NULL);
+	zswap_pages[slot] = zp;
+	zswap_npages++;
+	zswap_bytes += size;
+	spinlock_release(&zswap_lock);
+
+	zswap_stores++;
+	zswap_ratios[(len - 1) * 4 / PAGE_SIZE]++;
+	lock_release(lz_lock);
+	return true;
+
+ fail:
+	lock_release(lz_lock);
+	return false;
+}
+
+/*
+ * The caller holds a reference to SLOT, so its page cannot be dropped
+ * while it is being uncompressed.
+ */
+bool
+zswap_load(unsigned slot, vaddr_t kpage)
+{
+	struct zpage *zp;
+
+	if (zswap_pages == NULL) {
+		return false;
+	}
+	KASSERT(slot < zswap_nslots);
+
+	spinlock_acquire(&zswap_lock);
+	zp = zswap_pages[slot];
+	if (zp != NULL) {
+		zswap_loads++;
+	}
+	spinlock_release(&zswap_lock);
+	if (zp == NULL) {
+		return false;
+	}
+
+	lz_decompress(zp->zp_data, zp->zp_len, (unsigned char *)kpage,
+		      PAGE_SIZE);
+	return true;
+}
+
+bool
+zswap_contains(unsigned slot)
+{
+	return zswap_pages != NULL && zswap_pages[slot] != NULL;
+}
+
+void
+zswap_drop(unsigned slot)
+{
+	struct zpage *zp;
+
+	if (zswap_pages == NULL) {
+		return;
+	}
+	KASSERT(slot < zswap_nslots);
+
+	spinlock_acquire(&zswap_lock);
+	zp = zswap_pages[slot];
+	if (zp != NULL) {
+		zswap_pages[slot] = NULL;
+		zswap_npages--;
+		zswap_bytes -= kmalloc_blocksize(sizeof(*zp) + zp->zp_len);
+	}
+	spinlock_release(&zswap_lock);
+
+	if (zp != NULL) {
+		kfree(zp);
+	}
+}
+
+size_t
+zswap_poolsize(void)
+{
+	return zswap_bytes;
+}
+
+void
+zswap_printstats(void)
+{
+	if (zswap_pages == NULL) {
+		return;
+	}
+	kprintf("Compressed swap: %u pages in %u/%u KB (%u%% of original); "
+		"%u stored, %u loaded, %u incompressible, %u spilled\n",
+		zswap_npages, (unsigned)(zswap_bytes / 1024),
+		(unsigned)(zswap_limit / 1024),
+		zswap_npages ?
+		(unsigned)(zswap_bytes * 100 / (zswap_npages * PAGE_SIZE)) : 0,
+		zswap_stores, zswap_loads, zswap_rejects, zswap_spills);
+	kprintf("Compressed sizes: %u up to 1/4 page, %u up to 1/2\n",
+		zswap_ratios[0], zswap_ratios[1]);
+}
@@ -0,0 +1,27 @@
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+#include <sys/types.h>
+
+/*
+ * Get the PROT_ and MAP_ #defines from the kernel
+ */
+#include <kern/mman.h>
+
+/* Returned by mmap on failure */
+#define MAP_FAILED ((void *)-1)
+
+/*
+ * mmap maps LEN bytes of the open file FD, starting at OFFSET (which
+ * must be a multiple of the page size), somewhere in the address
+ * space, and returns where. The ADDR hint is ignored. munmap must be
+ * passed exactly the address and length of a mapping; pages written
+ * through a MAP_SHARED mapping are written back to the file then.
+ * msync writes them back without unmapping; the range must be inside
+ * one mapping.
+ */
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int munmap(void *addr, size_t len);
+int msync(void *addr, size_t len, int flags);
+
+#endif /* _SYS_MMAN_H_ */